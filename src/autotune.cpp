@@ -0,0 +1,123 @@
+#include "autotune.h"
+
+#include <algorithm>
+#include <atomic>
+
+#define AUTOTUNE_LOAD_HIGH	0.85 /* Of the frame period */
+#define AUTOTUNE_LOAD_LOW	0.55
+#define AUTOTUNE_EWMA_ALPHA	0.1
+#define AUTOTUNE_HOLD_FRAMES	5 /* After a step down, let the load settle */
+#define AUTOTUNE_DWELL_FRAMES	60 /* Quiet frames before a step up */
+#define AUTOTUNE_DWELL_MAX	1800
+
+/* Level 0 are the estimator defaults (RANSAC_NITER, RANSAC_WORKERS) */
+static const autotune_knobs_t m_levels[] = {
+	/* niter, workers, stride, sad_gate */
+	{ 20, 3, 1, 0.0 },
+	{ 20, 3, 1, 2.0 },
+	{ 20, 2, 1, 1.5 },
+	{ 15, 2, 2, 1.5 },
+	{ 10, 2, 2, 1.2 },
+	{ 10, 1, 3, 1.2 },
+	{ 6, 1, 4, 1.0 },
+};
+
+#define AUTOTUNE_LEVELS	((int)(sizeof(m_levels) / sizeof(m_levels[0])))
+
+static bool m_enabled;
+static suseconds_t m_frame_delay;
+static std::atomic<int> m_level;
+
+/* Controller state, only touched by autotune_update(): */
+static double m_load; /* EWMA of t_busy / m_frame_delay */
+static int m_quiet; /* Frames below AUTOTUNE_LOAD_LOW */
+static int m_hold;
+static int m_dwell;
+static int m_since_up; /* Frames since the last step up, -1: none */
+
+static void set_level(int level)
+{
+	DBG("autotune: level " << m_level << " -> " << level << " (load " << m_load << ")");
+
+	m_level.store(level, std::memory_order_relaxed);
+	m_quiet = 0;
+}
+
+void autotune_init(suseconds_t frame_delay)
+{
+	m_frame_delay = frame_delay;
+	m_load = 0;
+	m_quiet = 0;
+	m_hold = 0;
+	m_dwell = AUTOTUNE_DWELL_FRAMES;
+	m_since_up = -1;
+	m_level.store(0);
+	m_enabled = (frame_delay > 0);
+}
+
+bool autotune_enabled(void)
+{
+	return m_enabled;
+}
+
+void autotune_update(suseconds_t t_busy, int dropped)
+{
+	if (!m_enabled)
+		return;
+
+	double load = (double)t_busy / m_frame_delay;
+	m_load += AUTOTUNE_EWMA_ALPHA * (load - m_load);
+
+	int level = m_level.load(std::memory_order_relaxed);
+
+	if (m_since_up >= 0)
+		m_since_up++;
+
+	if (m_hold > 0)
+		m_hold--;
+
+	/* Too slow: a drop or a single frame over the period reacts at once,
+	   a creeping load through the average */
+	if (dropped > 0 || load >= 1.0 || m_load > AUTOTUNE_LOAD_HIGH) {
+		if (m_hold == 0 && level < AUTOTUNE_LEVELS-1) {
+			/* The last step up was too optimistic, wait longer */
+			if (m_since_up >= 0 && m_since_up < m_dwell)
+				m_dwell = std::min(2 * m_dwell, AUTOTUNE_DWELL_MAX);
+			m_since_up = -1;
+
+			/* Way over: skip a level */
+			int step = (load >= 1.5) ? 2 : 1;
+			set_level(std::min(level + step, AUTOTUNE_LEVELS-1));
+			m_hold = AUTOTUNE_HOLD_FRAMES;
+			m_load = load; /* Start over at the new level */
+		}
+		m_quiet = 0;
+		return;
+	}
+
+	if (m_load < AUTOTUNE_LOAD_LOW)
+		m_quiet++;
+	else
+		m_quiet = 0;
+
+	if (m_quiet >= m_dwell && level > 0) {
+		set_level(level - 1);
+		m_since_up = 0;
+	}
+
+	/* Long stable stretch: forget earlier failed steps up */
+	if (m_since_up > AUTOTUNE_DWELL_MAX) {
+		m_dwell = AUTOTUNE_DWELL_FRAMES;
+		m_since_up = -1;
+	}
+}
+
+int autotune_level(void)
+{
+	return m_level.load(std::memory_order_relaxed);
+}
+
+void autotune_get(autotune_knobs_t *p_knobs)
+{
+	*p_knobs = m_levels[autotune_level()];
+}
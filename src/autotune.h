@@ -0,0 +1,34 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include "common.h"
+
+/*
+ * Keeps the frame processing within the frame period by trading accuracy for
+ * time. Effort levels go from the estimator defaults (level 0) to the
+ * cheapest settings that still give a usable estimate. The controller steps
+ * down as soon as a frame takes too long or is dropped, and steps back up
+ * only after a quiet dwell period. The dwell doubles every time a step up
+ * has to be taken back soon after.
+ */
+
+typedef struct {
+	int ransac_niter; /* RANSAC hypotheses per worker */
+	int workers; /* RANSAC hypothesis sets */
+	int stride; /* Every stride-th block, see motion_sampling_t */
+	double sad_gate; /* Drop vectors above sad_gate * average SAD, 0: off */
+} autotune_knobs_t;
+
+/* frame_delay: period the processing has to keep up with [us] */
+void autotune_init(suseconds_t frame_delay);
+bool autotune_enabled(void);
+
+/* Feeds one frame: its processing time (of the slowest stage, when
+   pipelined) [us] and the number of frames dropped since the last call */
+void autotune_update(suseconds_t t_busy, int dropped);
+
+/* Lock-free, safe from any stage */
+int autotune_level(void);
+void autotune_get(autotune_knobs_t *p_knobs);
+
+#endif
@@ -17,23 +17,39 @@ typedef struct {
 	double avg_y;
 } cv_imv_stats_t;
 
+/* Per block: what the motion estimate made of its vector */
+#define CV_IMV_BLOCK_UNUSED	0 /* Zero, gated, masked or not sampled */
+#define CV_IMV_BLOCK_OUTLIER	1
+#define CV_IMV_BLOCK_INLIER	2
+
 class cv_imv
 {
 	cv_imv_t *m_imv = NULL;
+	bool m_owned = true; /* False for a view into someone else's buffer */
 	size_t m_size;
 	int m_mbx;
 	int m_mby;
-	unsigned long m_timestamp;
+	int64_t m_timestamp; /* [us], microseconds_monotonic() time */
+	int64_t m_queued = 0; /* [us], when handed to the frame thread */
 
 public:
-	cv_imv(uint8_t *p_buffer, int mbx, int mby, unsigned long timestamp)
+	/* With copy == false, the vectors are used in place and p_buffer must
+	   outlive the object (e.g. a memory-mapped log) */
+	cv_imv(uint8_t *p_buffer, int mbx, int mby, int64_t timestamp,
+	       bool copy = true)
 	{
 		m_mbx = mbx;
 		m_mby = mby;
 		m_size = (m_mbx+1) * (m_mby);
 		m_timestamp = timestamp;
-		m_imv = new cv_imv_t[m_size];
-		memcpy(m_imv, p_buffer, m_size * sizeof(cv_imv_t));
+		m_owned = copy;
+
+		if (copy) {
+			m_imv = new cv_imv_t[m_size];
+			memcpy(m_imv, p_buffer, m_size * sizeof(cv_imv_t));
+		} else {
+			m_imv = (cv_imv_t *)p_buffer;
+		}
 	}
 
 	cv_imv(cv_imv const& copy)
@@ -42,10 +58,21 @@ public:
 		m_size = copy.m_size;
 		m_mbx = copy.m_mbx;
 		m_mby = copy.m_mby;
+		m_timestamp = copy.m_timestamp;
+		m_queued = copy.m_queued;
 		m_imv = new cv_imv_t[m_size];
 		std::copy(&copy.m_imv[0], &copy.m_imv[copy.m_size], m_imv);
 	}
 
+	cv_imv(cv_imv&& other) noexcept
+	{
+		m_size = 0;
+		m_mbx = 0;
+		m_mby = 0;
+		m_timestamp = 0;
+		other.swap(*this);
+	}
+
 	cv_imv& operator=(cv_imv rhs)
 	{
 		rhs.swap(*this);
@@ -55,15 +82,18 @@ public:
 	void swap(cv_imv& s) noexcept
 	{
 		std::swap(m_imv, s.m_imv);
+		std::swap(m_owned, s.m_owned);
 		std::swap(m_size, s.m_size);
 		std::swap(m_mbx, s.m_mbx);
 		std::swap(m_mby, s.m_mby);
 		std::swap(m_timestamp, s.m_timestamp);
+		std::swap(m_queued, s.m_queued);
 	}
 
 	~cv_imv()
 	{
-		delete [] m_imv;
+		if (m_owned)
+			delete [] m_imv;
 	}
 
 	cv_imv_stats_t stats()
@@ -139,11 +169,21 @@ public:
 		return m_imv;
 	}
 
-	unsigned long timestamp()
+	int64_t timestamp()
 	{
 		return m_timestamp;
 	}
 
+	int64_t queued()
+	{
+		return m_queued;
+	}
+
+	void set_queued(int64_t t)
+	{
+		m_queued = t;
+	}
+
 	int mbx()
 	{
 		return m_mbx;
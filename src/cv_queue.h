@@ -11,26 +11,45 @@ class cv_queue
 {
 	/* Inspired by http://vichargrave.com/multithreaded-work-queue-in-c */
 public:
-	cv_queue()
+	/* With a capacity, add() waits while the queue is full */
+	cv_queue(size_t capacity = 0)
 	{
+		m_capacity = capacity;
 		pthread_mutex_init(&m_mutex, NULL);
 		pthread_cond_init(&m_condv, NULL);
+		pthread_cond_init(&m_condv_full, NULL);
 	}
 
 	~cv_queue()
 	{
 		pthread_mutex_destroy(&m_mutex);
 		pthread_cond_destroy(&m_condv);
+		pthread_cond_destroy(&m_condv_full);
 	}
 
 	void add(T item)
 	{
 		pthread_mutex_lock(&m_mutex);
+		while (m_capacity > 0 && m_queue.size() >= m_capacity)
+			pthread_cond_wait(&m_condv_full, &m_mutex);
 		m_queue.push_back(item);
 		pthread_cond_signal(&m_condv);
 		pthread_mutex_unlock(&m_mutex);
 	}
 
+	/* Does not wait, false if the queue is full */
+	bool try_add(T item)
+	{
+		pthread_mutex_lock(&m_mutex);
+		bool room = m_capacity == 0 || m_queue.size() < m_capacity;
+		if (room) {
+			m_queue.push_back(item);
+			pthread_cond_signal(&m_condv);
+		}
+		pthread_mutex_unlock(&m_mutex);
+		return room;
+	}
+
 	T remove()
 	{
 		pthread_mutex_lock(&m_mutex);
@@ -38,10 +57,25 @@ public:
 			pthread_cond_wait(&m_condv, &m_mutex);
 		T item = m_queue.front();
 		m_queue.pop_front();
+		pthread_cond_signal(&m_condv_full);
 		pthread_mutex_unlock(&m_mutex);
 		return item;
 	}
 
+	/* Does not wait, false if the queue is empty */
+	bool try_remove(T *p_item)
+	{
+		pthread_mutex_lock(&m_mutex);
+		bool found = m_queue.size() > 0;
+		if (found) {
+			*p_item = m_queue.front();
+			m_queue.pop_front();
+			pthread_cond_signal(&m_condv_full);
+		}
+		pthread_mutex_unlock(&m_mutex);
+		return found;
+	}
+
 	int size()
 	{
 		pthread_mutex_lock(&m_mutex);
@@ -52,8 +86,10 @@ public:
 
 private:
 	list<T> m_queue;
+	size_t m_capacity; /* 0: unbounded */
 	pthread_mutex_t m_mutex;
 	pthread_cond_t m_condv;
+	pthread_cond_t m_condv_full;
 };
 
 #endif
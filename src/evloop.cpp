@@ -0,0 +1,229 @@
+#include "evloop.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "rtsched.h"
+#include "trace.h"
+
+#define EVLOOP_MAX_HANDLERS	8
+#define EVLOOP_MAX_EVENTS	8
+
+typedef struct {
+	int fd;
+	bool is_timer;
+	evloop_cb_t cb;
+	void *p_arg;
+	unsigned long missed; /* Timer expirations handled late */
+} evloop_handler_t;
+
+static bool m_initialized;
+static volatile bool m_run;
+static pthread_t m_thread;
+static pthread_mutex_t m_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int m_epoll_fd = -1;
+static int m_wake_fd = -1;
+
+static evloop_handler_t m_handlers[EVLOOP_MAX_HANDLERS];
+static int m_handler_count;
+
+static void *evloop_thread(void *ptr)
+{
+	struct epoll_event events[EVLOOP_MAX_EVENTS];
+
+	rtsched_thread(RTSCHED_ROLE_SENSORS, "evloop");
+	trace_thread_name("evloop");
+
+	while (m_run) {
+		int n = epoll_wait(m_epoll_fd, events, EVLOOP_MAX_EVENTS, -1);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			ERR("evloop_thread(): epoll_wait failed: " << errno);
+			break;
+		}
+
+		for (int i = 0; i < n; i++) {
+			evloop_handler_t *p_handler = (evloop_handler_t *)events[i].data.ptr;
+
+			/* Wake-up from evloop_stop() */
+			if (p_handler == NULL)
+				continue;
+
+			if (p_handler->is_timer) {
+				uint64_t expirations;
+				if (read(p_handler->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+					continue;
+
+				if (expirations > 1)
+					p_handler->missed += expirations-1;
+			}
+
+			/* Data left before a hangup is still read */
+			if (events[i].events & EPOLLIN)
+				p_handler->cb(p_handler->p_arg);
+
+			/* Would be reported on every wait from now on, and with
+			   nothing to read the loop would spin */
+			if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+				epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, p_handler->fd, NULL);
+				ERR("evloop_thread(): fd " << p_handler->fd <<
+				    ((events[i].events & EPOLLERR) ? " failed" :
+				     " hung up") << ", no longer polled");
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static bool evloop_add(int fd, bool is_timer, evloop_cb_t cb, void *p_arg)
+{
+	if (!m_initialized)
+		return false;
+
+	pthread_mutex_lock(&m_mutex);
+
+	if (m_handler_count == EVLOOP_MAX_HANDLERS) {
+		pthread_mutex_unlock(&m_mutex);
+		ERR("evloop_add(): Too many handlers");
+		return false;
+	}
+
+	evloop_handler_t *p_handler = &m_handlers[m_handler_count++];
+	p_handler->fd = fd;
+	p_handler->is_timer = is_timer;
+	p_handler->cb = cb;
+	p_handler->p_arg = p_arg;
+	p_handler->missed = 0;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = p_handler;
+
+	/* Still locked, so the slot is the last one and can be given back */
+	if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		int err = errno;
+		m_handler_count--;
+		pthread_mutex_unlock(&m_mutex);
+		ERR("evloop_add(): epoll_ctl failed: " << err);
+		return false;
+	}
+
+	pthread_mutex_unlock(&m_mutex);
+
+	return true;
+}
+
+bool evloop_init(void)
+{
+	DBG("evloop_init()");
+
+	if (m_initialized)
+		return true;
+
+	m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (m_epoll_fd == -1) {
+		ERR("evloop_init(): epoll_create1 failed: " << errno);
+		return false;
+	}
+
+	m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (m_wake_fd == -1) {
+		ERR("evloop_init(): eventfd failed: " << errno);
+		return false;
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wake_fd, &ev);
+
+	m_initialized = true;
+
+	return true;
+}
+
+bool evloop_start(void)
+{
+	if (!m_initialized)
+		return false;
+
+	DBG("evloop_start()");
+
+	m_run = true;
+
+	int rc = pthread_create(&m_thread, NULL, evloop_thread, NULL);
+	if (rc) {
+		ERR("Unable to create event loop thread: " << rc);
+		m_run = false;
+		return false;
+	}
+
+	return true;
+}
+
+void evloop_stop(void)
+{
+	if (!m_initialized || !m_run)
+		return;
+
+	DBG("evloop_stop()");
+
+	m_run = false;
+
+	uint64_t one = 1;
+	if (write(m_wake_fd, &one, sizeof(one)) == sizeof(one))
+		pthread_join(m_thread, NULL);
+
+	for (int i = 0; i < m_handler_count; i++) {
+		if (m_handlers[i].is_timer) {
+			DBG("evloop_stop(): timer " << i << " missed " <<
+			    m_handlers[i].missed << " periods");
+			close(m_handlers[i].fd);
+		}
+	}
+}
+
+bool evloop_add_timer(unsigned long period_us, evloop_cb_t cb, void *p_arg)
+{
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1) {
+		ERR("evloop_add_timer(): timerfd_create failed: " << errno);
+		return false;
+	}
+
+	/* Periodic in kernel, so the sampling grid does not drift with the
+	   time spent in the callbacks */
+	struct itimerspec its;
+	its.it_interval.tv_sec = period_us / 1000000UL;
+	its.it_interval.tv_nsec = (period_us % 1000000UL) * 1000UL;
+	its.it_value = its.it_interval;
+
+	if (timerfd_settime(fd, 0, &its, NULL) == -1) {
+		ERR("evloop_add_timer(): timerfd_settime failed: " << errno);
+		close(fd);
+		return false;
+	}
+
+	if (!evloop_add(fd, true, cb, p_arg)) {
+		close(fd);
+		return false;
+	}
+
+	return true;
+}
+
+bool evloop_add_fd(int fd, evloop_cb_t cb, void *p_arg)
+{
+	return evloop_add(fd, false, cb, p_arg);
+}
@@ -0,0 +1,18 @@
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include "common.h"
+
+/* Single epoll thread servicing periodic timers (timerfd) and readable file
+   descriptors. Callbacks run on the loop thread and must not block. */
+
+typedef void (*evloop_cb_t)(void *p_arg);
+
+bool evloop_init(void);
+bool evloop_start(void);
+void evloop_stop(void);
+
+bool evloop_add_timer(unsigned long period_us, evloop_cb_t cb, void *p_arg);
+bool evloop_add_fd(int fd, evloop_cb_t cb, void *p_arg);
+
+#endif
@@ -5,26 +5,40 @@
 #include <unistd.h>
 #include <iostream>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <atomic>
+#include <sys/signalfd.h>
 
 #include <opencv2/core/utility.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/optflow.hpp>
 
+#include "autotune.h"
 #include "cv.h"
 #include "cv_queue.h"
 #include "cv_img.h"
 #include "cv_imv.h"
 #include "gui.h"
+#include "latency.h"
 #include "draw.h"
+#include "evloop.h"
+#include "flowshm.h"
 #include "motion.h"
 #include "sensors.h"
 #include "mavlog.h"
+#include "recorder.h"
+#include "rtsched.h"
+#include "trace.h"
 #include "transform.h"
 #include "raspividcv.h"
 
 #define CONFIG_ENABLE_SONAR	true
 
+/* Allowed creep of the PTS-to-monotonic offset estimate per frame [us] */
+#define PTS_OFFSET_DRIFT_US	1
+
 using namespace cv;
 using namespace std;
 using namespace cv::optflow;
@@ -43,93 +57,409 @@ static cv_queue<cv_img*> m_img_queue;
 static cv_queue<cv_imv*> m_imv_queue;
 
 static bool m_use_gui;
+static bool m_simulate_sensors;
+static const char *m_rec_path;
+static const char *m_shm_path; /* NULL: no shared-memory ring */
+static bool m_rtsched;
 
 static suseconds_t m_frame_delay;
 
-static void algo_imv(int sad_limit)
-{
-	int cnt = 0;
-	unsigned long frame = 0;
-	unsigned long skipped_frames = 0;
-	suseconds_t t1, t2, t, prev_t;
+#define PIPELINE_STAGES		4
+
+/* One frame on its way through the processing stages */
+typedef struct {
+	unsigned long frame;
+	cv_imv *imv;
+	cv_img *img; /* NULL without GUI */
+	int sad_limit;
+	cv_imv_stats_t stats;
+	motion_points_t points;
+	int prefilter_checked;
+	int prefilter_rejected;
 	motion_t motion;
-	sensors_data_t sensors;
-
-	motion_init();
-	mavlog_init();
-	mavlog_start();
+	suseconds_t t_start; /* Taken from the IMV queue */
+	suseconds_t t_busy_sum; /* Time spent in the stages [us] */
+	suseconds_t t_busy_max; /* In the slowest stage [us] */
+} frame_job_t;
+
+static int m_pipeline_depth; /* 0: not pipelined */
+static cv_queue<frame_job_t *> *m_stage_queues[PIPELINE_STAGES-1];
+static const char *m_stage_names[PIPELINE_STAGES] = {
+	"process", "correct", "estimate", "publish"
+};
+
+static motion_state_t m_motion_state;
+static motion_sampling_t m_sampling; /* Before autotune */
+static motion_prefilter_t m_prefilter; /* Used by the prepare stage only */
+static unsigned long m_prefilter_checked;
+static unsigned long m_prefilter_rejected;
+static const char *m_mask_path;
+static vector<uint8_t> m_mask;
+static atomic<unsigned long> m_skipped_frames;
+
+static int64_t m_pts_offset; /* microseconds_monotonic() - PTS [us] */
+static int m_signal_fd = -1; /* SIGUSR1: dump latency histograms */
+
+#define AUTOTUNE_TELEMETRY_US	1000000
+
+static void job_busy(frame_job_t *p_job, suseconds_t t_stage_start)
+{
+	suseconds_t t = microseconds() - t_stage_start;
 
-	while (1) {
-		cv_img *img;
+	p_job->t_busy_sum += t;
+	if (t > p_job->t_busy_max)
+		p_job->t_busy_max = t;
+}
 
+/* Drops the oldest frames waiting for the pipeline */
+static void skip_frames(int count)
+{
+	while (count-- > 0) {
 		if (m_use_gui)
-			img = m_img_queue.remove();
-		cv_imv *imv = m_imv_queue.remove();
+			delete m_img_queue.remove();
+		delete m_imv_queue.remove();
+		m_skipped_frames++;
+	}
+}
 
-		t1 = microseconds();
+/* Frame processing as a pipeline: prepare (statistics and point extraction)
+   -> correct (undistortion and gyro compensation) -> estimate -> publish
+   (MAVLink, recorder, GUI). With a depth of 0 the stages run in turn on the
+   process thread. Otherwise every stage has its own thread, pinned to its
+   own core, and passes frames on through a queue of that many entries, so
+   the next frame is prepared while the current one is estimated. */
+static frame_job_t *stage_prepare(unsigned long frame)
+{
+	frame_job_t *p_job = new frame_job_t;
 
-		cv_imv_stats_t stats = imv->stats();
-		sad_limit = stats.avg_sad;
+	p_job->frame = frame;
+	p_job->img = NULL;
 
-		DBG("sad_limit = " << sad_limit);
+	if (m_use_gui)
+		p_job->img = m_img_queue.remove();
+	{
+		TRACE_SCOPE("queue wait");
+		p_job->imv = m_imv_queue.remove();
+	}
 
-		motion_calc_from_imv(*imv, &motion, sad_limit);
-		sensors_read(&sensors);
+	TRACE_SCOPE("prepare", frame);
 
-		if (m_use_gui && cnt++ == 10) {
-			draw_prepare(*img);
-			draw_imv(*imv, sad_limit);
-			gui_display(draw_get_image());
-			cnt = 0;
-		}
+	p_job->t_start = microseconds();
+	p_job->t_busy_sum = 0;
+	p_job->t_busy_max = 0;
+	int64_t ts = microseconds_monotonic();
+	latency_record(LATENCY_QUEUE_WAIT, ts - p_job->imv->queued());
 
-		motion.dx = stats.avg_x;
-		motion.dy = stats.avg_y;
+	{
+		TRACE_SCOPE("stats");
+		p_job->stats = p_job->imv->stats();
+	}
+	p_job->sad_limit = p_job->stats.avg_sad;
+	latency_record(LATENCY_STATS, microseconds_monotonic() - ts);
 
-		mavlog_send_motion((microseconds()-t1), &motion);
+	DBG("sad_limit = " << p_job->sad_limit);
 
-		if (m_use_gui)
-			waitKey(1);
+	motion_sampling_t sampling = m_sampling;
 
-		if (m_use_gui)
-			delete img;
-		delete imv;
+	if (autotune_enabled()) {
+		autotune_knobs_t knobs;
+
+		autotune_get(&knobs);
+		sampling.stride = knobs.stride;
+		sampling.sad_max = (int)(knobs.sad_gate * p_job->sad_limit);
+	}
+
+	motion_prepare(*p_job->imv, p_job->sad_limit, &sampling, &p_job->points);
+
+	/* Handed on, m_prefilter is overwritten by the next frame */
+	p_job->prefilter_checked = m_prefilter.checked;
+	p_job->prefilter_rejected = m_prefilter.rejected;
+
+	job_busy(p_job, p_job->t_start);
+
+	return p_job;
+}
+
+static void stage_correct(frame_job_t *p_job)
+{
+	TRACE_SCOPE("correct", p_job->frame);
+	suseconds_t t = microseconds();
+
+	motion_correct(&m_motion_state, &p_job->points);
+
+	job_busy(p_job, t);
+}
+
+static void stage_estimate(frame_job_t *p_job)
+{
+	TRACE_SCOPE("estimate", p_job->frame);
+	suseconds_t t = microseconds();
+
+	/* The RANSAC parameters are only read by this stage */
+	if (autotune_enabled()) {
+		autotune_knobs_t knobs;
+		transform_params_t params;
+
+		autotune_get(&knobs);
+		transform_get_params(&params);
+		params.ransac_niter = knobs.ransac_niter;
+		transform_set_params(&params);
+		m_motion_state.transform.workers = knobs.workers;
+	}
+
+	motion_estimate(&m_motion_state, &p_job->points, &p_job->motion);
+
+	p_job->motion.dx = p_job->stats.avg_x;
+	p_job->motion.dy = p_job->stats.avg_y;
+
+	job_busy(p_job, t);
+}
+
+/* Effort knobs as NAMED_VALUE_INT telemetry (sad_gate in percent) */
+static void autotune_telemetry(void)
+{
+	static suseconds_t t_last;
+	suseconds_t t = microseconds();
+	autotune_knobs_t knobs;
+
+	if (t - t_last < AUTOTUNE_TELEMETRY_US)
+		return;
+	t_last = t;
+
+	autotune_get(&knobs);
+	mavlog_send_named_int("at_level", autotune_level());
+	mavlog_send_named_int("at_niter", knobs.ransac_niter);
+	mavlog_send_named_int("at_workers", knobs.workers);
+	mavlog_send_named_int("at_stride", knobs.stride);
+	mavlog_send_named_int("at_sadgate", (int32_t)(knobs.sad_gate * 100));
+}
+
+/* Vectors, inlier mask and motion of the frame into the shared-memory ring */
+static void shm_publish(frame_job_t *p_job)
+{
+	cv_imv *imv = p_job->imv;
+	cv_imv_t *p_imv;
+	uint8_t *p_blocks;
+
+	flowshm_slot_t *p_slot = flowshm_begin(imv->timestamp(), &p_imv, &p_blocks);
+	if (p_slot == NULL)
+		return;
+
+	TRACE_SCOPE("shm");
+
+	memcpy(p_imv, imv->imv(), (imv->mbx()+1) * imv->mby() * sizeof(cv_imv_t));
+	motion_inlier_mask(&p_job->points, &p_job->motion, imv->mbx(), imv->mby(),
+			   p_blocks);
+
+	const Mat& A = p_job->motion.affine_xform;
+	p_slot->valid = (A.rows == 2 && A.cols == 3);
+	for (int i = 0; i < 6; i++)
+		p_slot->xform[i] = p_slot->valid ? A.at<double>(i/3, i%3) : 0.0;
+	p_slot->dx = p_job->motion.dx;
+	p_slot->dy = p_job->motion.dy;
+	p_slot->vec_in = p_job->motion.res.vec_in;
+	p_slot->vec_good = p_job->motion.res.vec_good;
+
+	flowshm_commit(p_slot);
+}
+
+/* Frees the job, returns the time since it was taken from the queue [us] */
+static suseconds_t stage_publish(frame_job_t *p_job)
+{
+	static int cnt = 0;
+	static unsigned long skipped_seen = 0;
+	sensors_data_t sensors;
+	cv_imv *imv = p_job->imv;
+
+	TRACE_SCOPE("publish", p_job->frame);
+	suseconds_t t_publish = microseconds();
+
+	sensors_read(&sensors);
+
+	if (m_use_gui && cnt++ == 10) {
+		draw_prepare(*p_job->img);
+		draw_imv(*imv, p_job->sad_limit);
+		gui_display(draw_get_image());
+		cnt = 0;
+	}
+
+	mavlog_send_motion(imv->timestamp(), &p_job->motion, &sensors);
+
+	{
+		TRACE_SCOPE("record");
+		recorder_log_imv(*imv);
+		recorder_log_motion(imv->timestamp(), &p_job->motion);
+	}
+
+	shm_publish(p_job);
+
+	if (m_use_gui)
+		waitKey(1);
+
+	job_busy(p_job, t_publish);
+
+	if (autotune_enabled()) {
+		/* Pipelined, throughput is limited by the slowest stage */
+		unsigned long skipped = m_skipped_frames;
+		autotune_update(m_pipeline_depth > 0 ? p_job->t_busy_max :
+				p_job->t_busy_sum, skipped - skipped_seen);
+		skipped_seen = skipped;
+		autotune_telemetry();
+	}
+
+	suseconds_t t = microseconds() - p_job->t_start;
+	unsigned long frame = p_job->frame;
+
+	m_prefilter_checked += p_job->prefilter_checked;
+	m_prefilter_rejected += p_job->prefilter_rejected;
 
-		t2 = microseconds();
-		t = t2-t1;
+	delete p_job->img;
+	delete imv;
+	delete p_job;
 
-		DBG("[algo_imv] " << frame << " Finished, duration: " << t << " us (skipped " << skipped_frames << " frames)");
+	DBG("[algo_imv] " << frame << " Finished, duration: " << t << " us (skipped " << m_skipped_frames << " frames)");
 
 #ifndef DEBUG
-		printf("\rFrame %d (%lu us, %d lost)  ", frame, t, skipped_frames);
-		fflush(stdout);
+	printf("\rFrame %lu (%lu us, %lu lost, effort level %d, %.1f %% prefiltered)  ",
+	       frame, t, (unsigned long)m_skipped_frames, autotune_level(),
+	       m_prefilter_checked > 0 ?
+	       100.0 * m_prefilter_rejected / m_prefilter_checked : 0.0);
+	fflush(stdout);
 #endif
 
-		if (t >= m_frame_delay) {
-			int frames_to_skip = t/m_frame_delay;
-			while (frames_to_skip > 0) {
-				if (m_use_gui)
-					m_img_queue.remove();
-				m_imv_queue.remove();
-				skipped_frames++;
-				frames_to_skip--;
-			}
+	return t;
+}
+
+static void *stage_thread(void *ptr)
+{
+	int stage = (int)(intptr_t)ptr;
+
+	rtsched_thread(RTSCHED_ROLE_FRAME, m_stage_names[stage]);
+	rtsched_pin(stage);
+	trace_thread_name(m_stage_names[stage]);
+
+	while (1) {
+		frame_job_t *p_job = m_stage_queues[stage-1]->remove();
+
+		if (stage == PIPELINE_STAGES-1) {
+			stage_publish(p_job);
+			continue;
 		}
 
-		prev_t = t;
-		frame++;
+		if (stage == 1)
+			stage_correct(p_job);
+		else
+			stage_estimate(p_job);
+
+		m_stage_queues[stage]->add(p_job);
+	}
+
+	return NULL;
+}
+
+static void algo_imv_serial(void)
+{
+	for (unsigned long frame = 0; ; frame++) {
+		frame_job_t *p_job = stage_prepare(frame);
+
+		stage_correct(p_job);
+		stage_estimate(p_job);
+		suseconds_t t = stage_publish(p_job);
+
+		if (t >= m_frame_delay)
+			skip_frames(t/m_frame_delay);
+	}
+}
+
+static void algo_imv_pipelined(void)
+{
+	pthread_t threads[PIPELINE_STAGES];
+
+	for (int i = 0; i < PIPELINE_STAGES-1; i++)
+		m_stage_queues[i] = new cv_queue<frame_job_t *>(m_pipeline_depth);
+
+	for (int i = 1; i < PIPELINE_STAGES; i++) {
+		int rc = pthread_create(&threads[i], NULL, stage_thread,
+					(void *)(intptr_t)i);
+		if (rc) {
+			ERR("Unable to create stage thread: " << rc);
+			return;
+		}
+	}
+
+	/* The first stage runs on the process thread */
+	rtsched_pin(0);
+
+	for (unsigned long frame = 0; ; frame++) {
+		/* When a later stage can't keep up, the queues fill and this
+		   stage waits; drop what piles up behind it meanwhile so that
+		   the latency stays bounded */
+		if (m_imv_queue.size() > m_pipeline_depth)
+			skip_frames(m_imv_queue.size() - m_pipeline_depth);
+
+		m_stage_queues[0]->add(stage_prepare(frame));
 	}
 }
 
 static void *process_thread(void *ptr)
 {
-	int cnt = 0;
 	int sad_limit = 500;
 
 	draw_init(m_img.width, m_img.height);
 	gui_init(m_use_gui, draw_get_colormap(), &sad_limit, 2000);
 
-	algo_imv(sad_limit);
+	rtsched_thread(RTSCHED_ROLE_FRAME, "process");
+	trace_thread_name("process");
+
+	motion_init();
+	motion_state_init(&m_motion_state);
+	mavlog_init();
+	mavlog_start();
+
+	if (m_pipeline_depth > 0)
+		algo_imv_pipelined();
+	else
+		algo_imv_serial();
+
+	return NULL;
+}
+
+/* SIGUSR1 is delivered through a signalfd on the event loop, so the dump
+   does not run in signal context */
+static void latency_signal_handler(void *ptr)
+{
+	struct signalfd_siginfo info;
+
+	while (read(m_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+		latency_dump(stderr);
+		rtsched_dump(stderr);
+		mavlog_dump(stderr);
+	}
+}
+
+/* Called first in main(): threads inherit the mask, so all of them, the
+   RaspiVid/MMAL ones included, leave SIGUSR1 to the signalfd. Blocked, it
+   stays pending even though RaspiVid sets it to SIG_IGN. */
+static bool latency_signal_block(sigset_t *p_mask)
+{
+	sigemptyset(p_mask);
+	sigaddset(p_mask, SIGUSR1);
+
+	return pthread_sigmask(SIG_BLOCK, p_mask, NULL) == 0;
+}
+
+static bool latency_signal_init(void)
+{
+	sigset_t mask;
+
+	if (!latency_signal_block(&mask))
+		return false;
+
+	m_signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (m_signal_fd == -1)
+		return false;
+
+	return evloop_add_fd(m_signal_fd, latency_signal_handler, NULL);
 }
 
 void cv_init(int width, int height, int fps, int fmt)
@@ -165,7 +495,25 @@ void cv_init(int width, int height, int fps, int fmt)
 	m_img.mbx = m_img.width/16;
 	m_img.mby = m_img.height/16;
 
-	sensors_init(CONFIG_ENABLE_SONAR);
+	if (m_rec_path != NULL)
+		recorder_init(m_rec_path, m_img.mbx, m_img.mby);
+
+	if (m_shm_path != NULL && !flowshm_init(m_shm_path, m_img.mbx, m_img.mby))
+		ERR("Continuing without the shared-memory ring");
+
+	if (m_mask_path != NULL) {
+		if (motion_mask_load(m_mask_path, m_img.mbx, m_img.mby, m_mask))
+			m_sampling.p_mask = m_mask.data();
+		else
+			ERR("Continuing without a block mask");
+	}
+
+	latency_init();
+	evloop_init();
+	sensors_init(CONFIG_ENABLE_SONAR, m_simulate_sensors);
+
+	if (!latency_signal_init())
+		ERR("Unable to handle SIGUSR1");
 
 	/* Start thread: */
 	int rc = pthread_create(&m_thread, NULL, process_thread, NULL);
@@ -174,7 +522,10 @@ void cv_init(int width, int height, int fps, int fmt)
 		return;
 	}
 
+	recorder_start();
 	sensors_start();
+	flowshm_start();
+	evloop_start();
 
 	m_initialized = true;
 }
@@ -190,6 +541,8 @@ void cv_process_img(uint8_t *p_buffer, int length, int64_t timestamp)
 	if (!m_initialized)
 		return;
 
+	TRACE_SCOPE("ingest img");
+
 	if (length != m_img.width*m_img.height) {
 		ERR("Wrong img length: " << length);
 		m_initialized = false;
@@ -207,6 +560,28 @@ void cv_process_img(uint8_t *p_buffer, int length, int64_t timestamp)
 	prev_timestamp = timestamp;
 }
 
+/* Converts encoder PTS to microseconds_monotonic() time, in which the gyro
+   samples are stamped. */
+static int64_t frame_time(int64_t pts)
+{
+	int64_t now = microseconds_monotonic();
+
+	/* MMAL_TIME_UNKNOWN */
+	if (pts <= 0)
+		return now;
+
+	/* The callback always comes some time after the capture, so the
+	   smallest offset seen is the best estimate. It is allowed to creep
+	   up slowly to follow drift between the two clocks. */
+	int64_t offset = now - pts;
+	if (m_pts_offset == 0 || offset < m_pts_offset)
+		m_pts_offset = offset;
+	else
+		m_pts_offset += PTS_OFFSET_DRIFT_US;
+
+	return pts + m_pts_offset;
+}
+
 void cv_process_imv(uint8_t *p_buffer, int length, int64_t timestamp)
 {
 	static int64_t prev_timestamp;
@@ -215,6 +590,9 @@ void cv_process_imv(uint8_t *p_buffer, int length, int64_t timestamp)
 	if (!m_initialized)
 		return;
 
+	trace_thread_name("mmal callback");
+	TRACE_SCOPE("ingest imv");
+
 	if (length != (m_img.mbx+1)*(m_img.mby)*sizeof(cv_imv_t)) {
 		ERR("Wrong imv length: " << length);
 		m_initialized = false;
@@ -222,9 +600,11 @@ void cv_process_imv(uint8_t *p_buffer, int length, int64_t timestamp)
 	}
 
 	t1 = microseconds();
-	cv_imv *imv = new cv_imv(p_buffer, m_img.mbx, m_img.mby, t1);
+	cv_imv *imv = new cv_imv(p_buffer, m_img.mbx, m_img.mby, frame_time(timestamp));
+	imv->set_queued(microseconds_monotonic());
 	m_imv_queue.add(imv);
 	t2 = microseconds();
+	latency_record(LATENCY_INGEST, t2-t1);
 
 	DBG("cv_process_imv(p_buffer, " << length << ") [dts " <<
 	    (timestamp-prev_timestamp) << "]: " << (t2-t1) << " us");
@@ -236,8 +616,12 @@ void cv_close(void)
 {
 	DBG("cv_close()");
 	m_initialized = false;
+	evloop_stop();
 	sensors_stop();
+	recorder_stop();
+	flowshm_stop();
 	mavlog_stop();
+	trace_stop();
 }
 
 int main(int argc, const char **argv)
@@ -251,21 +635,112 @@ int main(int argc, const char **argv)
 
 	int rargc = sizeof(rargv) / sizeof(rargv[0]);
 
+	/* Before any thread is started, so that all of them block it: */
+	sigset_t mask;
+	if (!latency_signal_block(&mask))
+		ERR("Unable to block SIGUSR1");
+
+	motion_sampling_init(&m_sampling);
+	motion_prefilter_init(&m_prefilter, 0);
+
 	if (argc >= 2) {
 		rargv[9] = argv[1];
 		int fps = atoi(argv[1]);
 		m_frame_delay = 1000000UL/fps;
 		printf("FPS: %d, delay: %lu us\n", fps, m_frame_delay);
 
-		if (argc == 3) {
-			if (strcmp("gui", argv[2]) == 0)
+		for (int i = 2; i < argc; i++) {
+			if (strcmp("gui", argv[i]) == 0) {
 				m_use_gui = true;
+			} else if (strcmp("sim", argv[i]) == 0) {
+				printf("Using simulated gyro and sonar\n");
+				m_simulate_sensors = true;
+			} else if (strncmp("seed=", argv[i], 5) == 0) {
+				uint64_t seed = strtoull(argv[i]+5, NULL, 0);
+				printf("Deterministic estimator, seed: %llu\n",
+				       (unsigned long long)seed);
+				transform_set_seed(seed);
+			} else if (strncmp("trace=", argv[i], 6) == 0) {
+				printf("Tracing to %s\n", argv[i]+6);
+				trace_init(argv[i]+6);
+			} else if (strncmp("pipeline=", argv[i], 9) == 0) {
+				m_pipeline_depth = atoi(argv[i]+9);
+				printf("Pipelined processing, queue depth: %d\n",
+				       m_pipeline_depth);
+			} else if (strcmp("autotune", argv[i]) == 0) {
+				printf("Scaling estimator effort to hold %lu us\n",
+				       m_frame_delay);
+				autotune_init(m_frame_delay);
+			} else if (strcmp("rt", argv[i]) == 0) {
+				m_rtsched = true;
+			} else if (strncmp("rt=", argv[i], 3) == 0) {
+				if (!rtsched_config(argv[i]+3))
+					return 1;
+				m_rtsched = true;
+			} else if (strncmp("mask=", argv[i], 5) == 0) {
+				printf("Block mask: %s\n", argv[i]+5);
+				m_mask_path = argv[i]+5;
+			} else if (strncmp("tile=", argv[i], 5) == 0) {
+				m_sampling.tile_size = atoi(argv[i]+5);
+				if (m_sampling.tile_size < 1 ||
+				    m_sampling.tile_size > MOTION_TILE_MAX) {
+					ERR("tile= must be 1.." << MOTION_TILE_MAX);
+					return 1;
+				}
+			} else if (strncmp("per_tile=", argv[i], 9) == 0) {
+				m_sampling.per_tile = atoi(argv[i]+9);
+			} else if (strncmp("prefilter=", argv[i], 10) == 0) {
+				motion_prefilter_init(&m_prefilter, atoi(argv[i]+10));
+				m_sampling.p_prefilter = &m_prefilter;
+				printf("Rejecting vectors %d px off their neighbours and the last frame\n",
+				       m_prefilter.threshold);
+			} else if (strncmp("serial=", argv[i], 7) == 0) {
+				/* serial=<device>[:<baud>] */
+				char path[64];
+				int baud = 921600;
+				snprintf(path, sizeof(path), "%s", argv[i]+7);
+				char *p_baud = strchr(path, ':');
+				if (p_baud != NULL) {
+					*p_baud = '\0';
+					baud = atoi(p_baud+1);
+				}
+				if (!mavlog_serial_init(path, baud))
+					return 1;
+				printf("MAVLink to %s at %d baud\n", path, baud);
+			} else if (strncmp("sink=", argv[i], 5) == 0) {
+				if (!mavlog_add_sink(argv[i]+5))
+					return 1;
+				printf("MAVLink to %s\n", argv[i]+5);
+			} else if (strcmp("predict", argv[i]) == 0) {
+				mavlog_predict_init();
+				printf("Predicting OPTICAL_FLOW_RAD at the gyro rate\n");
+			} else if (strcmp("shm", argv[i]) == 0) {
+				m_shm_path = FLOWSHM_DEFAULT_PATH;
+				printf("Publishing frames to readers on %s\n", m_shm_path);
+			} else if (strncmp("shm=", argv[i], 4) == 0) {
+				m_shm_path = argv[i]+4;
+				printf("Publishing frames to readers on %s\n", m_shm_path);
+			} else if (strncmp("rec=", argv[i], 4) == 0) {
+				printf("Recording to %s\n", argv[i]+4);
+				m_rec_path = argv[i]+4;
+			}
 		}
+
+		if (m_sampling.per_tile > 0 && m_sampling.tile_size == 0)
+			m_sampling.tile_size = 4;
+		if (m_sampling.per_tile > 0)
+			printf("Keeping the %d best vectors of every %dx%d blocks\n",
+			       m_sampling.per_tile, m_sampling.tile_size,
+			       m_sampling.tile_size);
 	} else {
-		fprintf(stderr, "Usage: %s <fps>, [gui]\n", argv[0]);
+		fprintf(stderr, "Usage: %s <fps>, [gui], [sim], [seed=<n>], [rec=<file>], [trace=<file>], [pipeline=<depth>], [autotune], [rt], [rt=<role>:<cpus>:<policy>:<prio>], [mask=<image>], [tile=<blocks>], [per_tile=<n>], [prefilter=<px>], [serial=<device>[:<baud>]], [sink=<type>:<target>[,div=<n>][,pdiv=<n>][,msgs=<id>+...][,queue=<n>]], [predict], [shm[=<socket>]]\n", argv[0]);
 		return 1;
 	}
 
+	/* Before RaspiVid and our threads start, so that all memory is locked */
+	if (m_rtsched && !rtsched_init())
+		ERR("Real-time setup incomplete, run as root");
+
 	int ret = raspividcv_main(rargc, rargv);
 
 	volatile unsigned int i = 0;
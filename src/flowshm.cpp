@@ -0,0 +1,374 @@
+#include "flowshm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#include "evloop.h"
+
+/* Older C libraries lack memfd_create() */
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC		0x0001U
+#define MFD_ALLOW_SEALING	0x0002U
+#endif
+
+#define FLOWSHM_SLOT_ALIGN	64 /* Cache line */
+
+static struct {
+	bool initialized;
+	int memfd;
+	int ro_fd; /* Read-only descriptor of memfd, handed to readers */
+	int listen_fd;
+	char path[108];
+	uint8_t *p_map;
+	size_t map_size;
+	flowshm_header_t *p_hdr;
+	uint32_t frame; /* Being written */
+	unsigned long readers;
+} m_shm;
+
+static inline size_t align(size_t size, size_t alignment)
+{
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+static inline flowshm_slot_t *slot_get(uint8_t *p_map, const flowshm_header_t *p_hdr,
+				       uint32_t frame)
+{
+	return (flowshm_slot_t *)(p_map + p_hdr->header_size +
+				  (size_t)(frame % p_hdr->slot_count) * p_hdr->slot_size);
+}
+
+static int futex(std::atomic<uint32_t> *p_word, int op, uint32_t val,
+		 const struct timespec *p_timeout)
+{
+	return syscall(SYS_futex, (uint32_t *)p_word, op, val, p_timeout, NULL, 0);
+}
+
+/* Runs on the event loop whenever a reader connects */
+static void accept_handler(void *ptr)
+{
+	int fd;
+
+	while ((fd = accept4(m_shm.listen_fd, NULL, NULL,
+			     SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		char byte = 0;
+		struct iovec iov = { &byte, 1 };
+		union {
+			struct cmsghdr hdr;
+			char buf[CMSG_SPACE(sizeof(int))];
+		} control;
+		struct msghdr msg;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+
+		struct cmsghdr *p_cmsg = CMSG_FIRSTHDR(&msg);
+		p_cmsg->cmsg_level = SOL_SOCKET;
+		p_cmsg->cmsg_type = SCM_RIGHTS;
+		p_cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(p_cmsg), &m_shm.ro_fd, sizeof(int));
+
+		/* A fresh socket has room for one byte, this never waits */
+		if (sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == 1)
+			m_shm.readers++;
+		else
+			ERR("flowshm: Can't pass the ring to a reader: " << errno);
+
+		close(fd);
+	}
+}
+
+bool flowshm_init(const char *p_path, int mbx, int mby)
+{
+	if (strlen(p_path) >= sizeof(m_shm.path)) {
+		ERR("flowshm_init(): Path too long: " << p_path);
+		return false;
+	}
+
+	size_t imv_size = (size_t)(mbx+1) * mby * sizeof(cv_imv_t);
+	size_t imv_offset = align(sizeof(flowshm_slot_t), FLOWSHM_SLOT_ALIGN);
+	size_t blocks_offset = imv_offset + align(imv_size, FLOWSHM_SLOT_ALIGN);
+	size_t slot_size = blocks_offset + align(mbx * mby, FLOWSHM_SLOT_ALIGN);
+
+	m_shm.map_size = FLOWSHM_HEADER_SIZE + FLOWSHM_SLOTS * slot_size;
+
+	m_shm.memfd = syscall(SYS_memfd_create, "flowberry",
+			      MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (m_shm.memfd == -1) {
+		ERR("flowshm_init(): memfd_create failed: " << errno);
+		return false;
+	}
+
+	if (ftruncate(m_shm.memfd, m_shm.map_size) != 0) {
+		ERR("flowshm_init(): Can't size the ring: " << errno);
+		close(m_shm.memfd);
+		return false;
+	}
+
+#ifdef F_ADD_SEALS
+	/* Readers can't shrink it under the frame thread (SIGBUS) */
+	fcntl(m_shm.memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif
+
+	m_shm.p_map = (uint8_t *)mmap(NULL, m_shm.map_size, PROT_READ | PROT_WRITE,
+				      MAP_SHARED, m_shm.memfd, 0);
+	if (m_shm.p_map == MAP_FAILED) {
+		ERR("flowshm_init(): mmap failed: " << errno);
+		close(m_shm.memfd);
+		return false;
+	}
+
+	/* Reopened read-only, so readers can't write into the ring */
+	char fd_path[32];
+	snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", m_shm.memfd);
+	m_shm.ro_fd = open(fd_path, O_RDONLY | O_CLOEXEC);
+	if (m_shm.ro_fd == -1)
+		m_shm.ro_fd = m_shm.memfd;
+
+	flowshm_header_t *p_hdr = (flowshm_header_t *)m_shm.p_map;
+	memcpy(p_hdr->magic, FLOWSHM_MAGIC, sizeof(p_hdr->magic));
+	p_hdr->version = FLOWSHM_VERSION;
+	p_hdr->header_size = FLOWSHM_HEADER_SIZE;
+	p_hdr->mbx = mbx;
+	p_hdr->mby = mby;
+	p_hdr->slot_count = FLOWSHM_SLOTS;
+	p_hdr->slot_size = slot_size;
+	p_hdr->imv_offset = imv_offset;
+	p_hdr->blocks_offset = blocks_offset;
+	p_hdr->published.store(0, std::memory_order_release);
+	m_shm.p_hdr = p_hdr;
+	m_shm.frame = 0;
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, p_path);
+	strcpy(m_shm.path, p_path);
+
+	m_shm.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	unlink(p_path);
+	if (m_shm.listen_fd == -1 ||
+	    bind(m_shm.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(m_shm.listen_fd, 8) != 0) {
+		ERR("flowshm_init(): Can't listen on " << p_path << ": " << errno);
+		if (m_shm.listen_fd != -1)
+			close(m_shm.listen_fd);
+		munmap(m_shm.p_map, m_shm.map_size);
+		if (m_shm.ro_fd != m_shm.memfd)
+			close(m_shm.ro_fd);
+		close(m_shm.memfd);
+		return false;
+	}
+
+	DBG("flowshm_init(): " << FLOWSHM_SLOTS << " slots of " << slot_size <<
+	    " bytes, readers connect to " << p_path);
+
+	m_shm.initialized = true;
+
+	return true;
+}
+
+bool flowshm_start(void)
+{
+	if (!m_shm.initialized)
+		return false;
+
+	return evloop_add_fd(m_shm.listen_fd, accept_handler, NULL);
+}
+
+void flowshm_stop(void)
+{
+	if (!m_shm.initialized)
+		return;
+
+	m_shm.initialized = false;
+
+	close(m_shm.listen_fd);
+	unlink(m_shm.path);
+
+	DBG("flowshm_stop(): " << m_shm.frame << " frames published to " <<
+	    m_shm.readers << " readers");
+}
+
+flowshm_slot_t *flowshm_begin(int64_t t, cv_imv_t **pp_imv, uint8_t **pp_blocks)
+{
+	if (!m_shm.initialized)
+		return NULL;
+
+	flowshm_slot_t *p_slot = slot_get(m_shm.p_map, m_shm.p_hdr, m_shm.frame);
+
+	/* Readers of the frame that was here see it change from now on */
+	p_slot->seq.store(2*m_shm.frame + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	p_slot->frame = m_shm.frame;
+	p_slot->t = t;
+
+	*pp_imv = (cv_imv_t *)((uint8_t *)p_slot + m_shm.p_hdr->imv_offset);
+	*pp_blocks = (uint8_t *)p_slot + m_shm.p_hdr->blocks_offset;
+
+	return p_slot;
+}
+
+void flowshm_commit(flowshm_slot_t *p_slot)
+{
+	p_slot->seq.store(2*m_shm.frame + 2, std::memory_order_release);
+	m_shm.frame++;
+	m_shm.p_hdr->published.store(m_shm.frame, std::memory_order_release);
+
+	/* Not a private futex: the waiters are other processes */
+	futex(&m_shm.p_hdr->published, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+bool flowshm_open(flowshm_reader_t *p_reader, const char *p_path)
+{
+	memset(p_reader, 0, sizeof(*p_reader));
+	p_reader->fd = -1;
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(p_path) >= sizeof(addr.sun_path)) {
+		ERR("flowshm_open(): Path too long: " << p_path);
+		return false;
+	}
+	strcpy(addr.sun_path, p_path);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock == -1 ||
+	    connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		ERR("flowshm_open(): Can't connect to " << p_path << ": " << errno);
+		if (sock != -1)
+			close(sock);
+		return false;
+	}
+
+	char byte;
+	struct iovec iov = { &byte, 1 };
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	close(sock);
+
+	struct cmsghdr *p_cmsg = CMSG_FIRSTHDR(&msg);
+	if (n != 1 || p_cmsg == NULL || p_cmsg->cmsg_type != SCM_RIGHTS) {
+		ERR("flowshm_open(): No ring received from " << p_path);
+		return false;
+	}
+	memcpy(&p_reader->fd, CMSG_DATA(p_cmsg), sizeof(int));
+
+	struct stat st;
+	if (fstat(p_reader->fd, &st) != 0 || (size_t)st.st_size < FLOWSHM_HEADER_SIZE) {
+		ERR("flowshm_open(): Ring too short");
+		close(p_reader->fd);
+		return false;
+	}
+
+	p_reader->map_size = st.st_size;
+	p_reader->p_map = (uint8_t *)mmap(NULL, p_reader->map_size, PROT_READ,
+					  MAP_SHARED, p_reader->fd, 0);
+	if (p_reader->p_map == MAP_FAILED) {
+		ERR("flowshm_open(): mmap failed: " << errno);
+		close(p_reader->fd);
+		return false;
+	}
+
+	const flowshm_header_t *p_hdr = (const flowshm_header_t *)p_reader->p_map;
+	if (memcmp(p_hdr->magic, FLOWSHM_MAGIC, sizeof(p_hdr->magic)) != 0 ||
+	    p_hdr->version != FLOWSHM_VERSION || p_hdr->slot_count == 0 ||
+	    p_hdr->header_size + (size_t)p_hdr->slot_count * p_hdr->slot_size >
+	    p_reader->map_size) {
+		ERR("flowshm_open(): " << p_path << " did not send a flow ring");
+		flowshm_close(p_reader);
+		return false;
+	}
+
+	p_reader->p_hdr = p_hdr;
+
+	uint32_t published = p_hdr->published.load(std::memory_order_acquire);
+	p_reader->next = (published > 0) ? published - 1 : 0;
+
+	return true;
+}
+
+void flowshm_close(flowshm_reader_t *p_reader)
+{
+	if (p_reader->p_map != NULL && p_reader->p_map != MAP_FAILED)
+		munmap(p_reader->p_map, p_reader->map_size);
+	if (p_reader->fd != -1)
+		close(p_reader->fd);
+
+	p_reader->p_map = NULL;
+	p_reader->p_hdr = NULL;
+	p_reader->fd = -1;
+}
+
+const flowshm_slot_t *flowshm_next(flowshm_reader_t *p_reader, int timeout_ms)
+{
+	const flowshm_header_t *p_hdr = p_reader->p_hdr;
+	std::atomic<uint32_t> *p_published =
+		const_cast<std::atomic<uint32_t> *>(&p_hdr->published);
+	int64_t t_end = microseconds_monotonic() + (int64_t)timeout_ms * 1000;
+
+	while (1) {
+		uint32_t published = p_published->load(std::memory_order_acquire);
+
+		/* Fallen behind by more than the ring: the oldest frames are
+		   about to be overwritten, carry on with the newest one */
+		if (published - p_reader->next >= p_hdr->slot_count) {
+			p_reader->lost += published - 1 - p_reader->next;
+			p_reader->next = published - 1;
+		}
+
+		if (published != p_reader->next) {
+			const flowshm_slot_t *p_slot = slot_get(p_reader->p_map, p_hdr,
+								p_reader->next);
+			uint32_t frame = p_reader->next++;
+
+			if (p_slot->seq.load(std::memory_order_acquire) == 2*frame + 2)
+				return p_slot;
+
+			/* Overwritten since published was read */
+			p_reader->lost++;
+			continue;
+		}
+
+		struct timespec ts;
+		struct timespec *p_ts = NULL;
+
+		if (timeout_ms >= 0) {
+			int64_t t_left = t_end - microseconds_monotonic();
+			if (t_left <= 0)
+				return NULL;
+			ts.tv_sec = t_left / 1000000;
+			ts.tv_nsec = (t_left % 1000000) * 1000;
+			p_ts = &ts;
+		}
+
+		/* Returns at once if a frame was published in between */
+		futex(p_published, FUTEX_WAIT, published, p_ts);
+	}
+}
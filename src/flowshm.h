@@ -0,0 +1,109 @@
+#ifndef FLOWSHM_H
+#define FLOWSHM_H
+
+#include <atomic>
+
+#include "common.h"
+#include "cv_imv.h"
+
+/*
+ * Per-frame results for other local processes, published once into a ring
+ * of FLOWSHM_SLOTS slots in a memfd and read in place (native layout, same
+ * machine):
+ *
+ *   flowshm_header_t, padded to header_size
+ *   slot_count slots of slot_size bytes: flowshm_slot_t, the (mbx+1)*mby
+ *   vectors at imv_offset and mbx*mby CV_IMV_BLOCK_* at blocks_offset
+ *
+ * A reader connects to the unix socket given to flowshm_init() and receives
+ * a read-only descriptor of the memfd (SCM_RIGHTS). Frame n goes to slot
+ * n % slot_count; its seq is odd while the slot is written and 2n+2 once it
+ * is complete. Then published becomes n+1 and waiters are woken with a
+ * futex on it. The writer never waits for readers: a reader that falls
+ * slot_count frames behind skips to the newest frame, and one still reading
+ * a slot that is overwritten sees seq change (flowshm_valid()).
+ */
+
+#define FLOWSHM_MAGIC		"FBSHM\0\0\1"
+#define FLOWSHM_VERSION		1
+#define FLOWSHM_HEADER_SIZE	64
+#define FLOWSHM_SLOTS		8
+#define FLOWSHM_DEFAULT_PATH	"/tmp/flowberry.sock"
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size; /* Offset of the first slot */
+	uint16_t mbx;
+	uint16_t mby;
+	uint32_t slot_count;
+	uint32_t slot_size;
+	uint32_t imv_offset; /* In a slot */
+	uint32_t blocks_offset;
+	std::atomic<uint32_t> published; /* Frames, futex word */
+} flowshm_header_t;
+
+typedef struct {
+	std::atomic<uint32_t> seq;
+	uint32_t frame;
+	int64_t t; /* Capture [us], microseconds_monotonic() time */
+	double xform[6]; /* [A|b], row-major; valid == 0 if not estimated */
+	double dx;
+	double dy;
+	int32_t vec_in;
+	int32_t vec_good;
+	uint8_t valid;
+} flowshm_slot_t;
+
+typedef struct {
+	int fd;
+	uint8_t *p_map;
+	size_t map_size;
+	const flowshm_header_t *p_hdr;
+	uint32_t next; /* Frame returned by the next flowshm_next() */
+	unsigned long lost; /* Overwritten before they were read */
+} flowshm_reader_t;
+
+/* Writer (flowberry): creates the ring for an mbx x mby grid and listens on
+   p_path; flowshm_start() serves readers from the event loop */
+bool flowshm_init(const char *p_path, int mbx, int mby);
+bool flowshm_start(void);
+void flowshm_stop(void);
+
+/* The slot for the next frame, filled in place and handed to the readers by
+   flowshm_commit(). NULL if there is no ring. */
+flowshm_slot_t *flowshm_begin(int64_t t, cv_imv_t **pp_imv, uint8_t **pp_blocks);
+void flowshm_commit(flowshm_slot_t *p_slot);
+
+/* Reader: starts at the newest complete frame */
+bool flowshm_open(flowshm_reader_t *p_reader, const char *p_path);
+void flowshm_close(flowshm_reader_t *p_reader);
+
+/* The next frame, waiting up to timeout_ms for it (-1: forever); NULL on
+   timeout. Frames skipped after falling behind or overwritten before they
+   were reached are counted in lost. */
+const flowshm_slot_t *flowshm_next(flowshm_reader_t *p_reader, int timeout_ms);
+
+/* False if the slot of the last flowshm_next() frame was overwritten while
+   in use; check after reading it */
+static inline bool flowshm_valid(const flowshm_reader_t *p_reader,
+				 const flowshm_slot_t *p_slot)
+{
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return p_slot->seq.load(std::memory_order_relaxed) == 2*p_reader->next;
+}
+
+static inline const cv_imv_t *flowshm_imv(const flowshm_reader_t *p_reader,
+					  const flowshm_slot_t *p_slot)
+{
+	return (const cv_imv_t *)((const uint8_t *)p_slot +
+				  p_reader->p_hdr->imv_offset);
+}
+
+static inline const uint8_t *flowshm_blocks(const flowshm_reader_t *p_reader,
+					    const flowshm_slot_t *p_slot)
+{
+	return (const uint8_t *)p_slot + p_reader->p_hdr->blocks_offset;
+}
+
+#endif
@@ -0,0 +1,151 @@
+#include "imvcodec.h"
+
+#define XY_ESCAPE	0x0f /* Low nibble: x/y residuals follow as 2 bytes */
+
+static inline uint8_t zigzag8(int8_t v)
+{
+	return (uint8_t)((v << 1) ^ (v >> 7));
+}
+
+static inline int8_t unzigzag8(uint8_t v)
+{
+	return (int8_t)((v >> 1) ^ -(v & 1));
+}
+
+static inline uint32_t zigzag32(int32_t v)
+{
+	return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int32_t unzigzag32(uint32_t v)
+{
+	return (int32_t)((v >> 1) ^ -(v & 1));
+}
+
+static inline int sad_predict(const cv_imv_t *p_imv, int i, int j, int stride)
+{
+	int idx = i + j*stride;
+
+	if (j == 0)
+		return (i > 0) ? p_imv[idx-1].sad : 0;
+	if (i == 0)
+		return p_imv[idx-stride].sad;
+
+	int a = p_imv[idx-1].sad; /* Left */
+	int b = p_imv[idx-stride].sad; /* Top */
+	int c = p_imv[idx-stride-1].sad; /* Top left */
+	int lo = (a < b) ? a : b;
+	int hi = (a < b) ? b : a;
+
+	if (c >= hi)
+		return lo;
+	if (c <= lo)
+		return hi;
+
+	return a + b - c;
+}
+
+size_t imvcodec_encode(const cv_imv_t *p_imv, const cv_imv_t *p_prev,
+		       int mbx, int mby, uint8_t *p_out)
+{
+	int stride = mbx+1;
+	uint8_t *p = p_out;
+
+	for (int j = 0; j < mby; j++) {
+		int8_t px = 0;
+		int8_t py = 0;
+
+		for (int i = 0; i < stride; i++) {
+			int idx = i + j*stride;
+			const cv_imv_t *p_vec = &p_imv[idx];
+
+			if (p_prev != NULL) {
+				px = p_prev[idx].x;
+				py = p_prev[idx].y;
+			}
+
+			uint8_t zx = zigzag8((int8_t)(p_vec->x - px));
+			uint8_t zy = zigzag8((int8_t)(p_vec->y - py));
+
+			if (zx < XY_ESCAPE && zy < 16) {
+				*p++ = zx | (zy << 4);
+			} else {
+				*p++ = XY_ESCAPE;
+				*p++ = zx;
+				*p++ = zy;
+			}
+
+			uint32_t zs = zigzag32((int32_t)p_vec->sad -
+					       sad_predict(p_imv, i, j, stride));
+			while (zs >= 0x80) {
+				*p++ = (uint8_t)(zs | 0x80);
+				zs >>= 7;
+			}
+			*p++ = (uint8_t)zs;
+
+			px = p_vec->x;
+			py = p_vec->y;
+		}
+	}
+
+	return p - p_out;
+}
+
+bool imvcodec_decode(const uint8_t *p_in, size_t length,
+		     const cv_imv_t *p_prev, int mbx, int mby, cv_imv_t *p_imv)
+{
+	int stride = mbx+1;
+	const uint8_t *p = p_in;
+	const uint8_t *p_end = p_in + length;
+
+	for (int j = 0; j < mby; j++) {
+		int8_t px = 0;
+		int8_t py = 0;
+
+		for (int i = 0; i < stride; i++) {
+			int idx = i + j*stride;
+			cv_imv_t *p_vec = &p_imv[idx];
+			uint8_t zx, zy;
+
+			if (p_prev != NULL) {
+				px = p_prev[idx].x;
+				py = p_prev[idx].y;
+			}
+
+			if (p >= p_end)
+				return false;
+
+			if ((*p & 0x0f) != XY_ESCAPE) {
+				zx = *p & 0x0f;
+				zy = *p >> 4;
+				p++;
+			} else {
+				if (p_end - p < 3)
+					return false;
+				zx = p[1];
+				zy = p[2];
+				p += 3;
+			}
+
+			p_vec->x = (int8_t)(px + unzigzag8(zx));
+			p_vec->y = (int8_t)(py + unzigzag8(zy));
+
+			uint32_t zs = 0;
+			int shift = 0;
+			do {
+				if (p >= p_end || shift > 21)
+					return false;
+				zs |= (uint32_t)(*p & 0x7f) << shift;
+				shift += 7;
+			} while (*p++ & 0x80);
+
+			p_vec->sad = (uint16_t)(unzigzag32(zs) +
+						sad_predict(p_imv, i, j, stride));
+
+			px = p_vec->x;
+			py = p_vec->y;
+		}
+	}
+
+	return p == p_end;
+}
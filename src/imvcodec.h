@@ -0,0 +1,29 @@
+#ifndef IMVCODEC_H
+#define IMVCODEC_H
+
+#include "common.h"
+#include "cv_imv.h"
+
+/*
+ * Lossless codec for a grid of count = (mbx+1)*mby vectors.
+ *
+ * x/y are predicted from the same block of the previous frame (or from the
+ * left neighbour in a keyframe, p_prev == NULL) and SAD from its left, top
+ * and top-left neighbours (LOCO-I median predictor). Residuals are zigzag
+ * coded; x/y residuals below 15 share one byte, SAD residuals are varints.
+ */
+
+/* Upper bound of the encoded size */
+static inline size_t imvcodec_bound(size_t count)
+{
+	return count * 6;
+}
+
+size_t imvcodec_encode(const cv_imv_t *p_imv, const cv_imv_t *p_prev,
+		       int mbx, int mby, uint8_t *p_out);
+
+/* Returns false if the data is truncated or corrupt */
+bool imvcodec_decode(const uint8_t *p_in, size_t length,
+		     const cv_imv_t *p_prev, int mbx, int mby, cv_imv_t *p_imv);
+
+#endif
@@ -0,0 +1,475 @@
+#include "imvlog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "imvcodec.h"
+
+#define IMVLOG_INDEX_GROW	4096 /* Entries */
+
+static inline size_t align8(size_t size)
+{
+	return (size + 7) & ~(size_t)7;
+}
+
+size_t imvlog_record_size(int mbx, int mby)
+{
+	/* Keeps the timestamps of all records 8-byte aligned */
+	return align8(sizeof(imvlog_record_t) + (mbx+1) * mby * sizeof(cv_imv_t));
+}
+
+void imvlog_record_fill(uint8_t *p_record, int mbx, int mby, int64_t t,
+			uint32_t seq, const cv_imv_t *p_imv)
+{
+	size_t payload = (mbx+1) * mby * sizeof(cv_imv_t);
+	size_t size = imvlog_record_size(mbx, mby);
+
+	imvlog_record_t rec;
+	rec.t = t;
+	rec.seq = seq;
+	rec.size = 0;
+
+	memcpy(p_record, &rec, sizeof(rec));
+	memcpy(p_record + sizeof(rec), p_imv, payload);
+	memset(p_record + sizeof(rec) + payload, 0, size - sizeof(rec) - payload);
+}
+
+static bool write_all(int fd, const void *p_data, size_t length)
+{
+	const uint8_t *p = (const uint8_t *)p_data;
+
+	while (length > 0) {
+		ssize_t n = write(fd, p, length);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		p += n;
+		length -= n;
+	}
+
+	return true;
+}
+
+static bool write_header(int fd, const imvlog_header_t *p_hdr)
+{
+	uint8_t buf[IMVLOG_HEADER_SIZE];
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, p_hdr, sizeof(*p_hdr));
+
+	return pwrite(fd, buf, sizeof(buf), 0) == sizeof(buf);
+}
+
+bool imvlog_writer_open(imvlog_writer_t *p_writer, const char *p_path,
+			int mbx, int mby, bool compress)
+{
+	memset(p_writer, 0, sizeof(*p_writer));
+
+	p_writer->fd = open(p_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (p_writer->fd == -1) {
+		ERR("imvlog_writer_open(): Can't open " << p_path);
+		return false;
+	}
+
+	imvlog_header_t *p_hdr = &p_writer->hdr;
+	memcpy(p_hdr->magic, IMVLOG_MAGIC, sizeof(p_hdr->magic));
+	p_hdr->version = IMVLOG_VERSION;
+	p_hdr->header_size = IMVLOG_HEADER_SIZE;
+	p_hdr->mbx = mbx;
+	p_hdr->mby = mby;
+	p_hdr->record_size = imvlog_record_size(mbx, mby);
+
+	if (compress) {
+		p_hdr->flags = IMVLOG_FLAG_COMPRESSED;
+		p_hdr->keyframe_interval = IMVLOG_KEYFRAME_INTERVAL;
+		p_writer->p_prev = new cv_imv_t[(mbx+1) * mby];
+	}
+
+	if (!write_header(p_writer->fd, p_hdr) ||
+	    lseek(p_writer->fd, IMVLOG_HEADER_SIZE, SEEK_SET) < 0) {
+		ERR("imvlog_writer_open(): Can't write header");
+		close(p_writer->fd);
+		delete [] p_writer->p_prev;
+		return false;
+	}
+
+	p_writer->offset = IMVLOG_HEADER_SIZE;
+
+	return true;
+}
+
+static bool index_reserve(imvlog_writer_t *p_writer, size_t count)
+{
+	size_t n = p_writer->hdr.frame_count;
+
+	if (n + count <= p_writer->index_size)
+		return true;
+
+	size_t size = p_writer->index_size + std::max(count, (size_t)IMVLOG_INDEX_GROW);
+	int64_t *p_index = (int64_t *)realloc(p_writer->p_index,
+					      size * sizeof(int64_t));
+	if (p_index == NULL)
+		return false;
+	p_writer->p_index = p_index;
+
+	if (p_writer->hdr.flags & IMVLOG_FLAG_COMPRESSED) {
+		uint64_t *p_offsets = (uint64_t *)realloc(p_writer->p_offsets,
+							  size * sizeof(uint64_t));
+		if (p_offsets == NULL)
+			return false;
+		p_writer->p_offsets = p_offsets;
+	}
+
+	p_writer->index_size = size;
+
+	return true;
+}
+
+/* Encodes the raw records into p_scratch, returns the encoded length */
+static size_t compress_records(imvlog_writer_t *p_writer,
+			       const uint8_t *p_records, size_t count)
+{
+	imvlog_header_t *p_hdr = &p_writer->hdr;
+	size_t vectors = (p_hdr->mbx+1) * p_hdr->mby;
+	size_t max = count * align8(sizeof(imvlog_record_t) + imvcodec_bound(vectors));
+
+	if (max > p_writer->scratch_size) {
+		uint8_t *p_scratch = (uint8_t *)realloc(p_writer->p_scratch, max);
+		if (p_scratch == NULL)
+			return 0;
+		p_writer->p_scratch = p_scratch;
+		p_writer->scratch_size = max;
+	}
+
+	uint8_t *p = p_writer->p_scratch;
+
+	for (size_t i = 0; i < count; i++) {
+		size_t n = p_hdr->frame_count + i;
+		imvlog_record_t rec;
+		memcpy(&rec, p_records + i*p_hdr->record_size, sizeof(rec));
+
+		const cv_imv_t *p_imv = (const cv_imv_t *)(p_records +
+			i*p_hdr->record_size + sizeof(imvlog_record_t));
+		bool keyframe = (n % p_hdr->keyframe_interval) == 0;
+
+		rec.size = imvcodec_encode(p_imv, keyframe ? NULL : p_writer->p_prev,
+					   p_hdr->mbx, p_hdr->mby,
+					   p + sizeof(rec));
+		memcpy(p, &rec, sizeof(rec));
+
+		size_t size = align8(sizeof(rec) + rec.size);
+		memset(p + sizeof(rec) + rec.size, 0, size - sizeof(rec) - rec.size);
+
+		memcpy(p_writer->p_prev, p_imv, vectors * sizeof(cv_imv_t));
+		p_writer->p_index[n] = rec.t;
+		p_writer->p_offsets[n] = p_writer->offset + (p - p_writer->p_scratch);
+		p += size;
+	}
+
+	return p - p_writer->p_scratch;
+}
+
+bool imvlog_writer_append(imvlog_writer_t *p_writer, const uint8_t *p_records,
+			  size_t count)
+{
+	imvlog_header_t *p_hdr = &p_writer->hdr;
+	const uint8_t *p_data = p_records;
+	size_t length = count * p_hdr->record_size;
+
+	if (count == 0)
+		return true;
+
+	if (!index_reserve(p_writer, count))
+		return false;
+
+	if (p_hdr->flags & IMVLOG_FLAG_COMPRESSED) {
+		length = compress_records(p_writer, p_records, count);
+		if (length == 0)
+			return false;
+		p_data = p_writer->p_scratch;
+	} else {
+		for (size_t i = 0; i < count; i++) {
+			const imvlog_record_t *p_rec =
+				(const imvlog_record_t *)(p_records + i*p_hdr->record_size);
+			p_writer->p_index[p_hdr->frame_count + i] = p_rec->t;
+		}
+	}
+
+	if (!write_all(p_writer->fd, p_data, length))
+		return false;
+
+	p_writer->offset += length;
+	p_hdr->frame_count += count;
+
+	return true;
+}
+
+bool imvlog_writer_close(imvlog_writer_t *p_writer)
+{
+	imvlog_header_t *p_hdr = &p_writer->hdr;
+	bool ok = true;
+
+	p_hdr->index_offset = p_writer->offset;
+
+	if (p_hdr->frame_count > 0 &&
+	    !write_all(p_writer->fd, p_writer->p_index,
+		       p_hdr->frame_count * sizeof(int64_t)))
+		ok = false;
+
+	if (ok && p_hdr->frame_count > 0 &&
+	    (p_hdr->flags & IMVLOG_FLAG_COMPRESSED) &&
+	    !write_all(p_writer->fd, p_writer->p_offsets,
+		       p_hdr->frame_count * sizeof(uint64_t)))
+		ok = false;
+
+	/* The header is written last, so a valid index_offset means the file is
+	   complete */
+	if (ok && (fdatasync(p_writer->fd) != 0 ||
+		   !write_header(p_writer->fd, p_hdr)))
+		ok = false;
+
+	if (!ok)
+		ERR("imvlog_writer_close(): Can't write index");
+
+	close(p_writer->fd);
+	free(p_writer->p_index);
+	free(p_writer->p_offsets);
+	free(p_writer->p_scratch);
+	delete [] p_writer->p_prev;
+	memset(p_writer, 0, sizeof(*p_writer));
+
+	return ok;
+}
+
+/* Rebuilds the index of a log that was not closed, keeping only complete
+   records */
+static bool recover_index(imvlog_t *p_log)
+{
+	imvlog_header_t *p_hdr = &p_log->hdr;
+	bool compressed = p_hdr->flags & IMVLOG_FLAG_COMPRESSED;
+	size_t max = (p_log->map_size - p_hdr->header_size) /
+		     (compressed ? sizeof(imvlog_record_t) : p_hdr->record_size);
+
+	p_log->p_own_index = (int64_t *)malloc((max+1) * sizeof(int64_t));
+	p_log->p_own_offsets = (uint64_t *)malloc((max+1) * sizeof(uint64_t));
+	if (p_log->p_own_index == NULL || p_log->p_own_offsets == NULL)
+		return false;
+
+	size_t offset = p_hdr->header_size;
+	size_t count = 0;
+
+	while (offset + sizeof(imvlog_record_t) <= p_log->map_size) {
+		const imvlog_record_t *p_rec =
+			(const imvlog_record_t *)(p_log->p_map + offset);
+		size_t size = compressed ?
+			      align8(sizeof(imvlog_record_t) + p_rec->size) :
+			      p_hdr->record_size;
+
+		if (offset + size > p_log->map_size)
+			break;
+
+		p_log->p_own_index[count] = p_rec->t;
+		p_log->p_own_offsets[count] = offset;
+		count++;
+		offset += size;
+	}
+
+	p_hdr->frame_count = count;
+	p_log->p_index = p_log->p_own_index;
+	p_log->p_offsets = p_log->p_own_offsets;
+
+	DBG("imvlog_open(): recovered " << count << " frames");
+
+	return true;
+}
+
+bool imvlog_open(imvlog_t *p_log, const char *p_path)
+{
+	struct stat st;
+
+	memset(p_log, 0, sizeof(*p_log));
+
+	p_log->fd = open(p_path, O_RDONLY);
+	if (p_log->fd == -1) {
+		ERR("imvlog_open(): Can't open " << p_path);
+		return false;
+	}
+
+	if (fstat(p_log->fd, &st) != 0 || (size_t)st.st_size < IMVLOG_HEADER_SIZE) {
+		ERR("imvlog_open(): " << p_path << " is too short");
+		close(p_log->fd);
+		return false;
+	}
+
+	p_log->map_size = st.st_size;
+	p_log->p_map = (uint8_t *)mmap(NULL, p_log->map_size, PROT_READ,
+				       MAP_SHARED, p_log->fd, 0);
+	if (p_log->p_map == MAP_FAILED) {
+		ERR("imvlog_open(): mmap failed: " << errno);
+		close(p_log->fd);
+		return false;
+	}
+
+	imvlog_header_t *p_hdr = &p_log->hdr;
+	memcpy(p_hdr, p_log->p_map, sizeof(*p_hdr));
+
+	if (memcmp(p_hdr->magic, IMVLOG_MAGIC, sizeof(p_hdr->magic)) != 0 ||
+	    p_hdr->version != IMVLOG_VERSION ||
+	    p_hdr->record_size != imvlog_record_size(p_hdr->mbx, p_hdr->mby) ||
+	    ((p_hdr->flags & IMVLOG_FLAG_COMPRESSED) &&
+	     p_hdr->keyframe_interval == 0)) {
+		ERR("imvlog_open(): " << p_path << " is not an IMV log");
+		imvlog_close(p_log);
+		return false;
+	}
+
+	size_t entries = (p_hdr->flags & IMVLOG_FLAG_COMPRESSED) ? 2 : 1;
+	size_t end = p_hdr->index_offset + entries * p_hdr->frame_count * 8;
+
+	if (p_hdr->index_offset != 0 && end <= p_log->map_size) {
+		p_log->p_index = (const int64_t *)(p_log->p_map + p_hdr->index_offset);
+		if (entries == 2)
+			p_log->p_offsets = (const uint64_t *)(p_log->p_index +
+							      p_hdr->frame_count);
+	} else if (!recover_index(p_log)) {
+		imvlog_close(p_log);
+		return false;
+	}
+
+	return true;
+}
+
+void imvlog_close(imvlog_t *p_log)
+{
+	if (p_log->p_map != NULL && p_log->p_map != MAP_FAILED)
+		munmap(p_log->p_map, p_log->map_size);
+
+	free(p_log->p_own_index);
+	free(p_log->p_own_offsets);
+	close(p_log->fd);
+	memset(p_log, 0, sizeof(*p_log));
+	p_log->fd = -1;
+}
+
+size_t imvlog_seek(const imvlog_t *p_log, int64_t t)
+{
+	const int64_t *p_first = p_log->p_index;
+	const int64_t *p_last = p_log->p_index + p_log->hdr.frame_count;
+
+	return std::lower_bound(p_first, p_last, t) - p_first;
+}
+
+void imvlog_prefetch(const imvlog_t *p_log, size_t first, size_t last)
+{
+	if (last <= first)
+		return;
+
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t start = (const uint8_t *)imvlog_record(p_log, first) - p_log->p_map;
+	size_t end = (last < imvlog_count(p_log)) ?
+		     (size_t)((const uint8_t *)imvlog_record(p_log, last) - p_log->p_map) :
+		     p_log->hdr.index_offset;
+
+	if (end <= start)
+		return;
+
+	start &= ~(page-1);
+	madvise(p_log->p_map + start, end - start, MADV_WILLNEED);
+}
+
+bool imvlog_cursor_init(imvlog_cursor_t *p_cursor, const imvlog_t *p_log)
+{
+	memset(p_cursor, 0, sizeof(*p_cursor));
+	p_cursor->p_log = p_log;
+	p_cursor->current = SIZE_MAX;
+
+	if (p_log->hdr.flags & IMVLOG_FLAG_COMPRESSED) {
+		size_t vectors = (p_log->hdr.mbx+1) * p_log->hdr.mby;
+		p_cursor->p_decoded[0] = new cv_imv_t[vectors];
+		p_cursor->p_decoded[1] = new cv_imv_t[vectors];
+	}
+
+	return true;
+}
+
+void imvlog_cursor_free(imvlog_cursor_t *p_cursor)
+{
+	delete [] p_cursor->p_decoded[0];
+	delete [] p_cursor->p_decoded[1];
+	memset(p_cursor, 0, sizeof(*p_cursor));
+}
+
+/* Decodes frame i on top of the current frame (or none for a keyframe) */
+static bool cursor_decode(imvlog_cursor_t *p_cursor, size_t i, bool keyframe)
+{
+	const imvlog_t *p_log = p_cursor->p_log;
+	const imvlog_record_t *p_rec = imvlog_record(p_log, i);
+	const uint8_t *p_data = (const uint8_t *)p_rec + sizeof(imvlog_record_t);
+
+	cv_imv_t *p_out = p_cursor->p_decoded[1];
+	const cv_imv_t *p_ref = keyframe ? NULL : p_cursor->p_decoded[0];
+
+	if (!imvcodec_decode(p_data, p_rec->size, p_ref, p_log->hdr.mbx,
+			     p_log->hdr.mby, p_out)) {
+		ERR("imvlog: frame " << i << " is corrupt");
+		p_cursor->current = SIZE_MAX;
+		return false;
+	}
+
+	std::swap(p_cursor->p_decoded[0], p_cursor->p_decoded[1]);
+	p_cursor->p_imv = p_cursor->p_decoded[0];
+	p_cursor->current = i;
+
+	return true;
+}
+
+bool imvlog_cursor_read(imvlog_cursor_t *p_cursor, size_t i)
+{
+	const imvlog_t *p_log = p_cursor->p_log;
+
+	if (i >= imvlog_count(p_log))
+		return false;
+
+	if (!(p_log->hdr.flags & IMVLOG_FLAG_COMPRESSED)) {
+		p_cursor->p_imv = (const cv_imv_t *)((const uint8_t *)imvlog_record(p_log, i) +
+						     sizeof(imvlog_record_t));
+		p_cursor->current = i;
+		return true;
+	}
+
+	if (i == p_cursor->current)
+		return true;
+
+	size_t interval = p_log->hdr.keyframe_interval;
+	size_t keyframe = i - (i % interval);
+	size_t next = keyframe;
+
+	/* Continue from the current frame if it is on the way */
+	if (p_cursor->current != SIZE_MAX && p_cursor->current >= keyframe &&
+	    p_cursor->current < i)
+		next = p_cursor->current + 1;
+
+	for (; next <= i; next++) {
+		if (!cursor_decode(p_cursor, next, next == keyframe))
+			return false;
+	}
+
+	return true;
+}
+
+cv_imv imvlog_cursor_frame(const imvlog_cursor_t *p_cursor)
+{
+	const imvlog_t *p_log = p_cursor->p_log;
+
+	return cv_imv((uint8_t *)p_cursor->p_imv, p_log->hdr.mbx, p_log->hdr.mby,
+		      imvlog_record(p_log, p_cursor->current)->t, false);
+}
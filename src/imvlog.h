@@ -0,0 +1,131 @@
+#ifndef IMVLOG_H
+#define IMVLOG_H
+
+#include "common.h"
+#include "cv_imv.h"
+
+/*
+ * Motion vector log, laid out to be mmap()ed (little endian, packed):
+ *
+ *   imvlog_header_t, padded to header_size
+ *   frame_count records
+ *   frame_count int64_t timestamps (index), at index_offset
+ *   frame_count uint64_t record offsets (compressed logs only)
+ *
+ * Raw records are record_size bytes (imvlog_record_t + vectors), so record i
+ * lives at header_size + i*record_size and is reachable without parsing.
+ * Compressed records (IMVLOG_FLAG_COMPRESSED) hold imvcodec data, are padded
+ * to 8 bytes and located through the offset index; every keyframe_interval-th
+ * record is a keyframe that decodes on its own.
+ *
+ * The header is finalized on close; a file that was not closed (power loss)
+ * has index_offset == 0 and the reader rebuilds the index from the records.
+ */
+
+#define IMVLOG_MAGIC		"FBIMV\0\0\1"
+#define IMVLOG_VERSION		1
+#define IMVLOG_HEADER_SIZE	64
+#define IMVLOG_FLAG_COMPRESSED	0x01
+#define IMVLOG_KEYFRAME_INTERVAL 30
+
+typedef struct __attribute__((packed)) {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size; /* Offset of the first record */
+	uint16_t mbx;
+	uint16_t mby;
+	uint32_t record_size; /* Of raw records */
+	uint64_t frame_count;
+	uint64_t index_offset;
+	uint32_t flags;
+	uint32_t keyframe_interval; /* Compressed logs only */
+} imvlog_header_t;
+
+typedef struct __attribute__((packed)) {
+	int64_t t; /* [us], microseconds_monotonic() time */
+	uint32_t seq; /* Frame number, gaps mean dropped frames */
+	uint32_t size; /* Bytes of compressed data following, 0 if raw */
+	/* Raw: (mbx+1)*mby cv_imv_t follow, padded to record_size */
+} imvlog_record_t;
+
+typedef struct {
+	int fd;
+	imvlog_header_t hdr;
+	uint64_t offset; /* Of the next record */
+	int64_t *p_index;
+	uint64_t *p_offsets;
+	size_t index_size;
+	cv_imv_t *p_prev; /* Reference for temporal prediction */
+	uint8_t *p_scratch;
+	size_t scratch_size;
+} imvlog_writer_t;
+
+typedef struct {
+	int fd;
+	uint8_t *p_map;
+	size_t map_size;
+	imvlog_header_t hdr;
+	/* Into the map, or p_own_* if recovered */
+	const int64_t *p_index;
+	const uint64_t *p_offsets;
+	int64_t *p_own_index;
+	uint64_t *p_own_offsets;
+} imvlog_t;
+
+typedef struct {
+	const imvlog_t *p_log;
+	size_t current; /* Frame in p_imv, SIZE_MAX if none */
+	const cv_imv_t *p_imv;
+	cv_imv_t *p_decoded[2]; /* Current and previous, compressed logs */
+} imvlog_cursor_t;
+
+size_t imvlog_record_size(int mbx, int mby);
+void imvlog_record_fill(uint8_t *p_record, int mbx, int mby, int64_t t,
+			uint32_t seq, const cv_imv_t *p_imv);
+
+bool imvlog_writer_open(imvlog_writer_t *p_writer, const char *p_path,
+			int mbx, int mby, bool compress);
+/* p_records holds count raw records built by imvlog_record_fill(); they are
+   compressed here if the log is */
+bool imvlog_writer_append(imvlog_writer_t *p_writer, const uint8_t *p_records,
+			  size_t count);
+bool imvlog_writer_close(imvlog_writer_t *p_writer);
+
+bool imvlog_open(imvlog_t *p_log, const char *p_path);
+void imvlog_close(imvlog_t *p_log);
+
+static inline size_t imvlog_count(const imvlog_t *p_log)
+{
+	return p_log->hdr.frame_count;
+}
+
+static inline const imvlog_record_t *imvlog_record(const imvlog_t *p_log,
+						   size_t i)
+{
+	size_t offset;
+
+	if (p_log->hdr.flags & IMVLOG_FLAG_COMPRESSED)
+		offset = p_log->p_offsets[i];
+	else
+		offset = p_log->hdr.header_size + i * p_log->hdr.record_size;
+
+	return (const imvlog_record_t *)(p_log->p_map + offset);
+}
+
+/* Index of the first frame with t >= timestamp, O(log n) */
+size_t imvlog_seek(const imvlog_t *p_log, int64_t t);
+
+/* Hints the kernel to read frames [first, last) ahead */
+void imvlog_prefetch(const imvlog_t *p_log, size_t first, size_t last);
+
+/* One cursor per thread. imvlog_cursor_read() makes frame i current: raw
+   frames are used in place from the map, compressed ones are decoded, from
+   the preceding keyframe unless i directly follows the current frame. */
+bool imvlog_cursor_init(imvlog_cursor_t *p_cursor, const imvlog_t *p_log);
+void imvlog_cursor_free(imvlog_cursor_t *p_cursor);
+bool imvlog_cursor_read(imvlog_cursor_t *p_cursor, size_t i);
+
+/* View of the current frame, valid until the next read */
+cv_imv imvlog_cursor_frame(const imvlog_cursor_t *p_cursor);
+
+#endif
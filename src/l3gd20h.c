@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include <sys/ioctl.h>
 
@@ -15,6 +16,8 @@
 #define GYRO_REG_OUT_TEMP	0x26
 #define GYRO_REG_STATUS		0x27
 #define GYRO_REG_OUT_X_L	0x28
+#define GYRO_REG_FIFO_CTRL	0x2e
+#define GYRO_REG_FIFO_SRC	0x2f
 #define GYRO_REG_LOW_ODR	0x39
 #define GYRO_REG_WHO_AM_I	0x0f
 
@@ -30,22 +33,38 @@
 #define GYRO_BIT_CTRL4_FS0		(1 << 4)
 #define GYRO_BIT_CTRL5_OUT_SEL1		(1 << 1)
 #define GYRO_BIT_CTRL5_HPEN		(1 << 4)
+#define GYRO_BIT_CTRL5_FIFO_EN		(1 << 6)
+#define GYRO_BIT_FIFO_CTRL_STREAM	(2 << 5)
+#define GYRO_BIT_FIFO_SRC_OVRN		(1 << 6)
+#define GYRO_BIT_FIFO_SRC_EMPTY		(1 << 5)
+#define GYRO_MASK_FIFO_SRC_FSS		0x1f
 #define GYRO_BIT_STATUS_ZYXOR		(1 << 7)
 #define GYRO_BIT_LOW_ODR_SW_RES		(1 << 2)
 #define GYRO_BIT_LOW_ODR_LOW_ODR	(1 << 0)
 
 static int m_fd;
+static uint8_t m_addr;
+static const l3gd20h_bus_t *m_bus;
 static float m_sensitivity;
+static float m_data_rate_hz;
+static uint8_t m_ctrl5_reg_value;
+
+static bool i2cdev_write_reg(uint8_t reg, uint8_t value);
+static bool i2cdev_read_regs(uint8_t reg, uint8_t *p_buffer, uint16_t length);
+static bool i2cdev_close(void);
+
+static const l3gd20h_bus_t m_i2cdev_bus = {
+	i2cdev_write_reg,
+	i2cdev_read_regs,
+	i2cdev_close
+};
 
 static bool l3gd20h_write_reg(uint8_t reg, uint8_t value);
 static bool l3gd20h_read_reg(uint8_t reg, uint8_t *p_value);
-static bool l3gd20h_read_block(uint8_t reg, uint8_t *p_buffer, uint8_t length);
+static bool l3gd20h_read_block(uint8_t reg, uint8_t *p_buffer, uint16_t length);
 
-static bool l3gd20h_write_reg(uint8_t reg, uint8_t value)
+static bool i2cdev_write_reg(uint8_t reg, uint8_t value)
 {
-	L3GD20H_DEBUG("[L3GD20H_DEBUG] Writing value 0x%02x to reg 0x%02x.\n",
-		      value, reg);
-
 	int ret = i2c_smbus_write_byte_data(m_fd, reg, value);
 	if (ret == -1) {
 		fprintf(stderr, "[L3GD20H] Failed to write register %d.\n", reg);
@@ -55,32 +74,95 @@ static bool l3gd20h_write_reg(uint8_t reg, uint8_t value)
 	return true;
 }
 
-static bool l3gd20h_read_reg(uint8_t reg, uint8_t *p_value)
+static bool i2cdev_read_regs(uint8_t reg, uint8_t *p_buffer, uint16_t length)
 {
-	L3GD20H_DEBUG("[L3GD20H_DEBUG] Reading byte from reg 0x%02x.\n",
-		      reg);
+	if (length <= I2C_SMBUS_BLOCK_MAX) {
+		int ret = i2c_smbus_read_i2c_block_data(m_fd, reg, length,
+							p_buffer);
+		if (ret == -1) {
+			fprintf(stderr, "[L3GD20H] Failed to read register %d.\n", reg);
+			return false;
+		}
 
-	int ret = i2c_smbus_read_i2c_block_data(m_fd, reg, 1, p_value);
-	if (ret == -1) {
-		fprintf(stderr, "[L3GD20H] Failed to read register %d.\n", reg);
+		return true;
+	}
+
+	/* Plain I2C combined transaction, not limited to the 32 bytes of an
+	   SMBus block read */
+	struct i2c_msg msgs[2];
+	struct i2c_rdwr_ioctl_data xfer;
+
+	msgs[0].addr = m_addr;
+	msgs[0].flags = 0;
+	msgs[0].len = 1;
+	msgs[0].buf = &reg;
+
+	msgs[1].addr = m_addr;
+	msgs[1].flags = I2C_M_RD;
+	msgs[1].len = length;
+	msgs[1].buf = p_buffer;
+
+	xfer.msgs = msgs;
+	xfer.nmsgs = 2;
+
+	if (ioctl(m_fd, I2C_RDWR, &xfer) == -1) {
+		fprintf(stderr, "[L3GD20H] Failed to burst read register %d.\n", reg);
 		return false;
 	}
 
 	return true;
 }
 
-static bool l3gd20h_read_block(uint8_t reg, uint8_t *p_buffer, uint8_t length)
+static bool i2cdev_close(void)
 {
-	int ret = i2c_smbus_read_i2c_block_data(m_fd, reg, length, p_buffer);
-	if (ret == -1) {
-		fprintf(stderr, "[L3GD20H] Failed to read register %d.\n", reg);
+	if (close(m_fd) == -1) {
+		perror("[L3GD20H] Failed to close I2C bus.\n");
 		return false;
 	}
 
 	return true;
 }
 
+static bool l3gd20h_write_reg(uint8_t reg, uint8_t value)
+{
+	L3GD20H_DEBUG("[L3GD20H_DEBUG] Writing value 0x%02x to reg 0x%02x.\n",
+		      value, reg);
+
+	return m_bus->write_reg(reg, value);
+}
+
+static bool l3gd20h_read_reg(uint8_t reg, uint8_t *p_value)
+{
+	L3GD20H_DEBUG("[L3GD20H_DEBUG] Reading byte from reg 0x%02x.\n",
+		      reg);
+
+	return m_bus->read_regs(reg, p_value, 1);
+}
+
+static bool l3gd20h_read_block(uint8_t reg, uint8_t *p_buffer, uint16_t length)
+{
+	return m_bus->read_regs(reg, p_buffer, length);
+}
+
 bool l3gd20h_init(char *p_path, uint8_t i2c_addr, l3gd20h_init_t *p_init)
+{
+	/* Open bus */
+	if ((m_fd = open(p_path, O_RDWR)) == -1) {
+		fprintf(stderr, "[L3GD20H] Can't open I2C bus %s.\n", p_path);
+		return false;
+	}
+
+	if (ioctl(m_fd, I2C_SLAVE, i2c_addr) == -1) {
+		perror("[L3GD20H] Can't find I2C device.\n");
+		return false;
+	}
+
+	m_addr = i2c_addr;
+
+	return l3gd20h_init_bus(&m_i2cdev_bus, p_init);
+}
+
+bool l3gd20h_init_bus(const l3gd20h_bus_t *p_bus, l3gd20h_init_t *p_init)
 {
 	uint8_t ctrl1_reg_value = 0;
 	uint8_t ctrl4_reg_value = 0;
@@ -108,66 +190,71 @@ bool l3gd20h_init(char *p_path, uint8_t i2c_addr, l3gd20h_init_t *p_init)
 	switch (p_init->data_rate) {
 	case L3GD20H_DATA_RATE_12_5HZ_NO_CUTOFF:
 		low_odr_reg_value |= GYRO_BIT_LOW_ODR_LOW_ODR;
+		m_data_rate_hz = 12.5f;
 		break;
 	case L3GD20H_DATA_RATE_25HZ_NO_CUTOFF:
 		low_odr_reg_value |= GYRO_BIT_LOW_ODR_LOW_ODR;
 		ctrl1_reg_value |= GYRO_BIT_CTRL1_DR0;
+		m_data_rate_hz = 25.0f;
 		break;
 	case L3GD20H_DATA_RATE_50HZ_CUTOFF_16_6HZ:
 		low_odr_reg_value |= GYRO_BIT_LOW_ODR_LOW_ODR;
 		ctrl1_reg_value |= GYRO_BIT_CTRL1_DR1;
+		m_data_rate_hz = 50.0f;
 		break;
 	case L3GD20H_DATA_RATE_100HZ_CUTOFF_12_5HZ:
+		m_data_rate_hz = 100.0f;
 		break;
 	case L3GD20H_DATA_RATE_100HZ_CUTOFF_25HZ:
 		ctrl1_reg_value |= GYRO_BIT_CTRL1_BW0;
+		m_data_rate_hz = 100.0f;
 		break;
 	case L3GD20H_DATA_RATE_200HZ_CUTOFF_12_5HZ:
 		ctrl1_reg_value |= GYRO_BIT_CTRL1_DR0;
+		m_data_rate_hz = 200.0f;
 		break;
 	case L3GD20H_DATA_RATE_200HZ_CUTOFF_70HZ:
 		ctrl1_reg_value |= (GYRO_BIT_CTRL1_DR0 | GYRO_BIT_CTRL1_BW1 |
 				    GYRO_BIT_CTRL1_BW0);
+		m_data_rate_hz = 200.0f;
 		break;
 	case L3GD20H_DATA_RATE_400HZ_CUTOFF_20HZ:
 		ctrl1_reg_value |= GYRO_BIT_CTRL1_DR1;
+		m_data_rate_hz = 400.0f;
 		break;
 	case L3GD20H_DATA_RATE_400HZ_CUTOFF_25HZ:
 		ctrl1_reg_value |= (GYRO_BIT_CTRL1_DR1 | GYRO_BIT_CTRL1_BW0);
+		m_data_rate_hz = 400.0f;
 		break;
 	case L3GD20H_DATA_RATE_400HZ_CUTOFF_50HZ:
 		ctrl1_reg_value |= (GYRO_BIT_CTRL1_DR1 | GYRO_BIT_CTRL1_BW1);
+		m_data_rate_hz = 400.0f;
 		break;
 	case L3GD20H_DATA_RATE_400HZ_CUTOFF_110HZ:
 		ctrl1_reg_value |= (GYRO_BIT_CTRL1_DR1 | GYRO_BIT_CTRL1_BW1 |
 				    GYRO_BIT_CTRL1_BW0);
+		m_data_rate_hz = 400.0f;
 		break;
 	case L3GD20H_DATA_RATE_800HZ_CUTOFF_30HZ:
 		ctrl1_reg_value |= (GYRO_BIT_CTRL1_DR1 | GYRO_BIT_CTRL1_DR0);
+		m_data_rate_hz = 800.0f;
 		break;
 	case L3GD20H_DATA_RATE_800HZ_CUTOFF_35HZ:
 		ctrl1_reg_value |= (GYRO_BIT_CTRL1_DR1 | GYRO_BIT_CTRL1_DR0 |
 				    GYRO_BIT_CTRL1_BW0);
+		m_data_rate_hz = 800.0f;
 		break;
 	case L3GD20H_DATA_RATE_800HZ_CUTOFF_100HZ:
 		ctrl1_reg_value |= (GYRO_BIT_CTRL1_DR1 | GYRO_BIT_CTRL1_DR0 |
 				    GYRO_BIT_CTRL1_BW1 | GYRO_BIT_CTRL1_BW0);
+		m_data_rate_hz = 800.0f;
 		break;
 	default:
 		perror("[L3GD20H] Unknown l3gd20h_data_rate_t.\n");
 		return false;
 	}
 
-	/* Open bus */
-	if ((m_fd = open(p_path, O_RDWR)) == -1) {
-		fprintf(stderr, "[L3GD20H] Can't open I2C bus %s.\n", p_path);
-		return false;
-	}
-
-	if (ioctl(m_fd, I2C_SLAVE, i2c_addr) == -1) {
-		perror("[L3GD20H] Can't find I2C device.\n");
-		return false;
-	}
+	m_bus = p_bus;
 
 	/* Test chip ID */
 	l3gd20h_read_reg(GYRO_REG_WHO_AM_I, &reg_value);
@@ -201,6 +288,8 @@ bool l3gd20h_init(char *p_path, uint8_t i2c_addr, l3gd20h_init_t *p_init)
 	if (!l3gd20h_write_reg(GYRO_REG_CTRL4, ctrl4_reg_value))
 		return false;
 
+	m_ctrl5_reg_value = 0;
+
 	if (p_init->enable_lowpass || p_init->enable_highpass) {
 		uint8_t val = 0;
 
@@ -212,6 +301,8 @@ bool l3gd20h_init(char *p_path, uint8_t i2c_addr, l3gd20h_init_t *p_init)
 
 		if (!l3gd20h_write_reg(GYRO_REG_CTRL5, val))
 			return false;
+
+		m_ctrl5_reg_value = val;
 	}
 
 	/* Enable X, Y and Z axes and enter the Normal Mode */
@@ -265,6 +356,71 @@ bool l3gd20h_read(l3gd20h_data_t *p_data, bool read_overrun_and_temperature)
 	return true;
 }
 
+bool l3gd20h_fifo_init(void)
+{
+	/* Stream mode: the FIFO keeps the newest 32 samples, the oldest are
+	   overwritten when it is not drained in time. Reads are paced by the
+	   caller, so no watermark is set. */
+	if (!l3gd20h_write_reg(GYRO_REG_FIFO_CTRL, GYRO_BIT_FIFO_CTRL_STREAM))
+		return false;
+
+	m_ctrl5_reg_value |= GYRO_BIT_CTRL5_FIFO_EN;
+
+	return l3gd20h_write_reg(GYRO_REG_CTRL5, m_ctrl5_reg_value);
+}
+
+bool l3gd20h_fifo_read(l3gd20h_data_t *p_data, int max_count, int *p_count)
+{
+	uint8_t buffer[L3GD20H_FIFO_SIZE * 6];
+	uint8_t fifo_src;
+
+	*p_count = 0;
+
+	if (!l3gd20h_read_reg(GYRO_REG_FIFO_SRC, &fifo_src))
+		return false;
+
+	if ((fifo_src & GYRO_BIT_FIFO_SRC_EMPTY) != 0)
+		return true;
+
+	/* FSS only counts up to 31, OVRN means all 32 levels are filled */
+	bool full = (fifo_src & GYRO_BIT_FIFO_SRC_OVRN) != 0;
+	int count = full ? L3GD20H_FIFO_SIZE :
+		(fifo_src & GYRO_MASK_FIFO_SRC_FSS);
+
+	if (count > max_count)
+		count = max_count;
+
+	/* In FIFO mode the auto-increment wraps from OUT_Z_H back to OUT_X_L,
+	   so the whole FIFO comes out in one transaction */
+	if (!l3gd20h_read_block((GYRO_REG_OUT_X_L | GYRO_AUTO_INCREMENT),
+				buffer, count * 6))
+		return false;
+
+	for (int i = 0; i < count; i++) {
+		uint8_t *p_buf = buffer + i*6;
+		int16_t x = (int16_t)(p_buf[0] | (p_buf[1] << 8));
+		int16_t y = (int16_t)(p_buf[2] | (p_buf[3] << 8));
+		int16_t z = (int16_t)(p_buf[4] | (p_buf[5] << 8));
+
+		p_data[i].rate_x = (float)x * m_sensitivity / 1000;
+		p_data[i].rate_y = (float)y * m_sensitivity / 1000;
+		p_data[i].rate_z = (float)z * m_sensitivity / 1000;
+		p_data[i].temperature = 0;
+
+		/* A full FIFO may have overwritten samples before the oldest */
+		p_data[i].overrun = (i == 0 && full);
+	}
+
+	*p_count = count;
+
+	return true;
+}
+
+float l3gd20h_data_rate_hz(void)
+{
+	return m_data_rate_hz;
+}
+
 bool l3gd20h_read_temperature(int8_t *p_temperature)
 {
 	uint8_t reg_value;
@@ -284,10 +440,5 @@ bool l3gd20h_close(void)
 		return false;
 
 	/* Close bus */
-	if (close(m_fd) == -1) {
-		perror("[L3GD20H] Failed to close I2C bus.\n");
-		return false;
-	}
-
-	return true;
+	return m_bus->close();
 }
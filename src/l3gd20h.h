@@ -10,6 +10,8 @@ extern "C" {
 
 /* #define L3GD20H_I2C_ADDRESS	0x6b */
 
+#define L3GD20H_FIFO_SIZE	32
+
 #ifdef DEBUG
 #define L3GD20H_DEBUG		printf
 #else
@@ -54,9 +56,26 @@ typedef struct {
 	bool overrun; /* Readout speed is insufficient */
 } l3gd20h_data_t;
 
+/* Register-level bus backend. l3gd20h_init() uses the Linux i2c-dev one,
+   l3gd20h_init_bus() accepts any other (e.g. l3gd20h_sim_bus()). The
+   auto-increment flag is passed in bit 7 of reg. */
+typedef struct {
+	bool (*write_reg)(uint8_t reg, uint8_t value);
+	bool (*read_regs)(uint8_t reg, uint8_t *p_buffer, uint16_t length);
+	bool (*close)(void);
+} l3gd20h_bus_t;
+
 bool l3gd20h_init(char *p_path, uint8_t i2c_addr, l3gd20h_init_t *p_init);
+bool l3gd20h_init_bus(const l3gd20h_bus_t *p_bus, l3gd20h_init_t *p_init);
 bool l3gd20h_read(l3gd20h_data_t *p_data, bool read_overrun_and_temperature);
 bool l3gd20h_read_temperature(int8_t *p_temperature);
+
+/* FIFO stream mode: l3gd20h_fifo_read() drains up to max_count samples
+   (oldest first) in one burst. A full FIFO is flagged as overrun on the
+   first sample. */
+bool l3gd20h_fifo_init(void);
+bool l3gd20h_fifo_read(l3gd20h_data_t *p_data, int max_count, int *p_count);
+float l3gd20h_data_rate_hz(void);
 bool l3gd20h_close(void);
 
 #ifdef __cplusplus
@@ -0,0 +1,371 @@
+#include "l3gd20h_sim.h"
+
+#include <pthread.h>
+#include <string.h>
+#include "rng.h"
+#include "util.h"
+
+#define SIM_AUTO_INCREMENT	(1 << 7)
+#define SIM_REG_COUNT		0x40
+#define SIM_FIFO_SIZE		32
+
+#define SIM_REG_WHO_AM_I	0x0f
+#define SIM_REG_CTRL1		0x20
+#define SIM_REG_CTRL4		0x23
+#define SIM_REG_CTRL5		0x24
+#define SIM_REG_OUT_TEMP	0x26
+#define SIM_REG_STATUS		0x27
+#define SIM_REG_OUT_X_L		0x28
+#define SIM_REG_OUT_Z_H		0x2d
+#define SIM_REG_FIFO_CTRL	0x2e
+#define SIM_REG_FIFO_SRC	0x2f
+#define SIM_REG_LOW_ODR		0x39
+
+#define SIM_WHO_AM_I		0xd7
+#define SIM_CTRL1_DEFAULT	0x07
+
+#define SIM_BIT_CTRL1_PD	(1 << 3)
+#define SIM_BIT_CTRL5_FIFO_EN	(1 << 6)
+#define SIM_BIT_STATUS_ZYXDA	(1 << 3)
+#define SIM_BIT_STATUS_ZYXOR	(1 << 7)
+#define SIM_BIT_FIFO_SRC_FTH	(1 << 7)
+#define SIM_BIT_FIFO_SRC_OVRN	(1 << 6)
+#define SIM_BIT_FIFO_SRC_EMPTY	(1 << 5)
+#define SIM_BIT_LOW_ODR_SW_RES	(1 << 2)
+#define SIM_BIT_LOW_ODR_LOW_ODR	(1 << 0)
+
+#define SIM_FIFO_MODE_BYPASS	0
+#define SIM_FIFO_MODE_FIFO	1
+#define SIM_FIFO_MODE_STREAM	2
+
+typedef struct {
+	int16_t v[3];
+} sim_sample_t;
+
+static struct {
+	pthread_mutex_t mutex;
+
+	uint8_t regs[SIM_REG_COUNT];
+
+	int64_t t_start; /* Power-up time [us] */
+	uint64_t produced; /* Samples produced since power-up */
+
+	sim_sample_t out; /* Newest sample (bypass mode) */
+
+	sim_sample_t fifo[SIM_FIFO_SIZE];
+	int fifo_head;
+	int fifo_count;
+
+	float rate[3];
+	float noise;
+	int temperature;
+	rng_t rng;
+
+	unsigned long transactions;
+	unsigned long bytes;
+} m_sim = { PTHREAD_MUTEX_INITIALIZER };
+
+static void sim_reset(void)
+{
+	memset(m_sim.regs, 0, sizeof(m_sim.regs));
+	m_sim.regs[SIM_REG_WHO_AM_I] = SIM_WHO_AM_I;
+	m_sim.regs[SIM_REG_CTRL1] = SIM_CTRL1_DEFAULT;
+
+	m_sim.produced = 0;
+	m_sim.fifo_head = 0;
+	m_sim.fifo_count = 0;
+	memset(&m_sim.out, 0, sizeof(m_sim.out));
+}
+
+static float sim_odr_hz(void)
+{
+	static const float odr[2][4] = {
+		{ 100.0f, 200.0f, 400.0f, 800.0f },
+		{ 12.5f, 25.0f, 50.0f, 50.0f }
+	};
+
+	int low = (m_sim.regs[SIM_REG_LOW_ODR] & SIM_BIT_LOW_ODR_LOW_ODR) ? 1 : 0;
+	int dr = (m_sim.regs[SIM_REG_CTRL1] >> 6) & 0x03;
+
+	return odr[low][dr];
+}
+
+static float sim_sensitivity(void)
+{
+	switch ((m_sim.regs[SIM_REG_CTRL4] >> 4) & 0x03) {
+	case 0:
+		return 8.75f;
+	case 1:
+		return 17.5f;
+	default:
+		return 70.0f;
+	}
+}
+
+static int sim_fifo_mode(void)
+{
+	if ((m_sim.regs[SIM_REG_CTRL5] & SIM_BIT_CTRL5_FIFO_EN) == 0)
+		return SIM_FIFO_MODE_BYPASS;
+
+	switch (m_sim.regs[SIM_REG_FIFO_CTRL] >> 5) {
+	case 1:
+		return SIM_FIFO_MODE_FIFO;
+	case 2:
+		return SIM_FIFO_MODE_STREAM;
+	default:
+		return SIM_FIFO_MODE_BYPASS;
+	}
+}
+
+static void sim_produce(void)
+{
+	sim_sample_t sample;
+	float sensitivity = sim_sensitivity();
+
+	for (int i = 0; i < 3; i++) {
+		float noise = m_sim.noise * (2.0f * rng_next(&m_sim.rng) / 4294967296.0f - 1.0f);
+		float raw = (m_sim.rate[i] + noise) * 1000.0f / sensitivity;
+
+		if (raw > 32767.0f)
+			raw = 32767.0f;
+		else if (raw < -32768.0f)
+			raw = -32768.0f;
+
+		sample.v[i] = (int16_t)raw;
+	}
+
+	if ((m_sim.regs[SIM_REG_STATUS] & SIM_BIT_STATUS_ZYXDA) != 0)
+		m_sim.regs[SIM_REG_STATUS] |= SIM_BIT_STATUS_ZYXOR;
+	m_sim.regs[SIM_REG_STATUS] |= SIM_BIT_STATUS_ZYXDA;
+	m_sim.out = sample;
+
+	switch (sim_fifo_mode()) {
+	case SIM_FIFO_MODE_FIFO:
+		if (m_sim.fifo_count == SIM_FIFO_SIZE)
+			return;
+		break;
+	case SIM_FIFO_MODE_STREAM:
+		if (m_sim.fifo_count == SIM_FIFO_SIZE) {
+			/* Oldest sample is overwritten */
+			m_sim.fifo_head = (m_sim.fifo_head + 1) % SIM_FIFO_SIZE;
+			m_sim.fifo_count--;
+		}
+		break;
+	default:
+		return;
+	}
+
+	int tail = (m_sim.fifo_head + m_sim.fifo_count) % SIM_FIFO_SIZE;
+	m_sim.fifo[tail] = sample;
+	m_sim.fifo_count++;
+}
+
+/* Produces the samples due since the last bus access */
+static void sim_update(void)
+{
+	if ((m_sim.regs[SIM_REG_CTRL1] & SIM_BIT_CTRL1_PD) == 0)
+		return;
+
+	uint64_t due = (uint64_t)((microseconds_monotonic() - m_sim.t_start) *
+				  (double)sim_odr_hz() / 1000000.0);
+
+	/* More than a FIFO worth of samples only matters for the flags */
+	if (due > m_sim.produced + 2*SIM_FIFO_SIZE)
+		m_sim.produced = due - 2*SIM_FIFO_SIZE;
+
+	while (m_sim.produced < due) {
+		sim_produce();
+		m_sim.produced++;
+	}
+}
+
+static uint8_t sim_read_byte(uint8_t reg)
+{
+	uint8_t value;
+	int mode = sim_fifo_mode();
+
+	if (reg >= SIM_REG_OUT_X_L && reg <= SIM_REG_OUT_Z_H) {
+		int idx = reg - SIM_REG_OUT_X_L;
+		sim_sample_t *p_sample = &m_sim.out;
+
+		if (mode != SIM_FIFO_MODE_BYPASS && m_sim.fifo_count > 0)
+			p_sample = &m_sim.fifo[m_sim.fifo_head];
+
+		uint16_t v = (uint16_t)p_sample->v[idx/2];
+		value = (idx & 1) ? (v >> 8) : (v & 0xff);
+
+		if (reg == SIM_REG_OUT_Z_H) {
+			m_sim.regs[SIM_REG_STATUS] &= ~(SIM_BIT_STATUS_ZYXDA |
+							SIM_BIT_STATUS_ZYXOR);
+
+			/* Reading OUT_Z_H pops the sample from the FIFO */
+			if (mode != SIM_FIFO_MODE_BYPASS && m_sim.fifo_count > 0) {
+				m_sim.fifo_head = (m_sim.fifo_head + 1) % SIM_FIFO_SIZE;
+				m_sim.fifo_count--;
+			}
+		}
+
+		return value;
+	}
+
+	switch (reg) {
+	case SIM_REG_OUT_TEMP:
+		return (uint8_t)(int8_t)(m_sim.temperature - 25);
+	case SIM_REG_FIFO_SRC:
+		value = (uint8_t)(m_sim.fifo_count & 0x1f);
+		if (m_sim.fifo_count == 0)
+			value |= SIM_BIT_FIFO_SRC_EMPTY;
+		if (m_sim.fifo_count >= (m_sim.regs[SIM_REG_FIFO_CTRL] & 0x1f))
+			value |= SIM_BIT_FIFO_SRC_FTH;
+		/* OVRN: all levels filled, FSS wraps to 0 */
+		if (m_sim.fifo_count == SIM_FIFO_SIZE)
+			value |= SIM_BIT_FIFO_SRC_OVRN;
+		return value;
+	default:
+		return m_sim.regs[reg];
+	}
+}
+
+static bool sim_write_reg(uint8_t reg, uint8_t value)
+{
+	pthread_mutex_lock(&m_sim.mutex);
+
+	reg &= ~SIM_AUTO_INCREMENT;
+	m_sim.transactions++;
+
+	if (reg >= SIM_REG_COUNT) {
+		pthread_mutex_unlock(&m_sim.mutex);
+		return false;
+	}
+
+	sim_update();
+
+	switch (reg) {
+	case SIM_REG_LOW_ODR:
+		if ((value & SIM_BIT_LOW_ODR_SW_RES) != 0) {
+			/* Reset completes immediately, the bit reads back 0 */
+			sim_reset();
+			break;
+		}
+		m_sim.regs[reg] = value;
+		break;
+	case SIM_REG_CTRL1:
+		if ((value & SIM_BIT_CTRL1_PD) != 0 &&
+		    (m_sim.regs[reg] & SIM_BIT_CTRL1_PD) == 0) {
+			m_sim.t_start = microseconds_monotonic();
+			m_sim.produced = 0;
+		}
+		m_sim.regs[reg] = value;
+		break;
+	case SIM_REG_FIFO_CTRL:
+		/* Changing mode empties the FIFO */
+		if ((value >> 5) != (m_sim.regs[reg] >> 5))
+			m_sim.fifo_count = 0;
+		m_sim.regs[reg] = value;
+		break;
+	case SIM_REG_WHO_AM_I:
+	case SIM_REG_OUT_TEMP:
+	case SIM_REG_STATUS:
+	case SIM_REG_FIFO_SRC:
+		/* Read-only */
+		break;
+	default:
+		m_sim.regs[reg] = value;
+		break;
+	}
+
+	pthread_mutex_unlock(&m_sim.mutex);
+
+	return true;
+}
+
+static bool sim_read_regs(uint8_t reg, uint8_t *p_buffer, uint16_t length)
+{
+	pthread_mutex_lock(&m_sim.mutex);
+
+	bool auto_increment = (reg & SIM_AUTO_INCREMENT) != 0;
+	reg &= ~SIM_AUTO_INCREMENT;
+	m_sim.transactions++;
+	m_sim.bytes += length;
+
+	if (reg >= SIM_REG_COUNT) {
+		pthread_mutex_unlock(&m_sim.mutex);
+		return false;
+	}
+
+	sim_update();
+
+	bool fifo = (sim_fifo_mode() != SIM_FIFO_MODE_BYPASS);
+
+	for (int i = 0; i < length; i++) {
+		p_buffer[i] = sim_read_byte(reg);
+
+		if (!auto_increment)
+			continue;
+
+		/* In FIFO mode the address wraps from OUT_Z_H to OUT_X_L */
+		if (fifo && reg == SIM_REG_OUT_Z_H)
+			reg = SIM_REG_OUT_X_L;
+		else
+			reg = (reg + 1) % SIM_REG_COUNT;
+	}
+
+	pthread_mutex_unlock(&m_sim.mutex);
+
+	return true;
+}
+
+static bool sim_close(void)
+{
+	return true;
+}
+
+static const l3gd20h_bus_t m_sim_bus = {
+	sim_write_reg,
+	sim_read_regs,
+	sim_close
+};
+
+const l3gd20h_bus_t *l3gd20h_sim_bus(void)
+{
+	pthread_mutex_lock(&m_sim.mutex);
+	sim_reset();
+	rng_seed(&m_sim.rng, 1, 0);
+	m_sim.transactions = 0;
+	m_sim.bytes = 0;
+	m_sim.temperature = 25;
+	pthread_mutex_unlock(&m_sim.mutex);
+
+	return &m_sim_bus;
+}
+
+void l3gd20h_sim_set_rate(float rate_x, float rate_y, float rate_z)
+{
+	pthread_mutex_lock(&m_sim.mutex);
+	m_sim.rate[0] = rate_x;
+	m_sim.rate[1] = rate_y;
+	m_sim.rate[2] = rate_z;
+	pthread_mutex_unlock(&m_sim.mutex);
+}
+
+void l3gd20h_sim_set_noise(float noise)
+{
+	pthread_mutex_lock(&m_sim.mutex);
+	m_sim.noise = noise;
+	pthread_mutex_unlock(&m_sim.mutex);
+}
+
+void l3gd20h_sim_set_temperature(int temperature)
+{
+	pthread_mutex_lock(&m_sim.mutex);
+	m_sim.temperature = temperature;
+	pthread_mutex_unlock(&m_sim.mutex);
+}
+
+void l3gd20h_sim_get_stats(unsigned long *p_transactions, unsigned long *p_bytes)
+{
+	pthread_mutex_lock(&m_sim.mutex);
+	*p_transactions = m_sim.transactions;
+	*p_bytes = m_sim.bytes;
+	pthread_mutex_unlock(&m_sim.mutex);
+}
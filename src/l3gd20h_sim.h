@@ -0,0 +1,28 @@
+#ifndef L3GD20H_SIM_H
+#define L3GD20H_SIM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "l3gd20h.h"
+
+/* Register-level L3GD20H model for hardware-free testing. Samples are
+   produced in real time at the configured ODR; the 32-level FIFO (bypass,
+   FIFO and stream modes), overrun flags, FIFO_SRC, auto-increment with the
+   OUT_X_L..OUT_Z_H wrap, software reset and WHO_AM_I are emulated. */
+
+const l3gd20h_bus_t *l3gd20h_sim_bus(void);
+
+void l3gd20h_sim_set_rate(float rate_x, float rate_y, float rate_z); /* [deg/s] */
+void l3gd20h_sim_set_noise(float noise); /* Uniform noise amplitude [deg/s] */
+void l3gd20h_sim_set_temperature(int temperature); /* [deg C] */
+
+/* Bus statistics (transactions and bytes read since start) */
+void l3gd20h_sim_get_stats(unsigned long *p_transactions, unsigned long *p_bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
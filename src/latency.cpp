@@ -0,0 +1,149 @@
+#include "latency.h"
+
+#include <atomic>
+#include <stdlib.h>
+#include <algorithm>
+
+/* Values below 2*LATENCY_SUB_BUCKETS us are exact, above that each power of
+   two is split into LATENCY_SUB_BUCKETS buckets (HdrHistogram layout) */
+#define LATENCY_SUB_BITS	5
+#define LATENCY_SUB_BUCKETS	(1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS		((32 - LATENCY_SUB_BITS) * LATENCY_SUB_BUCKETS + \
+				 2 * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+	std::atomic<uint32_t> buckets[LATENCY_BUCKETS];
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> sum;
+	std::atomic<uint32_t> max;
+} histogram_t;
+
+static const char *m_names[LATENCY_STAGE_COUNT] = {
+	"ingest",
+	"queue wait",
+	"stats",
+	"undistort",
+	"compensate",
+	"ransac",
+	"mavlink send",
+	"end to end",
+	"serial wire"
+};
+
+static histogram_t m_histograms[LATENCY_STAGE_COUNT];
+
+static inline int bucket_index(uint32_t v)
+{
+	if (v < 2 * LATENCY_SUB_BUCKETS)
+		return v;
+
+	int shift = (31 - __builtin_clz(v)) - LATENCY_SUB_BITS;
+
+	return shift * LATENCY_SUB_BUCKETS + (v >> shift);
+}
+
+/* Highest value that falls into the bucket */
+static inline uint32_t bucket_value(int i)
+{
+	if (i < 2 * LATENCY_SUB_BUCKETS)
+		return i;
+
+	int shift = i / LATENCY_SUB_BUCKETS - 1;
+	uint32_t sub = i % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS;
+
+	return ((sub + 1) << shift) - 1;
+}
+
+void latency_record(latency_stage_t stage, int64_t us)
+{
+	histogram_t *p_hist = &m_histograms[stage];
+	uint32_t v = (us < 0) ? 0 : (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+
+	p_hist->buckets[bucket_index(v)].fetch_add(1, std::memory_order_relaxed);
+	p_hist->count.fetch_add(1, std::memory_order_relaxed);
+	p_hist->sum.fetch_add(v, std::memory_order_relaxed);
+
+	uint32_t max = p_hist->max.load(std::memory_order_relaxed);
+	while (v > max && !p_hist->max.compare_exchange_weak(max, v,
+							      std::memory_order_relaxed))
+		;
+}
+
+static uint32_t percentile(const uint32_t *p_buckets, uint64_t count,
+			   double p, uint32_t max)
+{
+	uint64_t rank = (uint64_t)(p * count + 0.5);
+	uint64_t seen = 0;
+
+	if (rank < 1)
+		rank = 1;
+
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += p_buckets[i];
+		if (seen >= rank)
+			return std::min(bucket_value(i), max);
+	}
+
+	return max;
+}
+
+void latency_dump(FILE *p_file)
+{
+	uint32_t buckets[LATENCY_BUCKETS];
+
+	fprintf(p_file, "%-14s %10s %8s %8s %8s %8s %8s\n", "latency [us]",
+		"count", "mean", "p50", "p99", "p99.9", "max");
+
+	for (int s = 0; s < LATENCY_STAGE_COUNT; s++) {
+		histogram_t *p_hist = &m_histograms[s];
+		uint64_t count = 0;
+
+		/* Not an atomic snapshot, recording goes on meanwhile; the
+		   bucket total is used so the percentiles are consistent */
+		for (int i = 0; i < LATENCY_BUCKETS; i++) {
+			buckets[i] = p_hist->buckets[i].load(std::memory_order_relaxed);
+			count += buckets[i];
+		}
+
+		uint32_t max = p_hist->max.load(std::memory_order_relaxed);
+		uint64_t sum = p_hist->sum.load(std::memory_order_relaxed);
+		uint64_t sum_count = p_hist->count.load(std::memory_order_relaxed);
+
+		if (count == 0) {
+			fprintf(p_file, "%-14s %10d\n", m_names[s], 0);
+			continue;
+		}
+
+		fprintf(p_file, "%-14s %10llu %8llu %8u %8u %8u %8u\n",
+			m_names[s], (unsigned long long)count,
+			(unsigned long long)(sum_count > 0 ? sum / sum_count : 0),
+			percentile(buckets, count, 0.5, max),
+			percentile(buckets, count, 0.99, max),
+			percentile(buckets, count, 0.999, max), max);
+	}
+
+	fflush(p_file);
+}
+
+void latency_reset(void)
+{
+	for (int s = 0; s < LATENCY_STAGE_COUNT; s++) {
+		histogram_t *p_hist = &m_histograms[s];
+
+		for (int i = 0; i < LATENCY_BUCKETS; i++)
+			p_hist->buckets[i].store(0, std::memory_order_relaxed);
+		p_hist->count.store(0, std::memory_order_relaxed);
+		p_hist->sum.store(0, std::memory_order_relaxed);
+		p_hist->max.store(0, std::memory_order_relaxed);
+	}
+}
+
+static void latency_dump_stderr(void)
+{
+	latency_dump(stderr);
+}
+
+void latency_init(void)
+{
+	atexit(latency_dump_stderr);
+}
@@ -0,0 +1,31 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "common.h"
+
+typedef enum {
+	LATENCY_INGEST = 0, /* cv_process_imv() */
+	LATENCY_QUEUE_WAIT, /* From the IMV queue to the frame thread */
+	LATENCY_STATS, /* cv_imv::stats() */
+	LATENCY_UNDISTORT,
+	LATENCY_COMPENSATE, /* Gyro integration and correction */
+	LATENCY_RANSAC, /* transform_estimate_rigid(), including IRLS */
+	LATENCY_MAVLINK_SEND, /* One send of a sink */
+	LATENCY_END_TO_END, /* Capture (PTS) to the send of the flow message
+			       by the first sink */
+	LATENCY_SERIAL_WIRE, /* Serial write() to the last byte on the wire */
+	LATENCY_STAGE_COUNT
+} latency_stage_t;
+
+/* Always on: a few relaxed atomic adds, safe from any thread. Values are
+   kept in log-linear buckets with a relative error below 1/32. */
+void latency_record(latency_stage_t stage, int64_t us);
+
+/* count, p50, p99, p99.9 and max [us] of every stage */
+void latency_dump(FILE *p_file);
+void latency_reset(void);
+
+/* Dumps to stderr at exit */
+void latency_init(void);
+
+#endif
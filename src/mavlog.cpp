@@ -2,23 +2,19 @@
 
 /* Inspired by example code at http://qgroundcontrol.org/dev/mavlink_linux_integration_tutorial */
 
-#include <unistd.h>
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include <stdio.h>
 
-#include "cv_queue.h"
+#include "evloop.h"
+#include "mavsink.h"
+#include "predict.h"
+#include "seqlock.h"
+#include "trace.h"
 #include "sensors.h"
 #include "mavlink.h"
 
-/* TODO: Make this configurable (14550 is the default port for QGroundControl) */
-/* TODO: Allow hostname */
-#define MAVLOG_TARGET_IP		"192.168.42.42"
-#define MAVLOG_PORT			14550
+/* Without a sink= option (14550 is the default port for QGroundControl) */
+#define MAVLOG_DEFAULT_SINK		"udp:192.168.42.42:14550"
 
-/* TODO: Adjust */
-#define MAVLOG_BUFFER_SIZE		1024
 #define MAVLOG_HEARTBEAT_PERIOD_MS	1000
 
 /* TODO: Determine correct values */
@@ -29,53 +25,33 @@
 /* Conversion: */
 #define PX2M		0.0019 /* (b*s)/f */
 
-static pthread_t m_mavlink_thread;
-static pthread_t m_heartbeat_thread;
-static cv_queue<mavlink_message_t> m_msq_queue;
+/* Header fields of the mavlink_msg_*_send() functions */
+mavlink_system_t mavlink_system = { MAVLOG_SYSTEM_ID, MAVLOG_COMPONENT_ID };
+
 static volatile bool m_initialized;
 static volatile bool m_run;
+static mavlog_stream_t m_stream; /* Of the live camera */
+static bool m_default_sink = true; /* No sink given */
 
-static void *mavlink_thread(void *ptr)
-{
-	int target_sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	struct sockaddr_in target_addr;
-	uint8_t buffer[MAVLOG_BUFFER_SIZE];
-	mavlink_message_t msg;
-  
-	memset(&target_addr, 0, sizeof(target_addr));
-	target_addr.sin_family = AF_INET;
-	target_addr.sin_addr.s_addr = inet_addr(MAVLOG_TARGET_IP);
-	target_addr.sin_port = htons(MAVLOG_PORT);
-
-	DBG("mavlog_thread(): Sending MavLink packets to " <<
-	    MAVLOG_TARGET_IP << ":" << MAVLOG_PORT);
-
-	while (m_run) {
-		mavlink_message_t msg = m_msq_queue.remove();
-		int len = mavlink_msg_to_send_buffer(buffer, &msg);
-		int bytes_sent = sendto(target_sock, buffer, len, 0,
-					(struct sockaddr*)&target_addr,
-					sizeof(target_addr));
-
-		if (bytes_sent <= 0)
-			ERR("mavlog_thread(): Unable to send bytes");
-	}
-}
+/* Prediction mode: updated by the frame thread, read at the gyro rate */
+static bool m_predict_enabled;
+static seqlock<predict_t> m_predict;
+static predict_t m_predict_writer;
+static int64_t m_predict_prev_t; /* Event loop only */
 
-static void *heartbeat_thread(void *ptr)
+/* Runs on the event loop every MAVLOG_HEARTBEAT_PERIOD_MS */
+static void heartbeat_handler(void *ptr)
 {
-	mavlink_message_t msg;
+	if (!m_run)
+		return;
 
-	while (m_run) {
-		mavlink_msg_heartbeat_pack(MAVLOG_SYSTEM_ID,
-					   MAVLOG_COMPONENT_ID, &msg,
-					   MAV_TYPE_GENERIC,
-					   MAV_AUTOPILOT_INVALID, 0, 0,
-					   MAV_STATE_ACTIVE);
-		m_msq_queue.add(msg);
+	mavsink_batch_t *p_batch = mavsink_batch_get(0);
+	if (p_batch == NULL)
+		return;
 
-		usleep(MAVLOG_HEARTBEAT_PERIOD_MS * 1000UL);
-	}
+	mavlink_msg_heartbeat_send(MAVSINK_CHAN, MAV_TYPE_GENERIC,
+				   MAV_AUTOPILOT_INVALID, 0, 0, MAV_STATE_ACTIVE);
+	mavsink_send(p_batch);
 }
 
 void mavlog_init(void)
@@ -85,52 +61,124 @@ void mavlog_init(void)
 	m_initialized = true;
 }
 
-void mavlog_start(void)
+bool mavlog_add_sink(const char *p_spec)
 {
-	if (!m_initialized)
+	m_default_sink = false;
+
+	return mavsink_add(p_spec);
+}
+
+bool mavlog_serial_init(const char *p_path, int baud)
+{
+	char spec[128];
+	snprintf(spec, sizeof(spec), "serial:%s:%d", p_path, baud);
+
+	return mavsink_add(spec);
+}
+
+void mavlog_dump(FILE *p_file)
+{
+	mavsink_dump(p_file);
+}
+
+/* Runs on the event loop after every gyro readout (t: newest sample). Sends
+   OPTICAL_FLOW_RAD for the interval since the previous call: the predicted
+   translation plus the measured rotation. */
+static void predict_handler(int64_t t, void *ptr)
+{
+	int64_t t0 = m_predict_prev_t;
+	m_predict_prev_t = t;
+
+	if (!m_run || t0 == 0 || t <= t0)
 		return;
 
-	DBG("mavlog_start()");
+	TRACE_SCOPE("predict");
 
-	m_run = true;
+	predict_t state = m_predict.read();
+	double vx, vy;
+	uint8_t quality;
 
-	int rc = pthread_create(&m_mavlink_thread, NULL, mavlink_thread, NULL);
-	if (rc) {
-		ERR("Unable to create thread: " << rc);
+	if (!predict_velocity(&state, t, &vx, &vy, &quality))
 		return;
+
+	sensors_data_t sensors;
+	sensors_read(&sensors);
+
+	double gx, gy, gz;
+	sensors_gyro_integrate(t0, t, &gx, &gy, &gz);
+
+	float dist_m = (float)sensors.sonar.distance_mm / 1000.0f;
+	double dt = (t - t0) / 1000000.0;
+	float flow_x_rad = 0;
+	float flow_y_rad = 0;
+
+	if (dist_m > 0) {
+		flow_x_rad = (float)(vx * dt / dist_m);
+		flow_y_rad = (float)(vy * dt / dist_m);
+	} else {
+		quality = 0;
 	}
 
-	rc = pthread_create(&m_heartbeat_thread, NULL, heartbeat_thread, NULL);
-	if (rc) {
-		ERR("Unable to create thread: " << rc);
+	/* Not a frame: no t_capture, so the sinks' frame counts and the
+	   end-to-end latency (of a gyro sample) leave it out. The sinks
+	   divide predictions on their own (pdiv=). */
+	mavsink_batch_t *p_batch = mavsink_batch_get(0);
+	if (p_batch == NULL)
 		return;
-	}
+
+	p_batch->predicted = true;
+
+	mavlink_msg_optical_flow_rad_send(MAVSINK_CHAN, (uint64_t)microseconds(),
+					  MAVLOG_SENSOR_ID, (uint32_t)(t - t0),
+					  flow_x_rad, flow_y_rad,
+					  (float)(M_PI * gx / 180.0),
+					  (float)(M_PI * gy / 180.0),
+					  (float)(M_PI * gz / 180.0),
+					  (int16_t)(sensors.gyro.temperature * 100),
+					  quality, 0, dist_m);
+	mavsink_send(p_batch);
 }
 
-void mavlog_send_motion(unsigned long timestamp, motion_t *p_motion)
+void mavlog_predict_init(void)
 {
-	static uint64_t prev_t;
+	predict_init(&m_predict_writer);
+	m_predict.write(m_predict_writer);
+	m_predict_enabled = true;
 
-	if (!m_initialized || !m_run)
-		return;
+	sensors_gyro_hook(predict_handler, NULL);
+}
 
-	if (prev_t == 0) {
-		prev_t = (uint64_t)microseconds();
+void mavlog_start(void)
+{
+	if (!m_initialized)
 		return;
-	}
 
-	suseconds_t t1, t2;
+	DBG("mavlog_start()");
 
-	t1 = microseconds();
+	m_run = true;
 
-	uint64_t t = (uint64_t)microseconds();
+	if (m_default_sink)
+		mavsink_add(MAVLOG_DEFAULT_SINK);
 
-	sensors_data_t sensors;
-	memset(&sensors, 0, sizeof(sensors));
-	sensors_read(&sensors);
+	if (!mavsink_start())
+		ERR("Not all MAVLink sinks could be opened");
+
+	if (!evloop_add_timer(MAVLOG_HEARTBEAT_PERIOD_MS * 1000UL,
+			      heartbeat_handler, NULL)) {
+		ERR("Unable to register heartbeat timer");
+		return;
+	}
+}
+
+bool mavlog_flow_calc(mavlog_stream_t *p_stream, uint64_t t, motion_t *p_motion,
+		      sensors_data_t *p_sensors, mavlog_flow_t *p_flow)
+{
+	if (p_stream->prev_t == 0 || t <= p_stream->prev_t) {
+		p_stream->prev_t = t;
+		return false;
+	}
 
 	double dx_px, dy_px, dr_rad;
-	uint8_t flow_quality;
 
 	if (p_motion->affine_xform.cols == 3 && p_motion->affine_xform.rows == 2) {
 		/* A = [sR|t] = [ s*cos(r), -s*sin(r), tx ]
@@ -141,65 +189,115 @@ void mavlog_send_motion(unsigned long timestamp, motion_t *p_motion)
 			       p_motion->affine_xform.at<double>(0, 0));
 
 		/* TODO: vec_in too low -> low quality */
-		flow_quality = (uint8_t)(255*p_motion->res.vec_in / p_motion->res.vec_good);
+		p_flow->quality = (uint8_t)(255*p_motion->res.vec_in / p_motion->res.vec_good);
 	} else {
 		dx_px = 0;
 		dy_px = 0;
 		dr_rad = 0;
-		flow_quality = 0;
+		p_flow->quality = 0;
 	}
 
-	/* TODO: Negative: Distance unknown */
-	float ground_dist_m = (float)sensors.sonar.distance_mm / 1000.0f;
+	p_flow->dt_us = (uint32_t)(t - p_stream->prev_t);
 
-	/* TODO: Make this be the "Time in microseconds since the distance was sampled" */
-	uint32_t ground_dist_dt = 0;
+	/* TODO: Negative: Distance unknown */
+	p_flow->ground_dist_m = (float)p_sensors->sonar.distance_mm / 1000.0f;
 
 	/* Flow in dezi-pixels: */
-	int16_t flow_x_10px = (int16_t)round(dx_px * 10.0);
-	int16_t flow_y_10px = (int16_t)round(dy_px * 10.0);
+	p_flow->flow_x_10px = (int16_t)round(dx_px * 10.0);
+	p_flow->flow_y_10px = (int16_t)round(dy_px * 10.0);
 
 	/* Flow in "radians"
 	   (see https://groups.google.com/forum/#!topic/px4users/2JuTs5NXqq8 for
 	   explanation): */
-	float flow_x_rad = (float)(PX2M * dx_px);
-	float flow_y_rad = (float)(PX2M * dy_px);
+	p_flow->flow_x_rad = (float)(PX2M * dx_px);
+	p_flow->flow_y_rad = (float)(PX2M * dy_px);
 
 	/* Flow in meters per second: */
-	float dt = (float)(t-prev_t) / 1000000.0f;
-	float flow_x_m = (flow_x_rad / dt) * ground_dist_m;
-	float flow_y_m = (flow_y_rad / dt) * ground_dist_m;;
+	float dt = (float)p_flow->dt_us / 1000000.0f;
+	p_flow->flow_x_m = (p_flow->flow_x_rad / dt) * p_flow->ground_dist_m;
+	p_flow->flow_y_m = (p_flow->flow_y_rad / dt) * p_flow->ground_dist_m;
 
 	/* Gyro (note the Z axis represents rotation recovered from flow): */
-	float gyro_x_rad = (float)((M_PI * sensors.gyro.x / 180.0) * dt);
-	float gyro_y_rad = (float)((M_PI * sensors.gyro.y / 180.0) * dt);
-	float gyro_z_rad = (float)dr_rad;
-	int16_t gyro_t_cdeg = (int)(sensors.gyro.temperature * 100);
+	p_flow->gyro_x_rad = (float)((M_PI * p_sensors->gyro.x / 180.0) * dt);
+	p_flow->gyro_y_rad = (float)((M_PI * p_sensors->gyro.y / 180.0) * dt);
+	p_flow->gyro_z_rad = (float)dr_rad;
+	p_flow->gyro_t_cdeg = (int)(p_sensors->gyro.temperature * 100);
+
+	p_stream->prev_t = t;
+
+	return true;
+}
+
+void mavlog_send_motion(int64_t t_capture, motion_t *p_motion, sensors_data_t *p_sensors)
+{
+	if (!m_initialized || !m_run)
+		return;
+
+	TRACE_SCOPE("mavlog");
+
+	suseconds_t t1, t2;
+
+	t1 = microseconds();
+
+	uint64_t t = (uint64_t)microseconds();
+	mavlog_flow_t flow;
+
+	if (!mavlog_flow_calc(&m_stream, t, p_motion, p_sensors, &flow))
+		return;
+
+	/* TODO: Make this be the "Time in microseconds since the distance was sampled" */
+	uint32_t ground_dist_dt = 0;
+
+	mavsink_batch_t *p_batch = mavsink_batch_get(t_capture);
+	if (p_batch == NULL)
+		return;
 
 	/* OPTICAL_FLOW(): */
-	mavlink_message_t msg;
-	mavlink_msg_optical_flow_pack(MAVLOG_SYSTEM_ID, MAVLOG_COMPONENT_ID,
-				      &msg, t, MAVLOG_SENSOR_ID, flow_x_10px,
-				      flow_y_10px, flow_x_m, flow_y_m,
-				      flow_quality, ground_dist_m);
-	m_msq_queue.add(msg);
-
-	/* OPTICAL_FLOW_RAD(): */
-	mavlink_msg_optical_flow_rad_pack(MAVLOG_SYSTEM_ID, MAVLOG_COMPONENT_ID,
-					  &msg, t, MAVLOG_SENSOR_ID,
-					  (uint32_t)(t-prev_t), flow_x_rad,
-					  flow_y_rad, gyro_x_rad, gyro_y_rad,
-					  gyro_z_rad, gyro_t_cdeg, flow_quality,
-					  ground_dist_dt, ground_dist_m);
-	m_msq_queue.add(msg);
-
-	prev_t = t;
+	mavlink_msg_optical_flow_send(MAVSINK_CHAN, t, MAVLOG_SENSOR_ID,
+				      flow.flow_x_10px, flow.flow_y_10px,
+				      flow.flow_x_m, flow.flow_y_m,
+				      flow.quality, flow.ground_dist_m);
+
+	if (m_predict_enabled) {
+		/* OPTICAL_FLOW_RAD comes from predict_handler() instead (its
+		   integration intervals must not overlap). The velocity is the
+		   mean over the frame interval. */
+		predict_update(&m_predict_writer, t_capture - flow.dt_us/2,
+			       flow.flow_x_m, flow.flow_y_m, flow.quality);
+		m_predict.write(m_predict_writer);
+	} else {
+		/* OPTICAL_FLOW_RAD(): */
+		mavlink_msg_optical_flow_rad_send(MAVSINK_CHAN, t,
+						  MAVLOG_SENSOR_ID, flow.dt_us,
+						  flow.flow_x_rad, flow.flow_y_rad,
+						  flow.gyro_x_rad, flow.gyro_y_rad,
+						  flow.gyro_z_rad, flow.gyro_t_cdeg,
+						  flow.quality, ground_dist_dt,
+						  flow.ground_dist_m);
+	}
+
+	mavsink_send(p_batch);
 
 	t2 = microseconds();
 
 	DBG("mavlog_send_motion(): " << (t2-t1) << " us");
 }
 
+void mavlog_send_named_int(const char *p_name, int32_t value)
+{
+	if (!m_initialized || !m_run)
+		return;
+
+	mavsink_batch_t *p_batch = mavsink_batch_get(0);
+	if (p_batch == NULL)
+		return;
+
+	mavlink_msg_named_value_int_send(MAVSINK_CHAN,
+					 microseconds_monotonic() / 1000,
+					 p_name, value);
+	mavsink_send(p_batch);
+}
+
 void mavlog_stop(void)
 {
 	if (!m_initialized)
@@ -208,5 +306,7 @@ void mavlog_stop(void)
 	m_run = false;
 	m_initialized = false;
 
+	mavsink_dump(stderr);
+
 	DBG("mavlog_stop()");
 }
@@ -1,14 +1,58 @@
 #ifndef MAVLOG_H
 #define MAVLOG_H
 
+#include <stdio.h>
+
 #include "common.h"
 #include "motion.h"
+#include "sensors.h"
+
+/* OPTICAL_FLOW(_RAD) fields of one frame */
+typedef struct {
+	uint32_t dt_us; /* Since the previous frame */
+	int16_t flow_x_10px;
+	int16_t flow_y_10px;
+	float flow_x_rad;
+	float flow_y_rad;
+	float flow_x_m; /* [m/s] */
+	float flow_y_m;
+	float gyro_x_rad;
+	float gyro_y_rad;
+	float gyro_z_rad; /* Rotation recovered from flow */
+	int16_t gyro_t_cdeg;
+	uint8_t quality;
+	float ground_dist_m;
+} mavlog_flow_t;
+
+/* Per-stream state of the flow conversion */
+typedef struct {
+	uint64_t prev_t; /* [us] */
+} mavlog_stream_t;
 
 void mavlog_init(void);
+/* Output targets, see mavsink_add(); before mavlog_start(). Without any,
+   MAVLink goes to UDP 192.168.42.42:14550. */
+bool mavlog_add_sink(const char *p_spec);
+/* Also sends to the flight controller on a UART */
+bool mavlog_serial_init(const char *p_path, int baud);
+/* OPTICAL_FLOW_RAD at the gyro rate from a Kalman prediction between frames
+   instead of once per frame; before the sensors start */
+void mavlog_predict_init(void);
 void mavlog_start(void);
 
-void mavlog_send_motion(unsigned long timestamp, motion_t *p_motion);
+/* t_capture: microseconds_monotonic() time of the frame */
+void mavlog_send_motion(int64_t t_capture, motion_t *p_motion, sensors_data_t *p_sensors);
+
+/* NAMED_VALUE_INT, p_name up to 10 characters */
+void mavlog_send_named_int(const char *p_name, int32_t value);
 
 void mavlog_stop(void);
+/* Per-sink message counts */
+void mavlog_dump(FILE *p_file);
+
+/* Converts the motion of the frame taken at t [us]; false for the first
+   frame of a stream (no time base yet) */
+bool mavlog_flow_calc(mavlog_stream_t *p_stream, uint64_t t, motion_t *p_motion,
+		      sensors_data_t *p_sensors, mavlog_flow_t *p_flow);
 
 #endif
\ No newline at end of file
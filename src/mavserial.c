@@ -0,0 +1,226 @@
+#include "mavserial.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "util.h"
+
+static int m_fd = -1;
+static int m_baud;
+static unsigned long m_written;
+static unsigned long m_dropped;
+static unsigned long m_stale;
+
+/* Unsent end of a partially written message; nothing else is written
+   before it, so the receiver never sees a truncated frame */
+static uint8_t m_tail[MAVSERIAL_TAIL_MAX];
+static int m_tail_len;
+
+/* Bytes handed to the driver, drained at the baud rate. Covers what
+   TIOCOUTQ leaves out (UART FIFO, pseudo-terminals report 0). */
+static int64_t m_model_bytes;
+static int64_t m_model_t;
+
+static const struct {
+	int baud;
+	speed_t speed;
+} m_speeds[] = {
+	{ 9600, B9600 },
+	{ 19200, B19200 },
+	{ 38400, B38400 },
+	{ 57600, B57600 },
+	{ 115200, B115200 },
+	{ 230400, B230400 },
+	{ 460800, B460800 },
+	{ 500000, B500000 },
+	{ 576000, B576000 },
+	{ 921600, B921600 },
+};
+
+/* Time to shift out len bytes (8N1: 10 bits per byte) [us] */
+static uint32_t wire_time(int len)
+{
+	return (uint32_t)((int64_t)len * 10 * 1000000 / m_baud);
+}
+
+bool mavserial_init(const char *p_path, int baud)
+{
+	speed_t speed = 0;
+
+	for (unsigned int i = 0; i < sizeof(m_speeds)/sizeof(m_speeds[0]); i++) {
+		if (m_speeds[i].baud == baud)
+			speed = m_speeds[i].speed;
+	}
+
+	if (speed == 0)
+		return false;
+
+	m_fd = open(p_path, (O_RDWR | O_NOCTTY | O_NONBLOCK));
+	if (m_fd == -1)
+		return false;
+
+	struct termios options;
+	if (tcgetattr(m_fd, &options) != 0) {
+		mavserial_close();
+		return false;
+	}
+
+	/* Same raw setup as the sonar port, without flow control */
+	options.c_iflag &= ~(IGNBRK | BRKINT | ICRNL | INLCR | PARMRK | INPCK |
+			     ISTRIP | IXON | IXOFF);
+	options.c_oflag &= ~(OCRNL | ONLCR | ONLRET | ONOCR | OFILL | OPOST);
+	options.c_lflag &= ~(ECHO | ECHONL | ICANON | IEXTEN | ISIG);
+	options.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS);
+	options.c_cflag |= CS8 | CLOCAL | CREAD;
+
+	options.c_cc[VMIN] = 0;
+	options.c_cc[VTIME] = 0;
+
+	cfsetispeed(&options, speed);
+	cfsetospeed(&options, speed);
+
+	if (tcsetattr(m_fd, TCSANOW, &options) != 0) {
+		mavserial_close();
+		return false;
+	}
+
+	tcflush(m_fd, TCIOFLUSH);
+
+	m_baud = baud;
+	m_written = 0;
+	m_dropped = 0;
+	m_stale = 0;
+	m_tail_len = 0;
+	m_model_bytes = 0;
+	m_model_t = microseconds_monotonic();
+
+	return true;
+}
+
+/* Bytes still to be shifted out, the larger of the driver's count and the
+   model */
+static int backlog(void)
+{
+	int64_t t = microseconds_monotonic();
+
+	int64_t drained = (t - m_model_t) * m_baud / 10 / 1000000;
+
+	if (drained >= m_model_bytes) {
+		m_model_bytes = 0;
+		m_model_t = t;
+	} else if (drained > 0) {
+		/* Only whole bytes, the remainder counts towards the next */
+		m_model_bytes -= drained;
+		m_model_t += drained * 10 * 1000000 / m_baud;
+	}
+
+	int queued = 0;
+	if (ioctl(m_fd, TIOCOUTQ, &queued) != 0)
+		queued = 0;
+
+	return (queued > m_model_bytes) ? queued : (int)m_model_bytes;
+}
+
+static bool tail_write(void)
+{
+	if (m_tail_len == 0)
+		return true;
+
+	ssize_t n = write(m_fd, m_tail, m_tail_len);
+	if (n <= 0)
+		return false;
+
+	m_model_bytes += n;
+	m_tail_len -= n;
+	memmove(m_tail, m_tail + n, m_tail_len);
+
+	return m_tail_len == 0;
+}
+
+bool mavserial_flush(int timeout_ms)
+{
+	if (m_fd == -1)
+		return false;
+
+	while (!tail_write()) {
+		struct pollfd pfd = { m_fd, POLLOUT, 0 };
+		if (timeout_ms <= 0 || poll(&pfd, 1, timeout_ms) <= 0)
+			return false;
+		timeout_ms = 0; /* One wait only */
+	}
+
+	return true;
+}
+
+int mavserial_writev(const struct iovec *p_iov, int count, uint32_t *p_wire_us)
+{
+	if (m_fd == -1)
+		return 0;
+
+	/* The rest of a message comes first */
+	if (!tail_write()) {
+		m_dropped += count;
+		return 0;
+	}
+
+	/* Only the messages that start within the backlog limit */
+	int queued = backlog();
+	int fit = 0;
+	while (fit < count && wire_time(queued) <= MAVSERIAL_TX_MAX_US &&
+	       p_iov[fit].iov_len <= MAVSERIAL_TAIL_MAX) {
+		queued += p_iov[fit].iov_len;
+		fit++;
+	}
+	m_stale += count - fit;
+
+	ssize_t n = (fit > 0) ? writev(m_fd, p_iov, fit) : 0;
+	if (n < 0)
+		n = 0; /* EAGAIN: the driver buffer is full */
+	m_model_bytes += n;
+
+	/* Whole messages, then possibly the start of one whose end is kept */
+	int written = 0;
+	size_t left = n;
+	while (written < fit && left >= p_iov[written].iov_len)
+		left -= p_iov[written++].iov_len;
+
+	if (left > 0) {
+		m_tail_len = p_iov[written].iov_len - left;
+		memcpy(m_tail, (const uint8_t *)p_iov[written].iov_base + left,
+		       m_tail_len);
+		written++;
+	}
+
+	m_written += written;
+	m_dropped += fit - written;
+	*p_wire_us = wire_time(backlog() + m_tail_len);
+
+	return written;
+}
+
+void mavserial_stats(unsigned long *p_written, unsigned long *p_dropped,
+		     unsigned long *p_stale)
+{
+	*p_written = m_written;
+	*p_dropped = m_dropped;
+	*p_stale = m_stale;
+}
+
+int mavserial_get_fd(void)
+{
+	return m_fd;
+}
+
+bool mavserial_close(void)
+{
+	if (m_fd != -1 && close(m_fd) == 0) {
+		m_fd = -1;
+		return true;
+	}
+
+	return false;
+}
@@ -0,0 +1,45 @@
+#ifndef MAVSERIAL_H
+#define MAVSERIAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* New messages are dropped rather than queued behind a longer backlog: the
+   autopilot wants the newest estimate, not old ones sent late */
+#define MAVSERIAL_TX_MAX_US	20000
+#define MAVSERIAL_TAIL_MAX	280 /* >= MAVLINK_MAX_PACKET_LEN */
+
+/* Raw 8N1 port, baud rates from 9600 to 921600 */
+bool mavserial_init(const char *p_path, int baud);
+
+/* Non-blocking: writes the buffers (one complete message each, at most
+   MAVSERIAL_TAIL_MAX bytes) in order while the driver takes them and the
+   bytes ahead would be on the wire within MAVSERIAL_TX_MAX_US; the others
+   are dropped. A message is never cut: the end of one the driver took only
+   in part is kept and written before anything else. Returns the number of
+   messages written; *p_wire_us is the estimated time until the last byte
+   is on the wire. */
+int mavserial_writev(const struct iovec *p_iov, int count, uint32_t *p_wire_us);
+
+/* Waits up to timeout_ms for the driver to take the rest of a partially
+   written message; true if nothing is left */
+bool mavserial_flush(int timeout_ms);
+
+/* Messages written, messages the driver did not take and messages dropped
+   because of the backlog */
+void mavserial_stats(unsigned long *p_written, unsigned long *p_dropped,
+		     unsigned long *p_stale);
+
+int mavserial_get_fd(void);
+bool mavserial_close(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,620 @@
+#include "mavsink.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "cv_queue.h"
+#include "latency.h"
+#include "mavserial.h"
+#include "rtsched.h"
+#include "trace.h"
+
+#define MAVSINK_PRODUCERS	4 /* Threads holding a batch while filling it */
+#define MAVSINK_QUEUE		8 /* Default queue length [batches] */
+#define MAVSINK_QUEUE_MAX	32
+#define MAVSINK_MSGS_MAX	(MAVSINK_QUEUE_MAX * MAVSINK_BATCH_MSGS)
+#define MAVSINK_SERIAL_BAUD	921600
+#define MAVSINK_MCAST_TTL	1
+
+typedef enum {
+	MAVSINK_UDP = 0,
+	MAVSINK_SERIAL,
+	MAVSINK_FILE,
+	MAVSINK_UNIX,
+	MAVSINK_TYPE_COUNT
+} mavsink_type_t;
+
+typedef struct {
+	mavsink_type_t type;
+	char target[108]; /* Address, device or path */
+	char name[16]; /* Of the thread */
+	int baud;
+	int div;
+	int pdiv; /* 0: div */
+	int queue_max;
+	bool msgs[256]; /* Passed message IDs */
+
+	int fd;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	cv_queue<mavsink_batch_t *> *p_queue; /* NULL: not started */
+	pthread_t thread;
+	/* Seen by the divider; mavsink_send() runs on several threads */
+	std::atomic<unsigned long> frames;
+	std::atomic<unsigned long> predictions;
+
+	std::atomic<unsigned long> sent;
+	std::atomic<unsigned long> skipped;
+	std::atomic<unsigned long> filtered;
+	std::atomic<unsigned long> dropped;
+	int last_errno; /* Of the sink thread's last failed send */
+} mavsink_t;
+
+static const char *m_type_names[MAVSINK_TYPE_COUNT] = {
+	"udp", "serial", "file", "unix"
+};
+
+static mavsink_t m_sinks[MAVSINK_MAX];
+static int m_sink_count;
+
+/* Of this thread, from mavsink_batch_get() until mavsink_send() */
+static __thread mavsink_batch_t *t_p_batch;
+static __thread bool t_skip; /* The message being written does not fit */
+static bool m_started;
+static mavsink_batch_t *m_batches; /* Pool shared by all sinks */
+static cv_queue<mavsink_batch_t *> m_free_batches;
+static std::atomic<unsigned long> m_no_batch;
+
+static void batch_release(mavsink_batch_t *p_batch)
+{
+	if (p_batch->refs.fetch_sub(1) == 1)
+		m_free_batches.add(p_batch);
+}
+
+/* Messages of the batch that pass the sink's filter */
+static int batch_passed(const mavsink_t *p_sink, const mavsink_batch_t *p_batch)
+{
+	int passed = 0;
+
+	for (int i = 0; i < p_batch->count; i++) {
+		if (p_sink->msgs[p_batch->msgid[i]])
+			passed++;
+	}
+
+	return passed;
+}
+
+static bool parse_target(mavsink_t *p_sink)
+{
+	char target[sizeof(p_sink->target)];
+	snprintf(target, sizeof(target), "%s", p_sink->target);
+
+	memset(&p_sink->addr, 0, sizeof(p_sink->addr));
+	p_sink->addr_len = 0;
+
+	switch (p_sink->type) {
+	case MAVSINK_UDP: {
+		struct sockaddr_in *p_in = (struct sockaddr_in *)&p_sink->addr;
+		char *p_port = strrchr(target, ':');
+
+		if (p_port == NULL)
+			return false;
+		*p_port++ = '\0';
+
+		if (inet_aton(target, &p_in->sin_addr) == 0 || atoi(p_port) <= 0)
+			return false;
+
+		p_in->sin_family = AF_INET;
+		p_in->sin_port = htons(atoi(p_port));
+		p_sink->addr_len = sizeof(*p_in);
+		return true;
+	}
+	case MAVSINK_SERIAL: {
+		char *p_baud = strrchr(p_sink->target, ':');
+
+		if (p_baud != NULL) {
+			*p_baud++ = '\0';
+			p_sink->baud = atoi(p_baud);
+		}
+		return true;
+	}
+	case MAVSINK_UNIX: {
+		struct sockaddr_un *p_un = (struct sockaddr_un *)&p_sink->addr;
+
+		if (strlen(target) >= sizeof(p_un->sun_path))
+			return false;
+
+		p_un->sun_family = AF_UNIX;
+		strcpy(p_un->sun_path, target);
+		p_sink->addr_len = sizeof(*p_un);
+		return true;
+	}
+	default:
+		return true;
+	}
+}
+
+/* div=<n>, pdiv=<n>, queue=<n>, msgs=<id>+<id>... */
+static bool parse_option(mavsink_t *p_sink, char *p_option)
+{
+	if (strncmp("div=", p_option, 4) == 0) {
+		p_sink->div = atoi(p_option+4);
+		return p_sink->div >= 1;
+	} else if (strncmp("pdiv=", p_option, 5) == 0) {
+		p_sink->pdiv = atoi(p_option+5);
+		return p_sink->pdiv >= 1;
+	} else if (strncmp("queue=", p_option, 6) == 0) {
+		p_sink->queue_max = atoi(p_option+6);
+		return p_sink->queue_max >= 1 &&
+		       p_sink->queue_max <= MAVSINK_QUEUE_MAX;
+	} else if (strncmp("msgs=", p_option, 5) == 0) {
+		char *p_id = p_option+5;
+
+		memset(p_sink->msgs, 0, sizeof(p_sink->msgs));
+
+		while (*p_id != '\0') {
+			char *p_end;
+			long id = strtol(p_id, &p_end, 10);
+
+			if (p_end == p_id || id < 0 || id > 255)
+				return false;
+			p_sink->msgs[id] = true;
+
+			p_id = (*p_end == '+') ? p_end+1 : p_end;
+			if (*p_end != '+' && *p_end != '\0')
+				return false;
+		}
+		return true;
+	}
+
+	return false;
+}
+
+bool mavsink_add(const char *p_spec)
+{
+	if (m_started || m_sink_count == MAVSINK_MAX) {
+		ERR("mavsink_add(): Can't add " << p_spec);
+		return false;
+	}
+
+	mavsink_t *p_sink = &m_sinks[m_sink_count];
+	char spec[256];
+	snprintf(spec, sizeof(spec), "%s", p_spec);
+
+	char *p_options = strchr(spec, ',');
+	if (p_options != NULL)
+		*p_options++ = '\0';
+
+	char *p_target = strchr(spec, ':');
+	if (p_target == NULL) {
+		ERR("mavsink_add(): No target in " << p_spec);
+		return false;
+	}
+	*p_target++ = '\0';
+
+	int type;
+	for (type = 0; type < MAVSINK_TYPE_COUNT; type++) {
+		if (strcmp(spec, m_type_names[type]) == 0)
+			break;
+	}
+
+	if (type == MAVSINK_TYPE_COUNT) {
+		ERR("mavsink_add(): Unknown sink type " << spec);
+		return false;
+	}
+
+	/* mavserial drives a single port */
+	for (int i = 0; i < m_sink_count; i++) {
+		if (type == MAVSINK_SERIAL && m_sinks[i].type == MAVSINK_SERIAL) {
+			ERR("mavsink_add(): Only one serial sink is supported");
+			return false;
+		}
+	}
+
+	p_sink->type = (mavsink_type_t)type;
+	snprintf(p_sink->target, sizeof(p_sink->target), "%s", p_target);
+	p_sink->baud = MAVSINK_SERIAL_BAUD;
+	p_sink->div = 1;
+	p_sink->pdiv = 0;
+	p_sink->queue_max = MAVSINK_QUEUE;
+	for (int i = 0; i < 256; i++)
+		p_sink->msgs[i] = true;
+	p_sink->fd = -1;
+	p_sink->p_queue = NULL;
+	p_sink->frames = 0;
+	p_sink->predictions = 0;
+
+	if (!parse_target(p_sink)) {
+		ERR("mavsink_add(): Bad target " << p_target);
+		return false;
+	}
+
+	char *p_save = NULL;
+	for (char *p_option = (p_options != NULL) ?
+			      strtok_r(p_options, ",", &p_save) : NULL;
+	     p_option != NULL; p_option = strtok_r(NULL, ",", &p_save)) {
+		if (!parse_option(p_sink, p_option)) {
+			ERR("mavsink_add(): Bad option " << p_option);
+			return false;
+		}
+	}
+
+	snprintf(p_sink->name, sizeof(p_sink->name), "mavlink%d", m_sink_count);
+	m_sink_count++;
+
+	return true;
+}
+
+int mavsink_count(void)
+{
+	return m_sink_count;
+}
+
+static bool sink_open(mavsink_t *p_sink)
+{
+	switch (p_sink->type) {
+	case MAVSINK_UDP: {
+		p_sink->fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+		struct sockaddr_in *p_in = (struct sockaddr_in *)&p_sink->addr;
+		if (p_sink->fd != -1 && IN_MULTICAST(ntohl(p_in->sin_addr.s_addr))) {
+			unsigned char ttl = MAVSINK_MCAST_TTL;
+			setsockopt(p_sink->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl,
+				   sizeof(ttl));
+		}
+		break;
+	}
+	case MAVSINK_SERIAL:
+		if (mavserial_init(p_sink->target, p_sink->baud))
+			p_sink->fd = mavserial_get_fd();
+		break;
+	case MAVSINK_FILE:
+		p_sink->fd = open(p_sink->target, O_WRONLY | O_CREAT | O_TRUNC |
+				  O_CLOEXEC, 0644);
+		break;
+	case MAVSINK_UNIX:
+		p_sink->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		break;
+	default:
+		break;
+	}
+
+	return p_sink->fd != -1;
+}
+
+/* UDP and Unix sockets: one sendmmsg() for everything queued. A full socket
+   buffer drops instead of blocking. */
+static void send_datagrams(mavsink_t *p_sink, mavsink_batch_t **p_batches,
+			   int count, struct iovec *p_iovs, struct mmsghdr *p_msgs)
+{
+	int n = 0;
+
+	for (int i = 0; i < count; i++) {
+		for (int j = 0; j < p_batches[i]->count; j++) {
+			if (!p_sink->msgs[p_batches[i]->msgid[j]])
+				continue;
+
+			p_iovs[n].iov_base = p_batches[i]->buf[j];
+			p_iovs[n].iov_len = p_batches[i]->len[j];
+
+			memset(&p_msgs[n], 0, sizeof(p_msgs[n]));
+			p_msgs[n].msg_hdr.msg_name = &p_sink->addr;
+			p_msgs[n].msg_hdr.msg_namelen = p_sink->addr_len;
+			p_msgs[n].msg_hdr.msg_iov = &p_iovs[n];
+			p_msgs[n].msg_hdr.msg_iovlen = 1;
+			n++;
+		}
+	}
+
+	int sent = sendmmsg(p_sink->fd, p_msgs, n, MSG_DONTWAIT);
+	if (sent < 0) {
+		/* A full socket buffer only drops, anything else is reported
+		   once until sends succeed again */
+		int err = errno;
+		if (err != EAGAIN && err != EWOULDBLOCK && err != p_sink->last_errno)
+			ERR("mavsink: " << m_type_names[p_sink->type] << ":" <<
+			    p_sink->target << ": " << strerror(err));
+		p_sink->last_errno = err;
+		sent = 0;
+	} else {
+		p_sink->last_errno = 0;
+	}
+
+	p_sink->sent += sent;
+	p_sink->dropped += n - sent;
+}
+
+/* One writev() per batch, so the port drops whole frames */
+static void send_serial(mavsink_t *p_sink, mavsink_batch_t **p_batches,
+			int count, struct iovec *p_iovs)
+{
+	for (int i = 0; i < count; i++) {
+		int n = 0;
+
+		for (int j = 0; j < p_batches[i]->count; j++) {
+			if (!p_sink->msgs[p_batches[i]->msgid[j]])
+				continue;
+
+			p_iovs[n].iov_base = p_batches[i]->buf[j];
+			p_iovs[n].iov_len = p_batches[i]->len[j];
+			n++;
+		}
+
+		uint32_t wire_us;
+		int written = mavserial_writev(p_iovs, n, &wire_us);
+		if (written > 0)
+			latency_record(LATENCY_SERIAL_WIRE, wire_us);
+		p_sink->sent += written;
+		p_sink->dropped += n - written;
+	}
+
+	/* Completes a message the driver only took in part while the port
+	   drains, rather than with the next batch */
+	mavserial_flush(MAVSERIAL_TX_MAX_US / 1000);
+}
+
+/* .tlog: every message preceded by a big-endian wall clock time [us] */
+static void send_file(mavsink_t *p_sink, mavsink_batch_t **p_batches,
+		      int count, struct iovec *p_iovs, uint64_t *p_stamps)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	uint64_t stamp = htobe64((uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+
+	int n = 0;
+	size_t len = 0;
+
+	for (int i = 0; i < count; i++) {
+		for (int j = 0; j < p_batches[i]->count; j++) {
+			if (!p_sink->msgs[p_batches[i]->msgid[j]])
+				continue;
+
+			p_stamps[n] = stamp;
+			p_iovs[2*n].iov_base = &p_stamps[n];
+			p_iovs[2*n].iov_len = sizeof(p_stamps[n]);
+			p_iovs[2*n+1].iov_base = p_batches[i]->buf[j];
+			p_iovs[2*n+1].iov_len = p_batches[i]->len[j];
+			len += sizeof(p_stamps[n]) + p_batches[i]->len[j];
+			n++;
+		}
+	}
+
+	if (writev(p_sink->fd, p_iovs, 2*n) == (ssize_t)len)
+		p_sink->sent += n;
+	else
+		p_sink->dropped += n;
+}
+
+static void *sink_thread(void *ptr)
+{
+	mavsink_t *p_sink = (mavsink_t *)ptr;
+	mavsink_batch_t *batches[MAVSINK_QUEUE_MAX];
+	struct iovec iovs[2 * MAVSINK_MSGS_MAX];
+	struct mmsghdr msgs[MAVSINK_MSGS_MAX];
+	uint64_t stamps[MAVSINK_MSGS_MAX];
+
+	rtsched_thread(RTSCHED_ROLE_MAVLINK, p_sink->name);
+	trace_thread_name(p_sink->name);
+
+	DBG("sink_thread(): Sending MavLink packets to " <<
+	    m_type_names[p_sink->type] << ":" << p_sink->target);
+
+	while (1) {
+		int count = 0;
+
+		batches[count++] = p_sink->p_queue->remove();
+		while (count < p_sink->queue_max &&
+		       p_sink->p_queue->try_remove(&batches[count]))
+			count++;
+
+		int64_t t1 = microseconds_monotonic();
+		{
+			TRACE_SCOPE("send", count);
+
+			switch (p_sink->type) {
+			case MAVSINK_SERIAL:
+				send_serial(p_sink, batches, count, iovs);
+				break;
+			case MAVSINK_FILE:
+				send_file(p_sink, batches, count, iovs, stamps);
+				break;
+			default:
+				send_datagrams(p_sink, batches, count, iovs, msgs);
+				break;
+			}
+		}
+		int64_t t2 = microseconds_monotonic();
+
+		latency_record(LATENCY_MAVLINK_SEND, t2 - t1);
+
+		for (int i = 0; i < count; i++) {
+			/* Of the first sink only, normally the flight
+			   controller: one histogram, and the others (ground
+			   station, logs) have no deadline */
+			if (p_sink == &m_sinks[0] && batches[i]->t_capture != 0)
+				latency_record(LATENCY_END_TO_END,
+					       t2 - batches[i]->t_capture);
+			batch_release(batches[i]);
+		}
+	}
+
+	return NULL;
+}
+
+bool mavsink_start(void)
+{
+	bool ok = true;
+
+	/* A stuck sink holds its queue and as many batches again in
+	   sink_thread(); sized for all of them stuck, the producers still
+	   get batches for the others */
+	int batch_count = MAVSINK_PRODUCERS;
+	for (int i = 0; i < m_sink_count; i++)
+		batch_count += 2 * m_sinks[i].queue_max;
+
+	m_batches = new mavsink_batch_t[batch_count];
+	for (int i = 0; i < batch_count; i++)
+		m_free_batches.add(&m_batches[i]);
+
+	m_started = true;
+
+	for (int i = 0; i < m_sink_count; i++) {
+		mavsink_t *p_sink = &m_sinks[i];
+
+		if (!sink_open(p_sink)) {
+			ERR("mavsink_start(): Can't open " <<
+			    m_type_names[p_sink->type] << ":" << p_sink->target);
+			ok = false;
+			continue;
+		}
+
+		p_sink->p_queue = new cv_queue<mavsink_batch_t *>(p_sink->queue_max);
+
+		int rc = pthread_create(&p_sink->thread, NULL, sink_thread, p_sink);
+		if (rc) {
+			ERR("Unable to create thread: " << rc);
+			delete p_sink->p_queue;
+			p_sink->p_queue = NULL;
+			ok = false;
+		}
+	}
+
+	return ok;
+}
+
+mavsink_batch_t *mavsink_batch_get(int64_t t_capture)
+{
+	mavsink_batch_t *p_batch;
+
+	if (!m_free_batches.try_remove(&p_batch)) {
+		m_no_batch++;
+		t_p_batch = NULL;
+		return NULL;
+	}
+
+	p_batch->count = 0;
+	p_batch->t_capture = t_capture;
+	p_batch->predicted = false;
+	p_batch->refs = 1; /* The producer's */
+	t_p_batch = p_batch;
+
+	return p_batch;
+}
+
+/* MAVLINK_START_UART_SEND: len is the whole serialized message */
+void mavsink_msg_start(uint16_t len)
+{
+	mavsink_batch_t *p_batch = t_p_batch;
+
+	t_skip = (p_batch == NULL || p_batch->count == MAVSINK_BATCH_MSGS ||
+		  len > MAVLINK_MAX_PACKET_LEN);
+	if (!t_skip)
+		p_batch->len[p_batch->count] = 0;
+}
+
+/* MAVLINK_SEND_UART_BYTES: header, payload and checksum in turn */
+void mavsink_msg_write(const uint8_t *p_buf, uint16_t len)
+{
+	mavsink_batch_t *p_batch = t_p_batch;
+
+	if (t_skip)
+		return;
+
+	int i = p_batch->count;
+	memcpy(p_batch->buf[i] + p_batch->len[i], p_buf, len);
+	p_batch->len[i] += len;
+}
+
+void mavsink_msg_end(void)
+{
+	mavsink_batch_t *p_batch = t_p_batch;
+
+	if (t_skip)
+		return;
+
+	int i = p_batch->count;
+	p_batch->msgid[i] = p_batch->buf[i][5]; /* v1 header */
+	p_batch->count++;
+}
+
+void mavsink_send(mavsink_batch_t *p_batch)
+{
+	t_p_batch = NULL;
+
+	for (int i = 0; i < m_sink_count; i++) {
+		mavsink_t *p_sink = &m_sinks[i];
+
+		if (p_sink->p_queue == NULL)
+			continue;
+
+		/* Frames and predictions are divided, each on its own count;
+		   heartbeats and values always pass */
+		std::atomic<unsigned long> *p_count = NULL;
+		int div = p_sink->div;
+
+		if (p_batch->predicted) {
+			p_count = &p_sink->predictions;
+			if (p_sink->pdiv > 0)
+				div = p_sink->pdiv;
+		} else if (p_batch->t_capture != 0) {
+			p_count = &p_sink->frames;
+		}
+
+		if (p_count != NULL &&
+		    p_count->fetch_add(1, std::memory_order_relaxed) % div != 0) {
+			p_sink->skipped += p_batch->count;
+			continue;
+		}
+
+		int passed = batch_passed(p_sink, p_batch);
+		p_sink->filtered += p_batch->count - passed;
+		if (passed == 0)
+			continue;
+
+		p_batch->refs++;
+
+		/* Full: the oldest batch goes, the sink gets the newest data */
+		if (!p_sink->p_queue->try_add(p_batch)) {
+			mavsink_batch_t *p_old;
+
+			if (p_sink->p_queue->try_remove(&p_old)) {
+				p_sink->dropped += batch_passed(p_sink, p_old);
+				batch_release(p_old);
+			}
+
+			if (!p_sink->p_queue->try_add(p_batch)) {
+				p_sink->dropped += passed;
+				batch_release(p_batch);
+			}
+		}
+	}
+
+	batch_release(p_batch);
+}
+
+void mavsink_dump(FILE *p_file)
+{
+	fprintf(p_file, "%-8s %-24s %10s %10s %10s %10s\n", "sink", "target",
+		"sent", "skipped", "filtered", "dropped");
+
+	for (int i = 0; i < m_sink_count; i++) {
+		mavsink_t *p_sink = &m_sinks[i];
+
+		fprintf(p_file, "%-8s %-24s %10lu %10lu %10lu %10lu\n",
+			m_type_names[p_sink->type], p_sink->target,
+			(unsigned long)p_sink->sent, (unsigned long)p_sink->skipped,
+			(unsigned long)p_sink->filtered,
+			(unsigned long)p_sink->dropped);
+	}
+
+	if (m_no_batch > 0)
+		fprintf(p_file, "no free batch: %lu\n", (unsigned long)m_no_batch);
+}
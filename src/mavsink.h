@@ -0,0 +1,69 @@
+#ifndef MAVSINK_H
+#define MAVSINK_H
+
+#include <stdio.h>
+#include <atomic>
+
+#include "common.h"
+
+/* Messages are serialized with the library's mavlink_msg_*_send() on
+   MAVSINK_CHAN, which writes them straight into the batch the calling
+   thread got from mavsink_batch_get() */
+#include "mavlink_types.h"
+extern mavlink_system_t mavlink_system;
+void mavsink_msg_start(uint16_t len);
+void mavsink_msg_write(const uint8_t *p_buf, uint16_t len);
+void mavsink_msg_end(void);
+#define MAVLINK_USE_CONVENIENCE_FUNCTIONS
+#define MAVLINK_START_UART_SEND(chan, len)	mavsink_msg_start(len)
+#define MAVLINK_SEND_UART_BYTES(chan, buf, len)	mavsink_msg_write(buf, len)
+#define MAVLINK_END_UART_SEND(chan, len)	mavsink_msg_end()
+#include "mavlink.h"
+
+#define MAVSINK_CHAN		MAVLINK_COMM_0
+
+/* Telemetry fan-out: every batch of serialized MAVLink messages goes to all
+   sinks. Each sink has its own thread, rate divider, message filter and
+   bounded queue; a full queue loses its oldest batch, so a slow sink never
+   holds up the producer or the other sinks. */
+
+#define MAVSINK_BATCH_MSGS	2 /* OPTICAL_FLOW and OPTICAL_FLOW_RAD */
+#define MAVSINK_MAX		8
+
+/* Shared by all sinks, returned to the pool by the last one */
+typedef struct {
+	uint8_t buf[MAVSINK_BATCH_MSGS][MAVLINK_MAX_PACKET_LEN];
+	uint16_t len[MAVSINK_BATCH_MSGS];
+	uint8_t msgid[MAVSINK_BATCH_MSGS];
+	int count;
+	int64_t t_capture; /* Of the frame the messages describe, 0 if none */
+	bool predicted; /* Between frames, divided apart from them */
+	std::atomic<int> refs;
+} mavsink_batch_t;
+
+/* <type>:<target>[,div=<n>][,pdiv=<n>][,msgs=<id>+<id>...][,queue=<n>],
+   where type and target are one of
+     udp:<ip>:<port>          unicast or multicast
+     serial:<device>[:<baud>] at most one
+     file:<path>              QGroundControl .tlog
+     unix:<path>              datagram socket
+   div=<n> passes every n-th frame and pdiv=<n> (default: div) every n-th
+   predicted batch, other messages always pass; msgs= only the listed
+   message IDs. The first sink added is the one whose sends are
+   recorded as LATENCY_END_TO_END. Before mavsink_start(). */
+bool mavsink_add(const char *p_spec);
+int mavsink_count(void);
+bool mavsink_start(void);
+
+/* NULL if no batch is free (the sinks are far behind), never waits.
+   Set predicted in it before mavsink_send() for pdiv=.
+   Messages sent on MAVSINK_CHAN by this thread go into the batch until
+   mavsink_send(); more than MAVSINK_BATCH_MSGS are left out. */
+mavsink_batch_t *mavsink_batch_get(int64_t t_capture);
+/* Hands the batch to every sink that wants it; any thread */
+void mavsink_send(mavsink_batch_t *p_batch);
+
+/* Messages sent, skipped by the divider, filtered and dropped per sink */
+void mavsink_dump(FILE *p_file);
+
+#endif
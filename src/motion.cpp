@@ -1,59 +1,333 @@
 #include "motion.h"
 
+#include <algorithm>
 #include <opencv2/calib3d/calib3d.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/video/video.hpp>
+#include "latency.h"
 #include "sensors.h"
+#include "trace.h"
 #include "transform.h"
 #include "undistort.h"
 
 using namespace cv;
 using namespace std;
 
+static bool live_gyro_integrate(void *p_arg, int64_t t0, int64_t t1,
+				double *p_x, double *p_y, double *p_z)
+{
+	return sensors_gyro_integrate(t0, t1, p_x, p_y, p_z);
+}
+
 void motion_init(void)
 {
 	undistort_init();
 }
 
-void motion_calc_from_imv(cv_imv& imv, motion_t *p_motion, int sad_limit)
+void motion_state_init(motion_state_t *p_state)
 {
-	static Mat1f empty_homography;
-	static suseconds_t t_max;
-	suseconds_t t1, t2, t3, t;
+	p_state->prev_timestamp = 0;
+	p_state->t_max = 0;
+	transform_state_init(&p_state->transform);
+	p_state->gyro_integrate = live_gyro_integrate;
+	p_state->p_gyro_arg = NULL;
+}
 
-	t1 = microseconds();
+void motion_sampling_init(motion_sampling_t *p_sampling)
+{
+	p_sampling->stride = 1;
+	p_sampling->sad_max = 0;
+	p_sampling->p_mask = NULL;
+	p_sampling->tile_size = 0;
+	p_sampling->per_tile = 0;
+	p_sampling->p_prefilter = NULL;
+}
+
+void motion_prefilter_init(motion_prefilter_t *p_prefilter, int threshold)
+{
+	p_prefilter->threshold = threshold;
+	p_prefilter->mbx = 0;
+	p_prefilter->mby = 0;
+	p_prefilter->prev.clear();
+	p_prefilter->checked = 0;
+	p_prefilter->rejected = 0;
+}
+
+bool motion_mask_load(const char *p_path, int mbx, int mby,
+		      vector<uint8_t>& mask)
+{
+	Mat img = imread(p_path, IMREAD_GRAYSCALE);
+
+	if (img.empty()) {
+		ERR("motion_mask_load(): Can't read " << p_path);
+		return false;
+	}
+
+	/* Average over each block: usable if mostly white */
+	Mat blocks;
+	resize(img, blocks, Size(mbx, mby), 0, 0, INTER_AREA);
+
+	mask.resize(mbx * mby);
+
+	int usable = 0;
+	for (int j = 0; j < mby; j++) {
+		for (int i = 0; i < mbx; i++) {
+			mask[i + mbx*j] = (blocks.at<uint8_t>(j, i) >= 128);
+			usable += mask[i + mbx*j];
+		}
+	}
+
+	DBG("motion_mask_load(): " << usable << " of " << mbx*mby << " blocks usable");
+
+	return true;
+}
+
+typedef struct {
+	int i;
+	int j;
+	const cv_imv_t *p_vec;
+} candidate_t;
+
+static bool lower_sad(const candidate_t& a, const candidate_t& b)
+{
+	return a.p_vec->sad < b.p_vec->sad;
+}
+
+/* Median of at most 9 values */
+static inline int median(int *p_val, int n)
+{
+	for (int k = 1; k < n; k++) {
+		int v = p_val[k];
+		int l = k;
+
+		for (; l > 0 && p_val[l-1] > v; l--)
+			p_val[l] = p_val[l-1];
+		p_val[l] = v;
+	}
+
+	return p_val[n/2];
+}
+
+static inline int deviation(int x0, int y0, int x1, int y1)
+{
+	return max(abs(x0 - x1), abs(y0 - y1));
+}
+
+/* True if the vector of block (i, j) disagrees with its 3x3 neighbourhood
+   and with the previous frame */
+static bool prefilter_reject(const motion_prefilter_t *p_prefilter,
+			     const cv_imv_t *p_imv, int mbx, int mby, int i, int j)
+{
+	const cv_imv_t *p_vec = p_imv + (i+(mbx+1)*j);
+	const int8_t *p_prev = &p_prefilter->prev[2*(i + mbx*j)];
+
+	/* Temporal test first, it is the cheaper one */
+	if (deviation(p_vec->x, p_vec->y, p_prev[0], p_prev[1]) <=
+	    p_prefilter->threshold)
+		return false;
+
+	int xs[9];
+	int ys[9];
+	int n = 0;
+
+	for (int l = max(j-1, 0); l <= min(j+1, mby-1); l++) {
+		for (int k = max(i-1, 0); k <= min(i+1, mbx-1); k++) {
+			xs[n] = p_imv[k+(mbx+1)*l].x;
+			ys[n] = p_imv[k+(mbx+1)*l].y;
+			n++;
+		}
+	}
+
+	return deviation(p_vec->x, p_vec->y, median(xs, n), median(ys, n)) >
+	       p_prefilter->threshold;
+}
+
+/* Keeps this frame's grid for the next one */
+static void prefilter_store(motion_prefilter_t *p_prefilter,
+			    const cv_imv_t *p_imv, int mbx, int mby)
+{
+	p_prefilter->mbx = mbx;
+	p_prefilter->mby = mby;
+	p_prefilter->prev.resize(2*mbx*mby);
+
+	int8_t *p_prev = p_prefilter->prev.data();
+
+	for (int j = 0; j < mby; j++) {
+		for (int i = 0; i < mbx; i++) {
+			*p_prev++ = p_imv[i+(mbx+1)*j].x;
+			*p_prev++ = p_imv[i+(mbx+1)*j].y;
+		}
+	}
+}
+
+static inline void add_point(int i, int j, const cv_imv_t *p_vec, int sad_limit,
+			     vector<Point2f>& pts_src, vector<Point2f>& pts_dst,
+			     vector<float>& weights)
+{
+	int x = i*16 + 8;
+	int y = j*16 + 8;
 
-	vector<Point2f> pts_src;
-	vector<Point2f> pts_dst;
+	pts_src.push_back(Point2f(x+p_vec->x, y+p_vec->y));
+	pts_dst.push_back(Point2f(x, y));
 
-	int count = 0;
+	/* Prior weight: vectors with low SAD are more reliable */
+	if (sad_limit > 0)
+		weights.push_back(1.0f / (1.0f + (float)p_vec->sad / sad_limit));
+	else
+		weights.push_back(1.0f);
+}
 
+int motion_extract_points(cv_imv& imv, int sad_limit,
+			  const motion_sampling_t *p_sampling,
+			  vector<Point2f>& pts_src, vector<Point2f>& pts_dst,
+			  vector<float>& weights)
+{
+	motion_sampling_t all;
 	cv_imv_t *p_imv = imv.imv();
 	int mbx = imv.mbx();
 	int mby = imv.mby();
 
-	for (int j = 0; j < mby; j++) {
-		for (int i = 0; i < mbx; i++) {
-			cv_imv_t *p_vec = p_imv + (i+(mbx+1)*j);
+	if (p_sampling == NULL) {
+		motion_sampling_init(&all);
+		p_sampling = &all;
+	}
+
+	int stride = max(p_sampling->stride, 1);
+	int sad_max = p_sampling->sad_max;
+	const uint8_t *p_mask = p_sampling->p_mask;
+	int tile = (p_sampling->per_tile > 0) ?
+		   min(p_sampling->tile_size, MOTION_TILE_MAX) : 0;
+
+	/* Without a previous grid of the same size nothing is rejected */
+	motion_prefilter_t *p_prefilter = p_sampling->p_prefilter;
+	bool prefilter = p_prefilter != NULL && !p_prefilter->prev.empty() &&
+			 p_prefilter->mbx == mbx && p_prefilter->mby == mby;
+	int checked = 0;
+	int rejected = 0;
+
+	pts_src.clear();
+	pts_dst.clear();
+	weights.clear();
+
+	/* Blocks are visited tile by tile (the whole grid is one tile
+	   without tiling) and only the per_tile lowest SADs of a tile kept */
+	int tw = (tile > 0) ? tile : mbx;
+	int th = (tile > 0) ? tile : mby;
+
+	candidate_t cand[MOTION_TILE_MAX * MOTION_TILE_MAX];
+
+	for (int tj = 0; tj < mby; tj += th) {
+		for (int ti = 0; ti < mbx; ti += tw) {
+			int n = 0;
+
+			for (int j = tj; j < min(tj + th, mby); j++) {
+				/* Stride pattern shifted by one block per row */
+				int i0 = ti + ((j - ti) % stride + stride) % stride;
+
+				for (int i = i0; i < min(ti + tw, mbx); i += stride) {
+					const cv_imv_t *p_vec = p_imv + (i+(mbx+1)*j);
+
+					if (p_vec->x == 0 && p_vec->y == 0)
+						continue;
 
-			if (p_vec->x == 0 && p_vec->y == 0)
-				continue;
+					if (sad_max > 0 && p_vec->sad > sad_max)
+						continue;
 
-			//if (p_vec->sad > sad_limit)
-			//	continue;
+					if (p_mask != NULL && !p_mask[i + mbx*j])
+						continue;
 
-			int x = i*16 + 8;
-			int y = j*16 + 8;
+					if (prefilter) {
+						checked++;
+						if (prefilter_reject(p_prefilter, p_imv,
+								     mbx, mby, i, j)) {
+							rejected++;
+							continue;
+						}
+					}
 
-			pts_src.push_back(Point2f(x+p_vec->x, y+p_vec->y));
-			pts_dst.push_back(Point2f(x, y));
-			count++;
+					if (tile == 0) {
+						add_point(i, j, p_vec, sad_limit,
+							  pts_src, pts_dst, weights);
+						continue;
+					}
+
+					cand[n].i = i;
+					cand[n].j = j;
+					cand[n].p_vec = p_vec;
+					n++;
+				}
+			}
+
+			if (n > p_sampling->per_tile) {
+				nth_element(cand, cand + p_sampling->per_tile, cand + n,
+					    lower_sad);
+				n = p_sampling->per_tile;
+			}
+
+			for (int k = 0; k < n; k++)
+				add_point(cand[k].i, cand[k].j, cand[k].p_vec, sad_limit,
+					  pts_src, pts_dst, weights);
 		}
 	}
 
-	t2 = microseconds();
+	if (p_prefilter != NULL) {
+		p_prefilter->checked = checked;
+		p_prefilter->rejected = rejected;
+		prefilter_store(p_prefilter, p_imv, mbx, mby);
+		DBG("motion_extract_points(): prefilter rejected " << rejected
+		    << " of " << checked);
+	}
+
+	return pts_src.size();
+}
+
+void motion_prepare(cv_imv& imv, int sad_limit,
+		    const motion_sampling_t *p_sampling, motion_points_t *p_points)
+{
+	p_points->timestamp = imv.timestamp();
+
+	int count = motion_extract_points(imv, sad_limit, p_sampling, p_points->pts_src,
+					  p_points->pts_dst, p_points->weights);
+
+	/* The destinations are still the block centres */
+	int mbx = imv.mbx();
+	p_points->blocks.resize(count);
+	for (int k = 0; k < count; k++)
+		p_points->blocks[k] = ((int)p_points->pts_dst[k].x - 8) / 16 +
+				      mbx * (((int)p_points->pts_dst[k].y - 8) / 16);
+
+	DBG("motion_prepare(): " << count << " vectors");
+}
 
+void motion_correct(motion_state_t *p_state, motion_points_t *p_points)
+{
+	if (!p_points->pts_src.empty()) {
+		TRACE_SCOPE("undistort+compensate");
+		double angle_x, angle_y, angle_z;
+		int64_t ts = microseconds_monotonic();
+
+		undistort_process_flow(p_points->pts_src, p_points->pts_dst);
+
+		int64_t tu = microseconds_monotonic();
+		latency_record(LATENCY_UNDISTORT, tu - ts);
+
+		if (p_state->gyro_integrate != NULL && p_state->prev_timestamp != 0 &&
+		    p_state->gyro_integrate(p_state->p_gyro_arg, p_state->prev_timestamp,
+					    p_points->timestamp, &angle_x, &angle_y,
+					    &angle_z))
+			sensors_compensate(p_points->pts_src, angle_x, angle_y);
 
-	DBG("motion_calc_from_imv(): " << count << " vectors");
+		latency_record(LATENCY_COMPENSATE, microseconds_monotonic() - tu);
+	}
+
+	p_state->prev_timestamp = p_points->timestamp;
+}
+
+void motion_estimate(motion_state_t *p_state, motion_points_t *p_points,
+		     motion_t *p_motion)
+{
+	int count = p_points->pts_src.size();
 
 	p_motion->dx = 0;
 	p_motion->dy = 0;
@@ -61,23 +335,60 @@ void motion_calc_from_imv(cv_imv& imv, motion_t *p_motion, int sad_limit)
 	p_motion->res.vec_in = count;
 	p_motion->res.vec_good = 0;
 
-	if (count > 0) {
-		undistort_process_flow(pts_src, pts_dst);
-		sensors_compensate(pts_src, pts_dst);
+	if (count >= 3) {
+		TRACE_SCOPE("ransac");
+		int64_t ts = microseconds_monotonic();
+		p_motion->affine_xform = transform_estimate_rigid(&p_state->transform, p_points->pts_src, p_points->pts_dst, p_points->weights, &p_motion->res.vec_good);
+		latency_record(LATENCY_RANSAC, microseconds_monotonic() - ts);
+	} else {
+		p_motion->affine_xform = Mat();
 	}
 
-	if (count >= 3)
-		p_motion->affine_xform = transform_estimate_rigid(pts_src, pts_dst, &p_motion->res.vec_good);
-	else
-		p_motion->affine_xform = empty_homography;
+	DBG("motion_estimate(): Estimated [A|b] is:" << endl << p_motion->affine_xform);
+}
+
+void motion_inlier_mask(const motion_points_t *p_points, const motion_t *p_motion,
+			int mbx, int mby, uint8_t *p_mask)
+{
+	int count = p_points->pts_src.size();
+	const Mat& A = p_motion->affine_xform;
+
+	memset(p_mask, CV_IMV_BLOCK_UNUSED, mbx * mby);
+
+	if ((int)p_points->blocks.size() != count)
+		return;
+
+	vector<uint8_t> inlier(count, 0);
+	if (A.rows == 2 && A.cols == 3)
+		transform_inliers(A, p_points->pts_src, p_points->pts_dst, &inlier[0]);
+
+	for (int k = 0; k < count; k++)
+		p_mask[p_points->blocks[k]] = inlier[k] ? CV_IMV_BLOCK_INLIER :
+					      CV_IMV_BLOCK_OUTLIER;
+}
+
+void motion_calc_from_imv(motion_state_t *p_state, cv_imv& imv,
+			  motion_t *p_motion, int sad_limit)
+{
+	suseconds_t t1, t2, t3, t;
+	motion_points_t points;
+
+	TRACE_SCOPE("motion");
+
+	t1 = microseconds();
+
+	motion_prepare(imv, sad_limit, NULL, &points);
+
+	t2 = microseconds();
+
+	motion_correct(p_state, &points);
+	motion_estimate(p_state, &points, p_motion);
 
 	t3 = microseconds();
 
 	t = t3 - t1;
-	if (t > t_max)
-		t_max = t;
-
-	DBG("motion_calc_from_imv(): Estimated [A|b] is:" << endl << p_motion->affine_xform);
+	if (t > p_state->t_max)
+		p_state->t_max = t;
 
-	DBG("motion_calc_from_imv(): " << t << " (copy: " << (t2-t1) << ", max: " << t_max << ") us");	
+	DBG("motion_calc_from_imv(): " << t << " (copy: " << (t2-t1) << ", max: " << p_state->t_max << ") us");	
 }
@@ -5,6 +5,20 @@
 
 #include "common.h"
 #include "cv_imv.h"
+#include "transform.h"
+
+/* Rotation between two frames [deg], false if unknown */
+typedef bool (*motion_gyro_fn_t)(void *p_arg, int64_t t0, int64_t t1,
+				 double *p_x, double *p_y, double *p_z);
+
+/* Carried from one frame to the next; one per stream of frames */
+typedef struct {
+	int64_t prev_timestamp;
+	suseconds_t t_max;
+	transform_state_t transform;
+	motion_gyro_fn_t gyro_integrate; /* NULL: no rotation compensation */
+	void *p_gyro_arg;
+} motion_state_t;
 
 typedef struct {
 	cv::Mat affine_xform;
@@ -17,7 +31,82 @@ typedef struct {
 	} res;
 } motion_t;
 
+#define MOTION_TILE_MAX		16 /* [blocks] */
+
+/* Temporal-consistency prefilter: a vector is rejected if it differs by
+   more than threshold from both the median of its 3x3 neighbourhood and the
+   same block in the previous frame. Keeps the previous grid; one per stream
+   of frames. */
+typedef struct {
+	int threshold; /* [px] */
+	int mbx;
+	int mby;
+	std::vector<int8_t> prev; /* x, y per block, empty: no previous frame */
+	int checked; /* Last frame */
+	int rejected;
+} motion_prefilter_t;
+
+/* Which vectors become point pairs */
+typedef struct {
+	int stride; /* Every stride-th block, shifted by one per row; 1: all */
+	int sad_max; /* Vectors with a higher SAD are dropped, 0: no gate */
+	const uint8_t *p_mask; /* mbx*mby, 0: block never used; NULL: no mask */
+	/* Stratified subsampling: only the per_tile vectors with the lowest
+	   SAD of each tile_size x tile_size blocks are kept, 0: off */
+	int tile_size;
+	int per_tile;
+	motion_prefilter_t *p_prefilter; /* NULL: off */
+} motion_sampling_t;
+
+/* Point pairs of one frame on their way through the motion_prepare() steps */
+typedef struct {
+	int64_t timestamp;
+	std::vector<cv::Point2f> pts_src;
+	std::vector<cv::Point2f> pts_dst;
+	std::vector<float> weights;
+	std::vector<int> blocks; /* Grid index (i + mbx*j) of every pair */
+} motion_points_t;
+
+/* Everything, no mask, no tiles, no prefilter */
+void motion_sampling_init(motion_sampling_t *p_sampling);
+void motion_prefilter_init(motion_prefilter_t *p_prefilter, int threshold);
+
+/* Block validity mask for motion_sampling_t from an image of any size
+   (white: usable, e.g. black over propeller arms, landing gear and heavily
+   distorted borders) */
+bool motion_mask_load(const char *p_path, int mbx, int mby,
+		      std::vector<uint8_t>& mask);
+
 void motion_init(void);
-void motion_calc_from_imv(cv_imv& imv, motion_t *p_motion, int sad_limit);
+/* Compensates with the live gyro, sensors_gyro_integrate() */
+void motion_state_init(motion_state_t *p_state);
+
+/* Non-zero vectors as point pairs (previous -> current position) with their
+   prior weights; the vectors are cleared first. p_sampling may be NULL (all
+   vectors). Returns the number of pairs. */
+int motion_extract_points(cv_imv& imv, int sad_limit,
+			  const motion_sampling_t *p_sampling,
+			  std::vector<cv::Point2f>& pts_src,
+			  std::vector<cv::Point2f>& pts_dst,
+			  std::vector<float>& weights);
+
+/* motion_calc_from_imv() split into its steps: point extraction,
+   undistortion and gyro compensation, and the estimate. Each step only uses
+   its own part of the state (correct: prev_timestamp, estimate: transform),
+   so consecutive frames can be in different steps on different threads as
+   long as every step sees the frames in order. */
+void motion_prepare(cv_imv& imv, int sad_limit,
+		    const motion_sampling_t *p_sampling, motion_points_t *p_points);
+void motion_correct(motion_state_t *p_state, motion_points_t *p_points);
+void motion_estimate(motion_state_t *p_state, motion_points_t *p_points,
+		     motion_t *p_motion);
+
+/* Per block of the mbx*mby grid, CV_IMV_BLOCK_UNUSED, _OUTLIER or _INLIER
+   (within the RANSAC threshold of the estimate) */
+void motion_inlier_mask(const motion_points_t *p_points, const motion_t *p_motion,
+			int mbx, int mby, uint8_t *p_mask);
+
+void motion_calc_from_imv(motion_state_t *p_state, cv_imv& imv,
+			  motion_t *p_motion, int sad_limit);
 
 #endif
@@ -0,0 +1,113 @@
+#include "predict.h"
+
+#include <algorithm>
+
+using namespace std;
+
+#define PREDICT_MAX_AGE_US	200000 /* Extrapolation horizon */
+#define PREDICT_JERK_PSD	20.0 /* Process noise [(m/s^3)^2/Hz] */
+#define PREDICT_MEAS_SIGMA	0.05 /* Velocity of a perfect frame [m/s] */
+#define PREDICT_INIT_SIGMA_A	2.0 /* [m/s^2] */
+
+static void axis_init(predict_axis_t *p_axis, double v, double r)
+{
+	p_axis->x[0] = v;
+	p_axis->x[1] = 0;
+	p_axis->P[0][0] = r;
+	p_axis->P[0][1] = 0;
+	p_axis->P[1][0] = 0;
+	p_axis->P[1][1] = PREDICT_INIT_SIGMA_A * PREDICT_INIT_SIGMA_A;
+}
+
+/* x = F x, P = F P F' + Q with F = [1 dt; 0 1] and white jerk noise */
+static void axis_predict(predict_axis_t *p_axis, double dt)
+{
+	double q = PREDICT_JERK_PSD;
+	double (*P)[2] = p_axis->P;
+
+	p_axis->x[0] += p_axis->x[1] * dt;
+
+	double p00 = P[0][0] + dt * (P[1][0] + P[0][1]) + dt * dt * P[1][1];
+	double p01 = P[0][1] + dt * P[1][1];
+	double p11 = P[1][1];
+
+	P[0][0] = p00 + q * dt * dt * dt / 3.0;
+	P[0][1] = p01 + q * dt * dt / 2.0;
+	P[1][0] = P[0][1];
+	P[1][1] = p11 + q * dt;
+}
+
+/* Measurement of the velocity (H = [1 0]) with variance r */
+static void axis_update(predict_axis_t *p_axis, double v, double r)
+{
+	double (*P)[2] = p_axis->P;
+	double s = P[0][0] + r;
+	double k0 = P[0][0] / s;
+	double k1 = P[1][0] / s;
+	double innovation = v - p_axis->x[0];
+
+	p_axis->x[0] += k0 * innovation;
+	p_axis->x[1] += k1 * innovation;
+
+	double p00 = (1 - k0) * P[0][0];
+	double p01 = (1 - k0) * P[0][1];
+	double p11 = P[1][1] - k1 * P[0][1];
+
+	P[0][0] = p00;
+	P[0][1] = p01;
+	P[1][0] = p01;
+	P[1][1] = p11;
+}
+
+void predict_init(predict_t *p_predict)
+{
+	memset(p_predict, 0, sizeof(*p_predict));
+}
+
+void predict_update(predict_t *p_predict, int64_t t, double vx, double vy,
+		    uint8_t quality)
+{
+	if (quality == 0 || t <= p_predict->t)
+		return;
+
+	/* Low-quality frames count less */
+	double sigma = PREDICT_MEAS_SIGMA * 255.0 / quality;
+	double r = sigma * sigma;
+
+	/* Restart after a gap the model does not bridge */
+	if (p_predict->t == 0 || t - p_predict->t > PREDICT_MAX_AGE_US) {
+		axis_init(&p_predict->axis[0], vx, r);
+		axis_init(&p_predict->axis[1], vy, r);
+	} else {
+		double dt = (t - p_predict->t) / 1000000.0;
+
+		axis_predict(&p_predict->axis[0], dt);
+		axis_predict(&p_predict->axis[1], dt);
+		axis_update(&p_predict->axis[0], vx, r);
+		axis_update(&p_predict->axis[1], vy, r);
+	}
+
+	p_predict->t = t;
+	p_predict->quality = quality;
+}
+
+bool predict_velocity(const predict_t *p_predict, int64_t t, double *p_vx,
+		      double *p_vy, uint8_t *p_quality)
+{
+	if (p_predict->t == 0)
+		return false;
+
+	int64_t age = max(t - p_predict->t, (int64_t)0);
+	double dt = min(age, (int64_t)PREDICT_MAX_AGE_US) / 1000000.0;
+
+	*p_vx = p_predict->axis[0].x[0] + p_predict->axis[0].x[1] * dt;
+	*p_vy = p_predict->axis[1].x[0] + p_predict->axis[1].x[1] * dt;
+
+	if (age >= PREDICT_MAX_AGE_US)
+		*p_quality = 0;
+	else
+		*p_quality = (uint8_t)(p_predict->quality *
+				       (PREDICT_MAX_AGE_US - age) / PREDICT_MAX_AGE_US);
+
+	return true;
+}
@@ -0,0 +1,34 @@
+#ifndef PREDICT_H
+#define PREDICT_H
+
+#include "common.h"
+
+/* Velocity over ground between camera frames: a constant-acceleration
+   Kalman filter per axis, updated with the flow-derived velocity of every
+   frame and extrapolated to any later time (e.g. every gyro readout) */
+
+typedef struct {
+	double x[2]; /* Velocity [m/s], acceleration [m/s^2] */
+	double P[2][2];
+} predict_axis_t;
+
+/* Plain data, can be copied (seqlock) */
+typedef struct {
+	predict_axis_t axis[2];
+	int64_t t; /* Of the last update [us], 0: no estimate yet */
+	uint8_t quality; /* Of the last frame, 0..255 */
+} predict_t;
+
+void predict_init(predict_t *p_predict);
+
+/* Velocity measured for time t [us], e.g. the middle of the frame interval.
+   Frames of quality 0 and measurements older than the state are ignored. */
+void predict_update(predict_t *p_predict, int64_t t, double vx, double vy,
+		    uint8_t quality);
+
+/* Velocity extrapolated to t; the quality decays to 0 within
+   PREDICT_MAX_AGE_US of the last frame. False without an estimate. */
+bool predict_velocity(const predict_t *p_predict, int64_t t, double *p_vx,
+		      double *p_vy, uint8_t *p_quality);
+
+#endif
@@ -0,0 +1,455 @@
+#include "recorder.h"
+#include "imvlog.h"
+#include "rtsched.h"
+#include "trace.h"
+
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <string>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#define RECORDER_BUFFER_SIZE	(512*1024) /* Per buffer, two per channel */
+#define RECORDER_FLUSH_US	1000000 /* Max age of a partially filled buffer */
+#define RECORDER_COMPRESS_IMV	true /* Encoded on the writer thread */
+
+using namespace std;
+
+typedef enum {
+	BUFFER_FREE = 0, /* Owned by the producer */
+	BUFFER_FULL /* Owned by the writer thread */
+} buffer_state_t;
+
+typedef struct {
+	uint8_t *p_data;
+	uint32_t used;
+	uint32_t records;
+	int64_t t_first;
+	int64_t t_last;
+	std::atomic<int> state;
+} buffer_t;
+
+/* Double buffer with exactly one producer thread, so appending needs no
+   synchronization; only the hand-over to the writer is atomic. */
+typedef struct {
+	buffer_t buffers[2];
+	int active;
+	int64_t t_opened; /* When the active buffer got its first record */
+	unsigned long dropped;
+} channel_t;
+
+static bool m_initialized;
+static std::atomic<bool> m_run;
+static std::atomic<int> m_producers; /* Between producer_enter/leave() */
+static int m_fd = -1;
+static int m_mbx;
+static int m_mby;
+static uint32_t m_imv_seq; /* Frame thread only */
+static pthread_t m_thread;
+static sem_t m_sem;
+
+static channel_t m_channels[RECORDER_CH_COUNT];
+
+/* Writer thread only: */
+static imvlog_writer_t m_imvlog;
+static vector<recorder_index_entry_t> m_index;
+static uint64_t m_offset;
+
+static bool write_all(const void *p_data, size_t length)
+{
+	const uint8_t *p = (const uint8_t *)p_data;
+
+	while (length > 0) {
+		ssize_t n = write(m_fd, p, length);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		p += n;
+		length -= n;
+	}
+
+	return true;
+}
+
+static void write_chunk(int channel, buffer_t *p_buffer)
+{
+	if (p_buffer->used == 0)
+		return;
+
+	recorder_chunk_header_t hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = RECORDER_CHUNK_MAGIC;
+	hdr.channel = channel;
+	hdr.size = p_buffer->used;
+	hdr.records = p_buffer->records;
+	hdr.t_first = p_buffer->t_first;
+	hdr.t_last = p_buffer->t_last;
+
+	recorder_index_entry_t entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.offset = m_offset;
+	entry.channel = channel;
+	entry.t_first = p_buffer->t_first;
+	entry.t_last = p_buffer->t_last;
+
+	if (!write_all(&hdr, sizeof(hdr)) ||
+	    !write_all(p_buffer->p_data, p_buffer->used)) {
+		ERR("recorder: write failed: " << errno);
+		return;
+	}
+
+	m_offset += sizeof(hdr) + p_buffer->used;
+	m_index.push_back(entry);
+}
+
+static void write_buffer(int channel, buffer_t *p_buffer)
+{
+	if (channel != RECORDER_CH_IMV) {
+		write_chunk(channel, p_buffer);
+		return;
+	}
+
+	if (!imvlog_writer_append(&m_imvlog, p_buffer->p_data, p_buffer->records))
+		ERR("recorder: IMV write failed: " << errno);
+}
+
+/* Writes out all buffers handed over by the producers */
+static void write_full_buffers(void)
+{
+	for (int c = 0; c < RECORDER_CH_COUNT; c++) {
+		for (int b = 0; b < 2; b++) {
+			buffer_t *p_buffer = &m_channels[c].buffers[b];
+
+			if (p_buffer->state.load(std::memory_order_acquire) != BUFFER_FULL)
+				continue;
+
+			TRACE_SCOPE("recorder write", c);
+			write_buffer(c, p_buffer);
+
+			p_buffer->used = 0;
+			p_buffer->records = 0;
+			p_buffer->state.store(BUFFER_FREE, std::memory_order_release);
+		}
+	}
+}
+
+static void *recorder_thread(void *ptr)
+{
+	rtsched_thread(RTSCHED_ROLE_RECORDER, "recorder");
+	trace_thread_name("recorder");
+
+	while (m_run) {
+		sem_wait(&m_sem);
+		write_full_buffers();
+	}
+
+	write_full_buffers();
+
+	return NULL;
+}
+
+/* Producer side: hands the active buffer over to the writer and switches to
+   the other one, if the writer has already released it. */
+static void channel_seal(channel_t *p_channel)
+{
+	buffer_t *p_active = &p_channel->buffers[p_channel->active];
+	buffer_t *p_other = &p_channel->buffers[p_channel->active ^ 1];
+
+	if (p_active->used == 0)
+		return;
+
+	if (p_other->state.load(std::memory_order_acquire) != BUFFER_FREE)
+		return;
+
+	p_active->state.store(BUFFER_FULL, std::memory_order_release);
+	p_channel->active ^= 1;
+	sem_post(&m_sem);
+}
+
+/* Returns where a record of size bytes is to be written, or NULL if it has
+   to be dropped. Frame channel writes are complete when channel_commit() is
+   called. */
+static uint8_t *channel_reserve(channel_t *p_channel, int64_t t, uint32_t size)
+{
+	buffer_t *p_buffer = &p_channel->buffers[p_channel->active];
+
+	if (p_buffer->used > 0 &&
+	    (p_buffer->used + size > RECORDER_BUFFER_SIZE ||
+	     t - p_channel->t_opened > RECORDER_FLUSH_US)) {
+		channel_seal(p_channel);
+		p_buffer = &p_channel->buffers[p_channel->active];
+	}
+
+	if (p_buffer->used + size > RECORDER_BUFFER_SIZE) {
+		/* Both buffers are waiting for the writer (or the record
+		   would never fit) */
+		p_channel->dropped++;
+		return NULL;
+	}
+
+	if (p_buffer->used == 0) {
+		p_buffer->t_first = t;
+		p_channel->t_opened = t;
+	}
+
+	return p_buffer->p_data + p_buffer->used;
+}
+
+static void channel_commit(channel_t *p_channel, int64_t t, uint32_t size)
+{
+	buffer_t *p_buffer = &p_channel->buffers[p_channel->active];
+
+	p_buffer->used += size;
+	p_buffer->records++;
+	p_buffer->t_last = t;
+}
+
+/* Brackets every producer access, so that recorder_stop() can wait for
+   records that are being appended */
+static bool producer_enter(void)
+{
+	if (!m_initialized)
+		return false;
+
+	m_producers++;
+
+	if (!m_run) {
+		m_producers--;
+		return false;
+	}
+
+	return true;
+}
+
+static void producer_leave(void)
+{
+	m_producers--;
+}
+
+static void channel_append(int channel, uint16_t type, int64_t t,
+			   const void *p_payload, uint32_t payload_len)
+{
+	if (!producer_enter())
+		return;
+
+	channel_t *p_channel = &m_channels[channel];
+	uint32_t size = sizeof(recorder_record_t) + payload_len;
+	uint8_t *p = channel_reserve(p_channel, t, size);
+
+	if (p != NULL) {
+		recorder_record_t rec;
+		rec.type = type;
+		rec.reserved = 0;
+		rec.size = payload_len;
+		rec.t = t;
+
+		memcpy(p, &rec, sizeof(rec));
+		memcpy(p + sizeof(rec), p_payload, payload_len);
+
+		channel_commit(p_channel, t, size);
+	}
+
+	producer_leave();
+}
+
+bool recorder_init(const char *p_path, int mbx, int mby)
+{
+	DBG("recorder_init(" << p_path << ", " << mbx << ", " << mby << ")");
+
+	m_fd = open(p_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (m_fd == -1) {
+		ERR("recorder_init(): Can't open " << p_path);
+		return false;
+	}
+
+	string imv_path = string(p_path) + RECORDER_IMV_SUFFIX;
+	if (!imvlog_writer_open(&m_imvlog, imv_path.c_str(), mbx, mby,
+				RECORDER_COMPRESS_IMV)) {
+		close(m_fd);
+		return false;
+	}
+
+	m_mbx = mbx;
+	m_mby = mby;
+	m_imv_seq = 0;
+
+	for (int c = 0; c < RECORDER_CH_COUNT; c++) {
+		for (int b = 0; b < 2; b++) {
+			buffer_t *p_buffer = &m_channels[c].buffers[b];
+
+			p_buffer->p_data = (uint8_t *)malloc(RECORDER_BUFFER_SIZE);
+			if (p_buffer->p_data == NULL) {
+				ERR("recorder_init(): Out of memory");
+				return false;
+			}
+
+			/* Prefault so that the first records do not page-fault
+			   on the frame thread */
+			memset(p_buffer->p_data, 0, RECORDER_BUFFER_SIZE);
+			p_buffer->used = 0;
+			p_buffer->records = 0;
+			p_buffer->state.store(BUFFER_FREE);
+		}
+
+		m_channels[c].active = 0;
+		m_channels[c].dropped = 0;
+	}
+
+	recorder_file_header_t hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, RECORDER_MAGIC, sizeof(hdr.magic));
+	hdr.version = RECORDER_VERSION;
+	hdr.header_size = sizeof(hdr);
+
+	if (!write_all(&hdr, sizeof(hdr))) {
+		ERR("recorder_init(): Can't write header");
+		return false;
+	}
+
+	m_offset = sizeof(hdr);
+	m_index.clear();
+	sem_init(&m_sem, 0, 0);
+
+	m_initialized = true;
+
+	return true;
+}
+
+bool recorder_start(void)
+{
+	if (!m_initialized)
+		return false;
+
+	DBG("recorder_start()");
+
+	m_run = true;
+
+	int rc = pthread_create(&m_thread, NULL, recorder_thread, NULL);
+	if (rc) {
+		ERR("Unable to create recorder thread: " << rc);
+		m_run = false;
+		return false;
+	}
+
+	return true;
+}
+
+void recorder_stop(void)
+{
+	if (!m_initialized || !m_run)
+		return;
+
+	DBG("recorder_stop()");
+
+	m_run = false;
+
+	/* Let a record that is being appended complete */
+	while (m_producers > 0)
+		usleep(100);
+
+	sem_post(&m_sem);
+	pthread_join(m_thread, NULL);
+
+	/* Partially filled buffers */
+	for (int c = 0; c < RECORDER_CH_COUNT; c++) {
+		write_buffer(c, &m_channels[c].buffers[m_channels[c].active]);
+
+		if (m_channels[c].dropped > 0)
+			ERR("recorder: channel " << c << " dropped " <<
+			    m_channels[c].dropped << " records");
+	}
+
+	recorder_index_header_t idx;
+	idx.magic = RECORDER_INDEX_MAGIC;
+	idx.count = m_index.size();
+
+	recorder_trailer_t trailer;
+	trailer.index_offset = m_offset;
+	trailer.magic = RECORDER_TRAILER_MAGIC;
+	trailer.reserved = 0;
+
+	if (!write_all(&idx, sizeof(idx)) ||
+	    (idx.count > 0 && !write_all(&m_index[0], idx.count * sizeof(m_index[0]))) ||
+	    !write_all(&trailer, sizeof(trailer)))
+		ERR("recorder_stop(): Can't write index");
+
+	close(m_fd);
+	imvlog_writer_close(&m_imvlog);
+	sem_destroy(&m_sem);
+
+	for (int c = 0; c < RECORDER_CH_COUNT; c++)
+		for (int b = 0; b < 2; b++)
+			free(m_channels[c].buffers[b].p_data);
+
+	m_initialized = false;
+}
+
+void recorder_log_imv(cv_imv& imv)
+{
+	if (!producer_enter())
+		return;
+
+	uint32_t seq = m_imv_seq++;
+
+	if (imv.mbx() == m_mbx && imv.mby() == m_mby) {
+		channel_t *p_channel = &m_channels[RECORDER_CH_IMV];
+		uint32_t size = imvlog_record_size(m_mbx, m_mby);
+		uint8_t *p = channel_reserve(p_channel, imv.timestamp(), size);
+
+		if (p != NULL) {
+			imvlog_record_fill(p, m_mbx, m_mby, imv.timestamp(), seq,
+					   imv.imv());
+			channel_commit(p_channel, imv.timestamp(), size);
+		}
+	}
+
+	producer_leave();
+}
+
+void recorder_log_motion(int64_t t, motion_t *p_motion)
+{
+	recorder_motion_t rec;
+	memset(&rec, 0, sizeof(rec));
+
+	cv::Mat& A = p_motion->affine_xform;
+	if (A.rows == 2 && A.cols == 3) {
+		for (int i = 0; i < 6; i++)
+			rec.xform[i] = A.at<double>(i/3, i%3);
+		rec.valid = 1;
+	}
+
+	rec.dx = p_motion->dx;
+	rec.dy = p_motion->dy;
+	rec.vec_in = p_motion->res.vec_in;
+	rec.vec_good = p_motion->res.vec_good;
+
+	channel_append(RECORDER_CH_FRAME, RECORDER_REC_MOTION, t,
+		       &rec, sizeof(rec));
+}
+
+void recorder_log_gyro(int64_t t, float x, float y, float z)
+{
+	recorder_gyro_t rec;
+	rec.x = x;
+	rec.y = y;
+	rec.z = z;
+
+	channel_append(RECORDER_CH_SENSORS, RECORDER_REC_GYRO, t,
+		       &rec, sizeof(rec));
+}
+
+void recorder_log_sonar(int64_t t, int distance_mm)
+{
+	recorder_sonar_t rec;
+	rec.distance_mm = distance_mm;
+
+	channel_append(RECORDER_CH_SENSORS, RECORDER_REC_SONAR, t,
+		       &rec, sizeof(rec));
+}
@@ -0,0 +1,117 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include "common.h"
+#include "cv_imv.h"
+#include "motion.h"
+
+/*
+ * Flight recorder file format (little endian, packed):
+ *
+ *   recorder_file_header_t
+ *   { recorder_chunk_header_t, records... } * chunk count
+ *   recorder_index_header_t, recorder_index_entry_t * chunk count
+ *   recorder_trailer_t
+ *
+ * Every record is a recorder_record_t followed by its payload. Timestamps
+ * are microseconds_monotonic() time. Each chunk comes from one channel and
+ * is time-ordered; chunks of different channels interleave.
+ *
+ * The motion vectors go to a separate file (path + RECORDER_IMV_SUFFIX) in
+ * the memory-mappable imvlog format, see imvlog.h.
+ */
+
+#define RECORDER_MAGIC		"FBREC\0\0\1"
+#define RECORDER_CHUNK_MAGIC	0x4b4e4843 /* "CHNK" */
+#define RECORDER_INDEX_MAGIC	0x58444e49 /* "INDX" */
+#define RECORDER_TRAILER_MAGIC	0x444e4546 /* "FEND" */
+#define RECORDER_VERSION	2
+#define RECORDER_IMV_SUFFIX	".imv"
+
+typedef enum {
+	RECORDER_CH_FRAME = 0, /* Motion, frame thread */
+	RECORDER_CH_SENSORS, /* Gyro and sonar, event loop thread */
+	RECORDER_CH_IMV, /* Vectors, frame thread; written to the imvlog */
+	RECORDER_CH_COUNT
+} recorder_channel_t;
+
+typedef enum {
+	RECORDER_REC_GYRO = 2,
+	RECORDER_REC_SONAR,
+	RECORDER_REC_MOTION
+} recorder_record_type_t;
+
+typedef struct __attribute__((packed)) {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+} recorder_file_header_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint16_t channel;
+	uint16_t reserved;
+	uint32_t size; /* Bytes of records following this header */
+	uint32_t records;
+	int64_t t_first;
+	int64_t t_last;
+} recorder_chunk_header_t;
+
+typedef struct __attribute__((packed)) {
+	uint16_t type;
+	uint16_t reserved;
+	uint32_t size; /* Payload bytes following this header */
+	int64_t t;
+} recorder_record_t;
+
+typedef struct __attribute__((packed)) {
+	float x; /* [deg/s] */
+	float y;
+	float z;
+} recorder_gyro_t;
+
+typedef struct __attribute__((packed)) {
+	int32_t distance_mm;
+} recorder_sonar_t;
+
+typedef struct __attribute__((packed)) {
+	double xform[6]; /* [A|b], row-major; valid == 0 if not estimated */
+	double dx;
+	double dy;
+	int32_t vec_in;
+	int32_t vec_good;
+	uint8_t valid;
+	uint8_t reserved[7];
+} recorder_motion_t;
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint32_t count;
+} recorder_index_header_t;
+
+typedef struct __attribute__((packed)) {
+	uint64_t offset; /* Of the chunk header */
+	uint16_t channel;
+	uint16_t reserved[3];
+	int64_t t_first;
+	int64_t t_last;
+} recorder_index_entry_t;
+
+typedef struct __attribute__((packed)) {
+	uint64_t index_offset;
+	uint32_t magic;
+	uint32_t reserved;
+} recorder_trailer_t;
+
+bool recorder_init(const char *p_path, int mbx, int mby);
+bool recorder_start(void);
+void recorder_stop(void);
+
+/* Never block: when both buffers of a channel are waiting for the SD card,
+   the record is dropped and counted. */
+void recorder_log_imv(cv_imv& imv);
+void recorder_log_motion(int64_t t, motion_t *p_motion);
+void recorder_log_gyro(int64_t t, float x, float y, float z);
+void recorder_log_sonar(int64_t t, int distance_mm);
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef RNG_H
+#define RNG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+/* xoshiro128** (http://prng.di.unimi.it/), seeded by splitmix64 from a
+   (seed, stream) pair so that every worker gets an independent, fully
+   reproducible sequence. Cheap on 32-bit ARM: no divisions, no locks. */
+typedef struct {
+	uint32_t s[4];
+} rng_t;
+
+static inline uint64_t rng_splitmix64(uint64_t *p_x)
+{
+	uint64_t z = (*p_x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static inline void rng_seed(rng_t *p_rng, uint64_t seed, uint64_t stream)
+{
+	uint64_t x = seed ^ rng_splitmix64(&stream);
+	uint64_t a = rng_splitmix64(&x);
+	uint64_t b = rng_splitmix64(&x);
+
+	p_rng->s[0] = (uint32_t)a;
+	p_rng->s[1] = (uint32_t)(a >> 32);
+	p_rng->s[2] = (uint32_t)b;
+	p_rng->s[3] = (uint32_t)(b >> 32);
+
+	/* All-zero state is the only invalid one */
+	if ((a | b) == 0)
+		p_rng->s[0] = 1;
+}
+
+static inline uint32_t rng_rotl(uint32_t x, int k)
+{
+	return (x << k) | (x >> (32 - k));
+}
+
+static inline uint32_t rng_next(rng_t *p_rng)
+{
+	uint32_t *s = p_rng->s;
+	uint32_t result = rng_rotl(s[1] * 5, 7) * 9;
+	uint32_t t = s[1] << 9;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rng_rotl(s[3], 11);
+
+	return result;
+}
+
+/* Uniformly distributed integer in [a, b) (multiply-shift, no modulo) */
+static inline int rng_uniform(rng_t *p_rng, int a, int b)
+{
+	return a + (int)(((uint64_t)rng_next(p_rng) * (uint32_t)(b - a)) >> 32);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
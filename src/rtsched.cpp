@@ -0,0 +1,349 @@
+#include "rtsched.h"
+
+#include <algorithm>
+#include <atomic>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define RTSCHED_MAX_THREADS	64
+#define RTSCHED_STACK_PREFAULT	(64*1024) /* [B] */
+
+typedef struct {
+	const char *p_name;
+	uint32_t cpus; /* Bit mask, 0: all */
+	int policy;
+	int priority; /* sched_priority, or nice for SCHED_OTHER */
+} rtsched_config_t;
+
+typedef struct {
+	pid_t tid;
+	rtsched_role_t role;
+	char name[16];
+} rtsched_thread_t;
+
+static rtsched_config_t m_roles[RTSCHED_ROLE_COUNT] = {
+	{ "frame", 0x0e, SCHED_FIFO, 50 },
+	{ "ransac", 0x0e, SCHED_FIFO, 49 },
+	{ "sensors", 0x01, SCHED_FIFO, 60 }, /* Drains the gyro FIFO */
+	{ "mavlink", 0x01, SCHED_FIFO, 45 },
+	{ "recorder", 0x01, SCHED_OTHER, 10 }
+};
+
+static bool m_enabled;
+
+static rtsched_thread_t m_threads[RTSCHED_MAX_THREADS];
+static std::atomic<int> m_thread_count;
+
+static __thread int m_role = -1;
+
+static pid_t gettid_(void)
+{
+	return syscall(SYS_gettid);
+}
+
+/* Role CPUs that are online; all of them if there are none */
+static void role_cpus(int role, cpu_set_t *p_set)
+{
+	int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t mask = (m_enabled && role >= 0) ? m_roles[role].cpus : 0;
+
+	CPU_ZERO(p_set);
+	for (int i = 0; i < ncpu && i < 32; i++) {
+		if (mask & (1u << i))
+			CPU_SET(i, p_set);
+	}
+
+	if (CPU_COUNT(p_set) == 0) {
+		for (int i = 0; i < ncpu; i++)
+			CPU_SET(i, p_set);
+	}
+}
+
+/* "1-3", "0,2" */
+static bool parse_cpus(const char *p_str, uint32_t *p_mask)
+{
+	*p_mask = 0;
+
+	while (*p_str != '\0') {
+		char *p_end;
+		long a = strtol(p_str, &p_end, 10);
+		long b = a;
+
+		if (p_end == p_str)
+			return false;
+
+		if (*p_end == '-') {
+			p_str = p_end + 1;
+			b = strtol(p_str, &p_end, 10);
+			if (p_end == p_str)
+				return false;
+		}
+
+		if (a < 0 || b > 31 || a > b)
+			return false;
+
+		for (long i = a; i <= b; i++)
+			*p_mask |= 1u << i;
+
+		p_str = p_end;
+		if (*p_str == ',')
+			p_str++;
+	}
+
+	return *p_mask != 0;
+}
+
+bool rtsched_config(const char *p_spec)
+{
+	char role[16], cpus[32], policy[8];
+	int priority;
+
+	if (sscanf(p_spec, "%15[^:]:%31[^:]:%7[^:]:%d", role, cpus, policy,
+		   &priority) != 4) {
+		ERR("rtsched_config(): Expected <role>:<cpus>:<fifo|other>:<priority>, got " << p_spec);
+		return false;
+	}
+
+	for (int i = 0; i < RTSCHED_ROLE_COUNT; i++) {
+		if (strcmp(role, m_roles[i].p_name) != 0)
+			continue;
+
+		uint32_t mask;
+		if (!parse_cpus(cpus, &mask)) {
+			ERR("rtsched_config(): Bad CPU list " << cpus);
+			return false;
+		}
+
+		int min, max;
+		if (strcmp(policy, "fifo") == 0) {
+			m_roles[i].policy = SCHED_FIFO;
+			min = sched_get_priority_min(SCHED_FIFO);
+			max = sched_get_priority_max(SCHED_FIFO);
+		} else if (strcmp(policy, "other") == 0) {
+			m_roles[i].policy = SCHED_OTHER;
+			min = -20;
+			max = 19;
+		} else {
+			ERR("rtsched_config(): Unknown policy " << policy);
+			return false;
+		}
+
+		if (priority < min || priority > max) {
+			ERR("rtsched_config(): Priority " << priority << " not in [" << min << ", " << max << "]");
+			return false;
+		}
+
+		m_roles[i].cpus = mask;
+		m_roles[i].priority = priority;
+		return true;
+	}
+
+	ERR("rtsched_config(): Unknown role " << role);
+	return false;
+}
+
+bool rtsched_init(void)
+{
+	bool ok = true;
+
+	m_enabled = true;
+
+	/* Keep freed heap in the (locked) process instead of returning it */
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		ERR("rtsched_init(): mlockall failed: " << strerror(errno));
+		ok = false;
+	}
+
+	for (int i = 0; i < RTSCHED_ROLE_COUNT; i++) {
+		DBG("rtsched_init(): " << m_roles[i].p_name << ": cpus 0x" << std::hex << m_roles[i].cpus << std::dec << ", " << (m_roles[i].policy == SCHED_FIFO ? "fifo" : "other") << " " << m_roles[i].priority);
+	}
+
+	return ok;
+}
+
+static void __attribute__((noinline)) prefault_stack(void)
+{
+	volatile uint8_t stack[RTSCHED_STACK_PREFAULT];
+
+	for (size_t i = 0; i < sizeof(stack); i += 1024)
+		stack[i] = 0;
+}
+
+static bool apply_role(int role)
+{
+	const rtsched_config_t *p_config = &m_roles[role];
+	bool ok = true;
+	cpu_set_t set;
+
+	role_cpus(role, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+		ERR("rtsched: Unable to set CPUs of " << p_config->p_name);
+		ok = false;
+	}
+
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+
+	if (p_config->policy == SCHED_FIFO)
+		param.sched_priority = p_config->priority;
+
+	int rc = pthread_setschedparam(pthread_self(), p_config->policy, &param);
+	if (rc != 0) {
+		ERR("rtsched: Unable to set policy of " << p_config->p_name << ": " << strerror(rc));
+		ok = false;
+	}
+
+	if (p_config->policy == SCHED_OTHER &&
+	    setpriority(PRIO_PROCESS, gettid_(), p_config->priority) != 0) {
+		ERR("rtsched: Unable to set nice value of " << p_config->p_name);
+		ok = false;
+	}
+
+	return ok;
+}
+
+void rtsched_thread(rtsched_role_t role, const char *p_name)
+{
+	if (m_role >= 0)
+		return;
+
+	m_role = role;
+
+	if (m_enabled) {
+		apply_role(role);
+		prefault_stack();
+	}
+
+	char name[16];
+	snprintf(name, sizeof(name), "%s", p_name);
+	pthread_setname_np(pthread_self(), name);
+
+	int i = m_thread_count.fetch_add(1);
+	if (i >= RTSCHED_MAX_THREADS) {
+		m_thread_count--;
+		return;
+	}
+
+	m_threads[i].tid = gettid_();
+	m_threads[i].role = role;
+	memcpy(m_threads[i].name, name, sizeof(name));
+}
+
+void rtsched_pin(int index)
+{
+	cpu_set_t set, pin;
+
+	role_cpus(m_role, &set);
+
+	int n = CPU_COUNT(&set);
+	int k = index % n;
+
+	CPU_ZERO(&pin);
+	for (int i = 0; i < CPU_SETSIZE; i++) {
+		if (CPU_ISSET(i, &set) && k-- == 0) {
+			CPU_SET(i, &pin);
+			break;
+		}
+	}
+
+	int rc = pthread_setaffinity_np(pthread_self(), sizeof(pin), &pin);
+	if (rc != 0)
+		ERR("rtsched_pin(): Unable to pin thread: " << strerror(rc));
+}
+
+/* Fields of /proc/self/task/<tid>/schedstat: time on the CPU, time waiting
+   on a run queue [ns] and number of time slices */
+static bool read_schedstat(pid_t tid, uint64_t *p_wait_ns, uint64_t *p_slices)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", tid);
+
+	FILE *p_file = fopen(path, "r");
+	if (p_file == NULL)
+		return false;
+
+	unsigned long long run, wait, slices;
+	bool ok = (fscanf(p_file, "%llu %llu %llu", &run, &wait, &slices) == 3);
+	fclose(p_file);
+
+	*p_wait_ns = wait;
+	*p_slices = slices;
+
+	return ok;
+}
+
+static void read_ctxt_switches(pid_t tid, long *p_voluntary, long *p_involuntary)
+{
+	char path[64], line[128];
+	snprintf(path, sizeof(path), "/proc/self/task/%d/status", tid);
+
+	*p_voluntary = -1;
+	*p_involuntary = -1;
+
+	FILE *p_file = fopen(path, "r");
+	if (p_file == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), p_file) != NULL) {
+		sscanf(line, "voluntary_ctxt_switches: %ld", p_voluntary);
+		sscanf(line, "nonvoluntary_ctxt_switches: %ld", p_involuntary);
+	}
+
+	fclose(p_file);
+}
+
+void rtsched_dump(FILE *p_file)
+{
+	int count = std::min((int)m_thread_count, RTSCHED_MAX_THREADS);
+
+	fprintf(p_file, "%-16s %-9s %6s %-6s %4s %-8s %10s %12s %9s %9s\n",
+		"thread", "role", "tid", "policy", "prio", "cpus", "wait [ms]",
+		"wait/sl [us]", "vol. cs", "preempted");
+
+	for (int i = 0; i < count; i++) {
+		const rtsched_thread_t *p_thread = &m_threads[i];
+		pid_t tid = p_thread->tid;
+
+		/* Gone threads have no /proc entry left */
+		uint64_t wait_ns, slices;
+		if (!read_schedstat(tid, &wait_ns, &slices))
+			continue;
+
+		long voluntary, involuntary;
+		read_ctxt_switches(tid, &voluntary, &involuntary);
+
+		int policy = sched_getscheduler(tid);
+		struct sched_param param;
+		int prio = (sched_getparam(tid, &param) == 0) ? param.sched_priority : -1;
+		if (policy == SCHED_OTHER)
+			prio = getpriority(PRIO_PROCESS, tid);
+
+		char cpus[64] = "";
+		cpu_set_t set;
+		if (sched_getaffinity(tid, sizeof(set), &set) == 0) {
+			size_t len = 0;
+			for (int c = 0; c < CPU_SETSIZE && len < sizeof(cpus) - 4; c++) {
+				if (CPU_ISSET(c, &set))
+					len += snprintf(cpus + len, sizeof(cpus) - len,
+							"%s%d", len > 0 ? "," : "", c);
+			}
+		}
+
+		fprintf(p_file, "%-16s %-9s %6d %-6s %4d %-8s %10.1f %12.1f %9ld %9ld\n",
+			p_thread->name, m_roles[p_thread->role].p_name, tid,
+			policy == SCHED_FIFO ? "fifo" : policy == SCHED_RR ? "rr" : "other",
+			prio, cpus, wait_ns / 1e6,
+			slices > 0 ? wait_ns / 1e3 / slices : 0.0,
+			voluntary, involuntary);
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef RTSCHED_H
+#define RTSCHED_H
+
+#include "common.h"
+#include <stdio.h>
+
+/*
+ * Thread placement by role: every thread of the pipeline registers with its
+ * role, which gives it a CPU set, a scheduling policy (SCHED_FIFO or
+ * SCHED_OTHER) and a priority (nice value for SCHED_OTHER). Defaults keep the
+ * frame path on cores 1-3 and everything else on core 0 with the MMAL
+ * callbacks. Nothing is changed until rtsched_init(), which also locks the
+ * process memory (needs root or CAP_SYS_NICE and CAP_IPC_LOCK).
+ */
+
+typedef enum {
+	RTSCHED_ROLE_FRAME = 0, /* Process thread, pipeline stages */
+	RTSCHED_ROLE_RANSAC, /* OpenCV workers of the estimator */
+	RTSCHED_ROLE_SENSORS, /* Event loop: gyro, sonar, heartbeat */
+	RTSCHED_ROLE_MAVLINK,
+	RTSCHED_ROLE_RECORDER,
+	RTSCHED_ROLE_COUNT
+} rtsched_role_t;
+
+/* Overrides a role, "<role>:<cpus>:<fifo|other>:<priority>", e.g.
+   "frame:1-3:fifo:50" or "recorder:0:other:10" */
+bool rtsched_config(const char *p_spec);
+
+/* Applies the roles from now on and locks all current and future memory.
+   Call before the threads are started. False if something could not be
+   applied (the rest still is). */
+bool rtsched_init(void);
+
+/* Applies the role to the calling thread, names it and prefaults its stack.
+   The first role of a thread sticks: later calls (e.g. from a parallel loop
+   that also runs on the caller) do nothing. */
+void rtsched_thread(rtsched_role_t role, const char *p_name);
+
+/* Narrows the calling thread to the index-th CPU of its role (of all CPUs
+   before rtsched_init()), wrapping around */
+void rtsched_pin(int index);
+
+/* Placement, run-queue wait (scheduling latency) and context switches of
+   every registered thread */
+void rtsched_dump(FILE *p_file);
+
+#endif
@@ -1,115 +1,158 @@
 #include "sensors.h"
 #include <unistd.h>
-#include <pthread.h>
+#include <atomic>
+#include "evloop.h"
+#include "recorder.h"
 #include "l3gd20h.h"
+#include "l3gd20h_sim.h"
+#include "seqlock.h"
 #include "sonar.h"
+#include "sonar_sim.h"
+#include "trace.h"
 
 #define I2C_BUS_PATH		"/dev/i2c-1"
 
 #define GYRO_DEFAULT_I2C_ADDRESS	0x6b
 #define GYRO_CALIB_PATH			"gyro_calib.txt"
-#define GYRO_READOUT_PERIOD_MS		10
+#define GYRO_READOUT_PERIOD_MS		10 /* FIFO drain period */
+#define GYRO_TEMPERATURE_PERIOD		100 /* Drains between temperature reads */
+#define GYRO_RING_SIZE			1024 /* Samples, must be a power of two */
 
 #define SONAR_PORT_PATH			"/dev/ttyAMA0"
-#define SONAR_READOUT_PERIOD_MS		100
+#define SONAR_SIM_RATE_HZ		10 /* HRLV-EZ4 free-running rate */
 
 using namespace cv;
 using namespace std;
 
 static bool m_initialized;
 
-static struct {
-	pthread_t thread;
-	pthread_mutex_t mutex;
-	bool run;
+typedef struct {
+	double x; /* Newest rate [deg/s] */
+	double y;
+	double z;
+	int temperature;
+	int overruns; /* Since start */
+} gyro_state_t;
 
+static struct {
 	l3gd20h_data_t calib;
 
-	struct {
-		double x;
-		double y;
-		double z;
-		int temperature;
-		int overruns;
-	} acc_angle;
+	int64_t period; /* ODR period [us] */
+	int64_t t_next; /* Expected timestamp of the next FIFO sample */
+	int temperature_cnt;
+	gyro_state_t writer_state;
+
+	seqlock<gyro_state_t> state;
 } m_gyro;
 
+typedef struct {
+	int64_t t; /* [us], microseconds_monotonic() */
+	float x; /* [deg/s] */
+	float y; /* [deg/s] */
+	float z; /* [deg/s] */
+} gyro_sample_t;
+
+/* Single-producer ring of every gyro sample. The writer never waits; a
+   reader validates after copying that the writer has not lapped it. */
 static struct {
-	pthread_t thread;
-	pthread_mutex_t mutex;
-	bool run;
+	gyro_sample_t samples[GYRO_RING_SIZE];
+	std::atomic<uint32_t> head; /* Total number of samples written */
+} m_gyro_ring;
 
-	int distance_mm;
+static struct {
+	seqlock<int> distance_mm;
 } m_sonar;
 
 static bool m_enable_sonar;
+static bool m_simulate;
+static sensors_gyro_cb_t m_gyro_cb;
+static void *m_gyro_cb_arg;
 
-static void *gyro_thread(void *ptr)
+static void gyro_ring_push(int64_t t, l3gd20h_data_t *p_data)
 {
-	suseconds_t t1, t2;
-	l3gd20h_data_t gyro_data;
+	uint32_t head = m_gyro_ring.head.load(std::memory_order_relaxed);
+	gyro_sample_t *p_sample = &m_gyro_ring.samples[head & (GYRO_RING_SIZE-1)];
 
-	memset(&gyro_data, 0, sizeof(gyro_data));
+	p_sample->t = t;
+	p_sample->x = p_data->rate_x;
+	p_sample->y = p_data->rate_y;
+	p_sample->z = p_data->rate_z;
 
-	t2 = microseconds();
+	m_gyro_ring.head.store(head+1, std::memory_order_release);
 
-	while (m_gyro.run) {
-		t1 = microseconds();
+	recorder_log_gyro(t, p_data->rate_x, p_data->rate_y, p_data->rate_z);
+}
 
-		if (!l3gd20h_read(&gyro_data, true)) {
-			fprintf(stderr, "[sensors] Can't read gyro!\n");
-			memset(&gyro_data, 0, sizeof(gyro_data));
-		}
+/* Runs on the event loop every GYRO_READOUT_PERIOD_MS */
+static void gyro_handler(void *ptr)
+{
+	TRACE_SCOPE("gyro readout");
+	int64_t t_read;
+	l3gd20h_data_t gyro_data[L3GD20H_FIFO_SIZE];
+	int count;
+	gyro_state_t *p_state = &m_gyro.writer_state;
 
-		gyro_data.rate_x -= m_gyro.calib.rate_x;
-		gyro_data.rate_y -= m_gyro.calib.rate_y;
-		gyro_data.rate_z -= m_gyro.calib.rate_z;
+	t_read = microseconds_monotonic();
 
-		pthread_mutex_lock(&m_gyro.mutex);
+	if (!l3gd20h_fifo_read(gyro_data, L3GD20H_FIFO_SIZE, &count)) {
+		fprintf(stderr, "[sensors] Can't read gyro!\n");
+		count = 0;
+	}
 
-		m_gyro.acc_angle.x = gyro_data.rate_x;
-		m_gyro.acc_angle.y = gyro_data.rate_y;
-		m_gyro.acc_angle.z = gyro_data.rate_z;
-		m_gyro.acc_angle.temperature = gyro_data.temperature;
+	if (m_gyro.temperature_cnt-- <= 0) {
+		int8_t temperature;
+		if (l3gd20h_read_temperature(&temperature))
+			p_state->temperature = temperature;
+		m_gyro.temperature_cnt = GYRO_TEMPERATURE_PERIOD;
+	}
 
-		if (gyro_data.overrun)
-			m_gyro.acc_angle.overruns++;
+	if (count == 0)
+		return;
 
-		pthread_mutex_unlock(&m_gyro.mutex);
+	/* The newest sample was latched within the last ODR period. Stay on
+	   the ODR grid unless it drifts away from that by more than a period
+	   (overrun, clock mismatch). */
+	int64_t period = m_gyro.period;
+	int64_t t_newest = t_read - period/2;
+	int64_t t_first = m_gyro.t_next;
 
-		t2 = microseconds();
+	if (m_gyro.t_next == 0 || gyro_data[0].overrun ||
+	    llabs(t_first + (count-1)*period - t_newest) > period)
+		t_first = t_newest - (count-1)*period;
 
-		if ((t2-t1) < (GYRO_READOUT_PERIOD_MS*1000UL))
-			usleep(GYRO_READOUT_PERIOD_MS*1000UL - (t2-t1));
-		else
-			usleep(100);
+	for (int i = 0; i < count; i++) {
+		gyro_data[i].rate_x -= m_gyro.calib.rate_x;
+		gyro_data[i].rate_y -= m_gyro.calib.rate_y;
+		gyro_data[i].rate_z -= m_gyro.calib.rate_z;
+
+		gyro_ring_push(t_first + i*period, &gyro_data[i]);
 	}
 
-	l3gd20h_close();
+	m_gyro.t_next = t_first + count*period;
+
+	p_state->x = gyro_data[count-1].rate_x;
+	p_state->y = gyro_data[count-1].rate_y;
+	p_state->z = gyro_data[count-1].rate_z;
+
+	if (gyro_data[0].overrun)
+		p_state->overruns++;
+
+	m_gyro.state.write(*p_state);
+
+	if (m_gyro_cb != NULL)
+		m_gyro_cb(m_gyro.t_next - period, m_gyro_cb_arg);
 }
 
-static void *sonar_thread(void *ptr)
+/* Runs on the event loop whenever the sonar port is readable */
+static void sonar_handler(void *ptr)
 {
-	suseconds_t t1, t2;
+	TRACE_SCOPE("sonar");
 	int dist;
 
-	while (m_sonar.run) {
-		t1 = microseconds();
-
-		if (sonar_read(&dist)) {
-			pthread_mutex_lock(&m_sonar.mutex);
-			m_sonar.distance_mm = dist;
-			pthread_mutex_unlock(&m_sonar.mutex);
-
-			t2 = microseconds();
-			if ((t2-t1) < (SONAR_READOUT_PERIOD_MS*1000UL))
-				usleep(SONAR_READOUT_PERIOD_MS*1000UL - (t2-t1));
-			else
-				usleep(100);
-		}
+	while (sonar_read(&dist)) {
+		m_sonar.distance_mm.write(dist);
+		recorder_log_sonar(microseconds_monotonic(), dist);
 	}
-
-	sonar_close();
 }
 
 static bool gyro_load_calibration(char *p_filename, l3gd20h_data_t *p_calib)
@@ -160,28 +203,49 @@ static bool gyro_load_calibration(char *p_filename, l3gd20h_data_t *p_calib)
 	return true;
 }
 
-bool sensors_init(bool enable_sonar)
+bool sensors_init(bool enable_sonar, bool simulate)
 {
 	DBG("sensors_init()");
 	char *i2c_path = (char *)I2C_BUS_PATH;
 	char *sonar_path = (char *)SONAR_PORT_PATH;
+	char sim_path[64];
 
 	m_enable_sonar = enable_sonar;
+	m_simulate = simulate;
 
 	l3gd20h_init_t gyro_init;
 	memset(&gyro_init, 0, sizeof(gyro_init));
 
 	gyro_init.range = L3GD20H_RANGE_245_DPS;
-	gyro_init.data_rate = L3GD20H_DATA_RATE_100HZ_CUTOFF_25HZ;
+	gyro_init.data_rate = L3GD20H_DATA_RATE_400HZ_CUTOFF_50HZ;
 	gyro_init.enable_highpass = false;
 	gyro_init.enable_lowpass = true;
 
-	if (!l3gd20h_init(i2c_path, GYRO_DEFAULT_I2C_ADDRESS, &gyro_init)) {
+	if (m_simulate) {
+		if (!l3gd20h_init_bus(l3gd20h_sim_bus(), &gyro_init)) {
+			fprintf(stderr, "[sensors] Can't init simulated gyro.\n");
+			return false;
+		}
+	} else if (!l3gd20h_init(i2c_path, GYRO_DEFAULT_I2C_ADDRESS, &gyro_init)) {
 		fprintf(stderr, "[sensors] Can't open gyro addr 0x%02x or bus %s.\n",
 			GYRO_DEFAULT_I2C_ADDRESS, i2c_path);
 		return false;
 	}
 
+	if (!l3gd20h_fifo_init()) {
+		fprintf(stderr, "[sensors] Can't enable gyro FIFO.\n");
+		return false;
+	}
+
+	if (m_enable_sonar && m_simulate) {
+		if (!sonar_sim_start(SONAR_SIM_RATE_HZ, sim_path, sizeof(sim_path))) {
+			fprintf(stderr, "[sensors] Can't start simulated sonar.\n");
+			return false;
+		}
+
+		sonar_path = sim_path;
+	}
+
 	if (m_enable_sonar) {
 		if (!sonar_init(sonar_path)) {
 			fprintf(stderr, "[sensors] Can't open sonar port %s.\n",
@@ -191,8 +255,13 @@ bool sensors_init(bool enable_sonar)
 	}
 
 	if (!gyro_load_calibration((char*)GYRO_CALIB_PATH, &m_gyro.calib)) {
-		fprintf(stderr, "[sensors] Can't load gyro calibration!\n");
-		return false;
+		/* The simulated gyro has no bias */
+		if (m_simulate) {
+			memset(&m_gyro.calib, 0, sizeof(m_gyro.calib));
+		} else {
+			fprintf(stderr, "[sensors] Can't load gyro calibration!\n");
+			return false;
+		}
 	}
 
 	m_initialized = true;
@@ -200,6 +269,12 @@ bool sensors_init(bool enable_sonar)
 	return true;
 }
 
+void sensors_gyro_hook(sensors_gyro_cb_t cb, void *p_arg)
+{
+	m_gyro_cb = cb;
+	m_gyro_cb_arg = p_arg;
+}
+
 bool sensors_start(void)
 {
 	if (!m_initialized)
@@ -207,22 +282,19 @@ bool sensors_start(void)
 
 	DBG("sensors_start()");
 
-	m_gyro.run = true;
-	m_sonar.run = true;
-
-	pthread_mutex_init(&m_gyro.mutex, NULL);
-	pthread_mutex_init(&m_sonar.mutex, NULL);
+	m_gyro.period = (int64_t)(1000000.0f / l3gd20h_data_rate_hz());
+	m_gyro.t_next = 0;
+	m_gyro.temperature_cnt = 0;
+	memset(&m_gyro.writer_state, 0, sizeof(m_gyro.writer_state));
 
-	int rc = pthread_create(&m_gyro.thread, NULL, gyro_thread, NULL);
-	if (rc) {
-		ERR("Unable to create gyro thread: " << rc);
+	if (!evloop_add_timer(GYRO_READOUT_PERIOD_MS*1000UL, gyro_handler, NULL)) {
+		ERR("Unable to register gyro timer");
 		return false;
 	}
 
 	if (m_enable_sonar) {
-		rc = pthread_create(&m_sonar.thread, NULL, sonar_thread, NULL);
-		if (rc) {
-			ERR("Unable to create sonar thread: " << rc);
+		if (!evloop_add_fd(sonar_get_fd(), sonar_handler, NULL)) {
+			ERR("Unable to register sonar port");
 			return false;
 		}
 	}
@@ -234,30 +306,23 @@ void sensors_read(sensors_data_t *p_data)
 {
 	DBG("sensors_read():");
 
-	pthread_mutex_lock(&m_gyro.mutex);
-
-	DBG("gyro: " << m_gyro.acc_angle.x << ", " << m_gyro.acc_angle.y << ", "
-	    << m_gyro.acc_angle.z << " (" << m_gyro.acc_angle.temperature
-	    << " deg C, " << m_gyro.acc_angle.overruns << " overruns)");
-
-	p_data->gyro.x = m_gyro.acc_angle.x;
-	p_data->gyro.y = m_gyro.acc_angle.y;
-	p_data->gyro.z = m_gyro.acc_angle.z;
-	p_data->gyro.temperature = m_gyro.acc_angle.temperature;
+	gyro_state_t gyro = m_gyro.state.read();
 
-	m_gyro.acc_angle.overruns = 0;
-	//memset(&m_gyro.acc_angle, 0, sizeof(m_gyro.acc_angle));
+	DBG("gyro: " << gyro.x << ", " << gyro.y << ", " << gyro.z << " ("
+	    << gyro.temperature << " deg C, " << gyro.overruns << " overruns)");
 
-	pthread_mutex_unlock(&m_gyro.mutex);
+	p_data->gyro.x = gyro.x;
+	p_data->gyro.y = gyro.y;
+	p_data->gyro.z = gyro.z;
+	p_data->gyro.temperature = gyro.temperature;
+	p_data->gyro.overruns = gyro.overruns;
 
-	pthread_mutex_lock(&m_sonar.mutex);
+	p_data->sonar.distance_mm = m_sonar.distance_mm.read();
 
-	DBG("sonar: " << m_sonar.distance_mm << " mm");
-	p_data->sonar.distance_mm = m_sonar.distance_mm;
-
-	pthread_mutex_unlock(&m_sonar.mutex);	
+	DBG("sonar: " << p_data->sonar.distance_mm << " mm");
 }
 
+/* Must be called after evloop_stop() */
 void sensors_stop(void)
 {
 	if (!m_initialized)
@@ -265,38 +330,119 @@ void sensors_stop(void)
 
 	DBG("sensors_stop()");
 
-	m_gyro.run = false;
-	m_sonar.run = false;
+	l3gd20h_close();
+
+	if (m_enable_sonar)
+		sonar_close();
 
-	//pthread_destroy(&m_gyro.thread);
-	//pthread_destroy(&m_sonar.thread);
-	pthread_mutex_destroy(&m_gyro.mutex);
-	pthread_mutex_destroy(&m_sonar.mutex);
+	if (m_enable_sonar && m_simulate)
+		sonar_sim_stop();
+
+	m_initialized = false;
 }
 
-void sensors_compensate(vector<Point2f>& pts_src, vector<Point2f>& pts_dst)
+static inline double gyro_lerp(const gyro_sample_t *p_a, const gyro_sample_t *p_b,
+				float gyro_sample_t::*axis, int64_t t)
 {
-	suseconds_t t1, t2;
-	static suseconds_t prev_t;
+	if (p_b->t == p_a->t)
+		return p_b->*axis;
 
-	t1 = microseconds();
+	return p_a->*axis + (p_b->*axis - p_a->*axis) *
+	       (double)(t - p_a->t) / (double)(p_b->t - p_a->t);
+}
+
+/* Integral of the piecewise linear rate between two samples, clipped to
+   [t0, t1] [deg*us]: */
+static inline double gyro_segment(const gyro_sample_t *p_a, const gyro_sample_t *p_b,
+				  float gyro_sample_t::*axis, int64_t t0, int64_t t1)
+{
+	int64_t a = max(p_a->t, t0);
+	int64_t b = min(p_b->t, t1);
+
+	if (b <= a)
+		return 0;
+
+	return 0.5 * (gyro_lerp(p_a, p_b, axis, a) + gyro_lerp(p_a, p_b, axis, b)) * (b - a);
+}
+
+bool sensors_gyro_integrate(int64_t t0, int64_t t1, double *p_x, double *p_y, double *p_z)
+{
+	*p_x = 0;
+	*p_y = 0;
+	*p_z = 0;
 
-	double corr_x = 0;
-	double corr_y = 0;
+	if (t1 <= t0)
+		return false;
+
+	uint32_t head = m_gyro_ring.head.load(std::memory_order_acquire);
+	if (head == 0)
+		return false;
+
+	uint32_t oldest = (head > GYRO_RING_SIZE-1) ? head - (GYRO_RING_SIZE-1) : 0;
+	const uint32_t mask = GYRO_RING_SIZE-1;
+	const gyro_sample_t *s = m_gyro_ring.samples;
+
+	/* Walk back to the last sample taken at or before t0: */
+	uint32_t first = head-1;
+	while (first > oldest && s[first & mask].t > t0)
+		first--;
+
+	double ax = 0;
+	double ay = 0;
+	double az = 0;
+
+	/* Hold the oldest rate before the first sample (should not happen
+	   unless the ring is too short or the gyro has just started): */
+	gyro_sample_t a = s[first & mask];
+	if (t0 < a.t) {
+		int64_t b = min(a.t, t1);
+		ax += a.x * (b - t0);
+		ay += a.y * (b - t0);
+		az += a.z * (b - t0);
+	}
 
-	if (prev_t != 0) {
-		double dt = (t1-prev_t)/1000000.0;
+	for (uint32_t i = first+1; i < head; i++) {
+		gyro_sample_t b = s[i & mask];
+		if (a.t >= t1)
+			break;
 
-		pthread_mutex_lock(&m_gyro.mutex);
-		double omega_x = M_PI * m_gyro.acc_angle.x / 180.0;
-		double omega_y = M_PI * m_gyro.acc_angle.y / 180.0;
-		pthread_mutex_unlock(&m_gyro.mutex);
+		ax += gyro_segment(&a, &b, &gyro_sample_t::x, t0, t1);
+		ay += gyro_segment(&a, &b, &gyro_sample_t::y, t0, t1);
+		az += gyro_segment(&a, &b, &gyro_sample_t::z, t0, t1);
+		a = b;
+	}
 
-		/* f / (b*s) = 531.9335 */
-		corr_x = 531.9335 * tan(omega_x * dt);
-		corr_y = 531.9335 * tan(omega_y * dt);
+	/* Hold the newest rate until t1 (the next sample is not in yet): */
+	if (a.t < t1) {
+		int64_t b = max(a.t, t0);
+		ax += a.x * (t1 - b);
+		ay += a.y * (t1 - b);
+		az += a.z * (t1 - b);
 	}
 
+	/* Discard the result if the writer overwrote what we have just read */
+	std::atomic_thread_fence(std::memory_order_acquire);
+	uint32_t head_after = m_gyro_ring.head.load(std::memory_order_relaxed);
+	if (head_after - first >= GYRO_RING_SIZE)
+		return false;
+
+	*p_x = ax / 1000000.0;
+	*p_y = ay / 1000000.0;
+	*p_z = az / 1000000.0;
+
+	return true;
+}
+
+void sensors_compensate(vector<Point2f>& pts_src, double angle_x, double angle_y)
+{
+	suseconds_t t1, t2;
+
+	t1 = microseconds();
+
+	/* f / (b*s) = 531.9335 */
+	double corr_x = 531.9335 * tan(M_PI * angle_x / 180.0);
+	double corr_y = 531.9335 * tan(M_PI * angle_y / 180.0);
+
 	int count = pts_src.size(); /* TODO: Use an iterator */
 	for(int i = 0; i < count; i++) {
 		pts_src[i].x -= corr_x;
@@ -304,7 +450,6 @@ void sensors_compensate(vector<Point2f>& pts_src, vector<Point2f>& pts_dst)
 	}
 
 	t2 = microseconds();
-	prev_t = t1;
 
-	DBG("sensors_compensate(): [" << corr_x << ", " << corr_y << "], " << (t2-t2) << " us");
+	DBG("sensors_compensate(): [" << corr_x << ", " << corr_y << "], " << (t2-t1) << " us");
 }
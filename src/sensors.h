@@ -11,17 +11,32 @@ typedef struct sensors_data {
 		double y;
 		double z;
 		int temperature;
+		int overruns; /* Since start */
 	} gyro;
 	struct {
 		int distance_mm;
 	} sonar;
 } sensors_data_t;
 
-bool sensors_init(bool enable_sonar);
-bool sensors_start(void);
+/* With simulate, the gyro and sonar are replaced by l3gd20h_sim and
+   sonar_sim (no hardware needed) */
+bool sensors_init(bool enable_sonar, bool simulate);
+bool sensors_start(void); /* Registers the sensors with the event loop */
+
+/* Called on the event loop after every gyro readout with the time of the
+   newest sample [us]; before sensors_start() */
+typedef void (*sensors_gyro_cb_t)(int64_t t, void *p_arg);
+void sensors_gyro_hook(sensors_gyro_cb_t cb, void *p_arg);
+/* Wait-free snapshot of the newest sensor data (safe to call from the
+   frame thread) */
 void sensors_read(sensors_data_t *p_data);
 void sensors_stop(void);
 
-void sensors_compensate(std::vector<cv::Point2f>& pts_src, std::vector<cv::Point2f>& pts_dst);
+/* Integrates the gyro rate over [t0, t1] (microseconds_monotonic() time)
+   and returns the rotation in degrees. */
+bool sensors_gyro_integrate(int64_t t0, int64_t t1, double *p_x, double *p_y, double *p_z);
+
+/* Removes the image shift caused by the rotation [deg] between two frames */
+void sensors_compensate(std::vector<cv::Point2f>& pts_src, double angle_x, double angle_y);
 
 #endif
@@ -0,0 +1,52 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <atomic>
+#include <string.h>
+#include <stdint.h>
+
+/* Single-writer sequence lock for small POD snapshots. The writer never
+   waits; readers retry only if a write overlapped their copy, so neither
+   side makes a syscall or can be blocked by a preempted peer. */
+template <typename T>
+class seqlock
+{
+public:
+	seqlock() : m_seq(0)
+	{
+		memset(&m_data, 0, sizeof(m_data));
+	}
+
+	void write(const T& data)
+	{
+		uint32_t seq = m_seq.load(std::memory_order_relaxed);
+
+		m_seq.store(seq+1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		memcpy(&m_data, &data, sizeof(T));
+
+		m_seq.store(seq+2, std::memory_order_release);
+	}
+
+	T read() const
+	{
+		T data;
+		uint32_t seq1, seq2;
+
+		do {
+			seq1 = m_seq.load(std::memory_order_acquire);
+			memcpy(&data, &m_data, sizeof(T));
+			std::atomic_thread_fence(std::memory_order_acquire);
+			seq2 = m_seq.load(std::memory_order_relaxed);
+		} while ((seq1 & 1) != 0 || seq1 != seq2);
+
+		return data;
+	}
+
+private:
+	std::atomic<uint32_t> m_seq;
+	T m_data;
+};
+
+#endif
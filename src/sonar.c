@@ -6,6 +6,8 @@
 #include <unistd.h>
 
 static char m_buffer[16];
+static int m_buffer_len;
+static int m_buffer_pos;
 static int m_fd;
 static bool m_initialized;
 
@@ -18,7 +20,9 @@ bool sonar_init(char *p_path)
 		return false;
 	}
 
-	fcntl(m_fd, F_SETFL, 0);
+	/* Keep the port non-blocking: sonar_read() is driven by readiness
+	   notification (see sonar_get_fd()) */
+	fcntl(m_fd, F_SETFL, O_NONBLOCK);
 
 	struct termios options;
 	tcgetattr(m_fd, &options);
@@ -31,19 +35,26 @@ bool sonar_init(char *p_path)
 	options.c_cflag &= ~(CSIZE | PARENB);
 	options.c_cflag |= CS8;
 
-	options.c_cc[VMIN] = 1; /* minimum bytes to return from read() */
-	options.c_cc[VTIME] = 10; /* inter-character timer */
+	options.c_cc[VMIN] = 0; /* return whatever is available */
+	options.c_cc[VTIME] = 0;
 
 	cfsetispeed(&options, B9600);
 	cfsetospeed(&options, B9600);
 
 	tcsetattr(m_fd, TCSANOW, &options);
 
+	m_buffer_len = 0;
+	m_buffer_pos = 0;
 	m_initialized = true;
 
 	return true;
 }
 
+int sonar_get_fd(void)
+{
+	return m_initialized ? m_fd : -1;
+}
+
 bool sonar_read(int *p_distance_mm)
 {
 	if (!m_initialized)
@@ -53,8 +64,18 @@ bool sonar_read(int *p_distance_mm)
 	static int numlen;
 	static bool save_num;
 
-	int nread = read(m_fd, m_buffer, sizeof(m_buffer));
-	for (int i = 0; i < nread; i++) {
+	/* Parsing resumes where the previous call returned a reading */
+	if (m_buffer_pos == m_buffer_len) {
+		m_buffer_len = read(m_fd, m_buffer, sizeof(m_buffer));
+		m_buffer_pos = 0;
+
+		if (m_buffer_len < 0)
+			m_buffer_len = 0;
+	}
+
+	while (m_buffer_pos < m_buffer_len) {
+		int i = m_buffer_pos++;
+
 		switch (m_buffer[i]) {
 		case 'R':
 			save_num = true;
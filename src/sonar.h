@@ -9,7 +9,9 @@ extern "C" {
 #include <stdint.h>
 
 bool sonar_init(char *p_path);
+/* Non-blocking: returns true each time a complete reading was parsed */
 bool sonar_read(int *p_distance_mm);
+int sonar_get_fd(void);
 bool sonar_close(void);
 
 #ifdef __cplusplus
@@ -0,0 +1,114 @@
+#define _GNU_SOURCE /* posix_openpt(), ptsname(), cfmakeraw() */
+
+#include "sonar_sim.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SONAR_SIM_MIN_MM	300
+#define SONAR_SIM_MAX_MM	5000
+
+static int m_master_fd = -1;
+static pthread_t m_thread;
+static volatile bool m_run;
+static volatile int m_distance_mm = 1000;
+static long m_period_ns;
+
+static void *sonar_sim_thread(void *ptr)
+{
+	struct timespec next;
+	char frame[8];
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (m_run) {
+		int dist = m_distance_mm;
+
+		/* The sensor clamps its output to the measurable range */
+		if (dist < SONAR_SIM_MIN_MM)
+			dist = SONAR_SIM_MIN_MM;
+		else if (dist > SONAR_SIM_MAX_MM)
+			dist = SONAR_SIM_MAX_MM;
+
+		int len = snprintf(frame, sizeof(frame), "R%04d\r", dist);
+		if (write(m_master_fd, frame, len) != len)
+			fprintf(stderr, "[sonar_sim] Write failed.\n");
+
+		next.tv_nsec += m_period_ns;
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	return NULL;
+}
+
+bool sonar_sim_start(int rate_hz, char *p_path, size_t path_len)
+{
+	if (rate_hz <= 0)
+		return false;
+
+	m_master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (m_master_fd == -1) {
+		fprintf(stderr, "[sonar_sim] Can't open pseudo-terminal.\n");
+		return false;
+	}
+
+	if (grantpt(m_master_fd) == -1 || unlockpt(m_master_fd) == -1) {
+		fprintf(stderr, "[sonar_sim] Can't unlock pseudo-terminal.\n");
+		close(m_master_fd);
+		return false;
+	}
+
+	/* No echo or CR translation on the line */
+	struct termios options;
+	tcgetattr(m_master_fd, &options);
+	cfmakeraw(&options);
+	tcsetattr(m_master_fd, TCSANOW, &options);
+
+	const char *p_name = ptsname(m_master_fd);
+	if (p_name == NULL || strlen(p_name) >= path_len) {
+		close(m_master_fd);
+		return false;
+	}
+
+	strcpy(p_path, p_name);
+
+	m_period_ns = 1000000000L / rate_hz;
+	m_run = true;
+
+	int rc = pthread_create(&m_thread, NULL, sonar_sim_thread, NULL);
+	if (rc) {
+		fprintf(stderr, "[sonar_sim] Unable to create thread: %d\n", rc);
+		m_run = false;
+		close(m_master_fd);
+		return false;
+	}
+
+	return true;
+}
+
+void sonar_sim_set_distance(int distance_mm)
+{
+	m_distance_mm = distance_mm;
+}
+
+void sonar_sim_stop(void)
+{
+	if (!m_run)
+		return;
+
+	m_run = false;
+	pthread_join(m_thread, NULL);
+	close(m_master_fd);
+	m_master_fd = -1;
+}
@@ -0,0 +1,22 @@
+#ifndef SONAR_SIM_H
+#define SONAR_SIM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* HRLV-EZ4 stand-in: a pseudo-terminal whose master side emits "Rxxxx\r"
+   frames at rate_hz from its own thread. The slave path (returned in
+   p_path) can be passed to sonar_init(). */
+bool sonar_sim_start(int rate_hz, char *p_path, size_t path_len);
+void sonar_sim_set_distance(int distance_mm);
+void sonar_sim_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
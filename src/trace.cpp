@@ -0,0 +1,171 @@
+#include "trace.h"
+
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define TRACE_BUFFER_EVENTS	16384 /* Per thread, power of two */
+
+typedef struct {
+	const char *p_name;
+	int64_t start; /* [ns] */
+	int64_t duration;
+	int64_t arg;
+} trace_event_t;
+
+typedef struct trace_buffer {
+	pid_t tid;
+	const char *p_thread_name;
+	std::atomic<uint64_t> head;
+	trace_event_t events[TRACE_BUFFER_EVENTS];
+	struct trace_buffer *p_next;
+} trace_buffer_t;
+
+static std::atomic<bool> m_enabled;
+static std::atomic<trace_buffer_t *> m_buffers; /* All threads, push only */
+static const char *m_path;
+static bool m_written;
+
+static __thread trace_buffer_t *t_buffer;
+static __thread const char *t_thread_name; /* For the buffer, once made */
+
+bool trace_enabled(void)
+{
+	return m_enabled.load(std::memory_order_relaxed);
+}
+
+int64_t trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* First event of a thread: allocate its buffer and link it in */
+static trace_buffer_t *thread_buffer(void)
+{
+	if (t_buffer != NULL)
+		return t_buffer;
+
+	trace_buffer_t *p_buffer = new trace_buffer_t;
+	p_buffer->tid = syscall(SYS_gettid);
+	p_buffer->p_thread_name = t_thread_name;
+	p_buffer->head.store(0, std::memory_order_relaxed);
+
+	p_buffer->p_next = m_buffers.load(std::memory_order_relaxed);
+	while (!m_buffers.compare_exchange_weak(p_buffer->p_next, p_buffer,
+						std::memory_order_release))
+		;
+
+	t_buffer = p_buffer;
+
+	return p_buffer;
+}
+
+/* Kept while disabled too: threads mostly name themselves once at start,
+   possibly before trace_init() */
+void trace_thread_name(const char *p_name)
+{
+	t_thread_name = p_name;
+
+	if (t_buffer != NULL)
+		t_buffer->p_thread_name = p_name;
+}
+
+void trace_complete(const char *p_name, int64_t t_start, int64_t arg)
+{
+	if (!trace_enabled())
+		return;
+
+	trace_buffer_t *p_buffer = thread_buffer();
+	uint64_t head = p_buffer->head.load(std::memory_order_relaxed);
+	trace_event_t *p_event = &p_buffer->events[head & (TRACE_BUFFER_EVENTS-1)];
+
+	p_event->p_name = p_name;
+	p_event->start = t_start;
+	p_event->duration = trace_now() - t_start;
+	p_event->arg = arg;
+
+	p_buffer->head.store(head+1, std::memory_order_release);
+}
+
+static void trace_write(void)
+{
+	if (m_written || m_path == NULL)
+		return;
+
+	m_written = true;
+	m_enabled.store(false, std::memory_order_relaxed);
+
+	FILE *p_file = fopen(m_path, "w");
+	if (p_file == NULL) {
+		ERR("trace: Can't create " << m_path);
+		return;
+	}
+
+	pid_t pid = getpid();
+	bool first = true;
+
+	fprintf(p_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	for (trace_buffer_t *p_buffer = m_buffers.load(std::memory_order_acquire);
+	     p_buffer != NULL; p_buffer = p_buffer->p_next) {
+		/* A thread that was inside trace_complete() when tracing was
+		   disabled may still be filling slot head, which is the oldest
+		   one of a full ring: leave that one out */
+		uint64_t head = p_buffer->head.load(std::memory_order_acquire);
+		uint64_t tail = (head >= TRACE_BUFFER_EVENTS) ?
+			head - TRACE_BUFFER_EVENTS + 1 : 0;
+
+		if (p_buffer->p_thread_name != NULL) {
+			fprintf(p_file, "%s{\"ph\":\"M\",\"name\":\"thread_name\","
+				"\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				first ? "" : ",\n", pid, p_buffer->tid,
+				p_buffer->p_thread_name);
+			first = false;
+		}
+
+		for (uint64_t i = tail; i < head; i++) {
+			trace_event_t *p_event = &p_buffer->events[i & (TRACE_BUFFER_EVENTS-1)];
+
+			fprintf(p_file, "%s{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,"
+				"\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+				first ? "" : ",\n", p_event->p_name, pid,
+				p_buffer->tid, p_event->start / 1000.0,
+				p_event->duration / 1000.0);
+
+			if (p_event->arg >= 0)
+				fprintf(p_file, ",\"args\":{\"n\":%lld}",
+					(long long)p_event->arg);
+
+			fprintf(p_file, "}");
+			first = false;
+		}
+	}
+
+	fprintf(p_file, "\n]}\n");
+	fclose(p_file);
+}
+
+bool trace_init(const char *p_path)
+{
+	DBG("trace_init(" << p_path << ")");
+
+	m_path = p_path;
+	m_written = false;
+	m_enabled.store(true, std::memory_order_relaxed);
+	atexit(trace_write);
+
+	return true;
+}
+
+void trace_stop(void)
+{
+	DBG("trace_stop()");
+
+	trace_write();
+}
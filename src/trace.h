@@ -0,0 +1,55 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "common.h"
+
+/*
+ * Opt-in timeline tracing in Chrome trace-event format (chrome://tracing,
+ * ui.perfetto.dev). Each thread appends complete events to its own ring of
+ * TRACE_BUFFER_EVENTS, without locks; the newest events of every thread are
+ * written out as JSON by trace_stop(). While disabled, a scope costs one
+ * relaxed load.
+ */
+
+bool trace_init(const char *p_path); /* Enables tracing, writes at exit */
+void trace_stop(void); /* Writes the JSON, call after the pipeline stopped */
+
+bool trace_enabled(void);
+int64_t trace_now(void); /* [ns], CLOCK_MONOTONIC */
+
+/* Names the calling thread in the timeline, also before trace_init() */
+void trace_thread_name(const char *p_name);
+
+/* p_name must be a string literal (only the pointer is stored) */
+void trace_complete(const char *p_name, int64_t t_start, int64_t arg);
+
+class trace_scope
+{
+	const char *m_name;
+	int64_t m_arg;
+	int64_t m_start;
+
+public:
+	trace_scope(const char *p_name, int64_t arg = -1)
+	{
+		m_name = p_name;
+		m_arg = arg;
+		m_start = trace_enabled() ? trace_now() : 0;
+	}
+
+	~trace_scope()
+	{
+		if (m_start != 0)
+			trace_complete(m_name, m_start, m_arg);
+	}
+};
+
+#define TRACE_CONCAT_(a, b)	a##b
+#define TRACE_CONCAT(a, b)	TRACE_CONCAT_(a, b)
+
+/* Traces the rest of the enclosing block; the optional argument (e.g. a
+   frame number) is shown with the event */
+#define TRACE_SCOPE(...)	\
+	trace_scope TRACE_CONCAT(trace_scope_, __LINE__)(__VA_ARGS__)
+
+#endif
@@ -0,0 +1,157 @@
+#include "tracks.h"
+
+#include <algorithm>
+#include "recorder.h"
+
+using namespace std;
+
+static bool gyro_before(const tracks_gyro_t& a, const tracks_gyro_t& b)
+{
+	return a.t < b.t;
+}
+
+static bool sonar_before(const tracks_sonar_t& a, const tracks_sonar_t& b)
+{
+	return a.t < b.t;
+}
+
+void tracks_init(tracks_t *p_tracks)
+{
+	p_tracks->gyro.clear();
+	p_tracks->sonar.clear();
+	p_tracks->sonar_pos = 0;
+}
+
+bool tracks_load(tracks_t *p_tracks, const char *p_path)
+{
+	FILE *p_file = fopen(p_path, "rb");
+	if (p_file == NULL)
+		return false;
+
+	recorder_file_header_t hdr;
+	if (fread(&hdr, sizeof(hdr), 1, p_file) != 1 ||
+	    memcmp(hdr.magic, RECORDER_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != RECORDER_VERSION) {
+		fclose(p_file);
+		return false;
+	}
+
+	vector<uint8_t> data;
+	recorder_chunk_header_t chunk;
+
+	/* Chunks end at the index (or wherever a crashed recording stops) */
+	while (fread(&chunk, sizeof(chunk), 1, p_file) == 1 &&
+	       chunk.magic == RECORDER_CHUNK_MAGIC) {
+		data.resize(chunk.size);
+		if (chunk.size > 0 && fread(&data[0], chunk.size, 1, p_file) != 1)
+			break;
+
+		size_t pos = 0;
+		while (pos + sizeof(recorder_record_t) <= data.size()) {
+			recorder_record_t rec;
+			memcpy(&rec, &data[pos], sizeof(rec));
+
+			/* A record cut short ends the chunk */
+			if (pos + sizeof(rec) + rec.size > data.size())
+				break;
+
+			const uint8_t *p_payload = &data[pos + sizeof(rec)];
+
+			if (rec.type == RECORDER_REC_GYRO &&
+			    rec.size == sizeof(recorder_gyro_t)) {
+				recorder_gyro_t g;
+				memcpy(&g, p_payload, sizeof(g));
+				tracks_gyro_t s = { rec.t, g.x, g.y, g.z };
+				p_tracks->gyro.push_back(s);
+			} else if (rec.type == RECORDER_REC_SONAR &&
+				   rec.size == sizeof(recorder_sonar_t)) {
+				recorder_sonar_t d;
+				memcpy(&d, p_payload, sizeof(d));
+				tracks_sonar_t s = { rec.t, d.distance_mm };
+				p_tracks->sonar.push_back(s);
+			}
+
+			pos += sizeof(rec) + rec.size;
+		}
+	}
+
+	fclose(p_file);
+
+	/* Chunks of one channel are in order, but keep it simple */
+	sort(p_tracks->gyro.begin(), p_tracks->gyro.end(), gyro_before);
+	sort(p_tracks->sonar.begin(), p_tracks->sonar.end(), sonar_before);
+	p_tracks->sonar_pos = 0;
+
+	return !p_tracks->gyro.empty();
+}
+
+static double gyro_lerp(const tracks_gyro_t& a, const tracks_gyro_t& b,
+			float tracks_gyro_t::*axis, int64_t t)
+{
+	if (b.t == a.t)
+		return a.*axis;
+
+	return a.*axis + (b.*axis - a.*axis) * (double)(t - a.t) / (b.t - a.t);
+}
+
+bool tracks_gyro_integrate(void *p_arg, int64_t t0, int64_t t1,
+			   double *p_x, double *p_y, double *p_z)
+{
+	const vector<tracks_gyro_t>& s = ((tracks_t *)p_arg)->gyro;
+
+	*p_x = 0;
+	*p_y = 0;
+	*p_z = 0;
+
+	if (s.size() < 2 || t1 <= t0 || t0 < s.front().t || t1 > s.back().t)
+		return false;
+
+	tracks_gyro_t key = { t0, 0, 0, 0 };
+	size_t i = upper_bound(s.begin(), s.end(), key, gyro_before) - s.begin() - 1;
+
+	for (; i+1 < s.size() && s[i].t < t1; i++) {
+		int64_t a = max(s[i].t, t0);
+		int64_t b = min(s[i+1].t, t1);
+		if (b <= a)
+			continue;
+
+		*p_x += 0.5 * (gyro_lerp(s[i], s[i+1], &tracks_gyro_t::x, a) +
+			       gyro_lerp(s[i], s[i+1], &tracks_gyro_t::x, b)) * (b - a);
+		*p_y += 0.5 * (gyro_lerp(s[i], s[i+1], &tracks_gyro_t::y, a) +
+			       gyro_lerp(s[i], s[i+1], &tracks_gyro_t::y, b)) * (b - a);
+		*p_z += 0.5 * (gyro_lerp(s[i], s[i+1], &tracks_gyro_t::z, a) +
+			       gyro_lerp(s[i], s[i+1], &tracks_gyro_t::z, b)) * (b - a);
+	}
+
+	*p_x /= 1000000.0;
+	*p_y /= 1000000.0;
+	*p_z /= 1000000.0;
+
+	return true;
+}
+
+void tracks_read(tracks_t *p_tracks, int64_t t, sensors_data_t *p_data)
+{
+	memset(p_data, 0, sizeof(*p_data));
+
+	while (p_tracks->sonar_pos+1 < p_tracks->sonar.size() &&
+	       p_tracks->sonar[p_tracks->sonar_pos+1].t <= t)
+		p_tracks->sonar_pos++;
+
+	if (!p_tracks->sonar.empty() && p_tracks->sonar[p_tracks->sonar_pos].t <= t)
+		p_data->sonar.distance_mm = p_tracks->sonar[p_tracks->sonar_pos].distance_mm;
+
+	if (p_tracks->gyro.empty())
+		return;
+
+	tracks_gyro_t key = { t, 0, 0, 0 };
+	vector<tracks_gyro_t>::iterator it = upper_bound(p_tracks->gyro.begin(),
+							 p_tracks->gyro.end(),
+							 key, gyro_before);
+	if (it != p_tracks->gyro.begin()) {
+		--it;
+		p_data->gyro.x = it->x;
+		p_data->gyro.y = it->y;
+		p_data->gyro.z = it->z;
+	}
+}
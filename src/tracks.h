@@ -0,0 +1,43 @@
+#ifndef TRACKS_H
+#define TRACKS_H
+
+#include <vector>
+
+#include "common.h"
+#include "sensors.h"
+
+/* Gyro and sonar records of a recorder log (see recorder.h), played back in
+   place of the live sensors when the estimator is re-run offline */
+
+typedef struct {
+	int64_t t;
+	float x; /* [deg/s] */
+	float y;
+	float z;
+} tracks_gyro_t;
+
+typedef struct {
+	int64_t t;
+	int distance_mm;
+} tracks_sonar_t;
+
+typedef struct {
+	std::vector<tracks_gyro_t> gyro; /* Sorted by time */
+	std::vector<tracks_sonar_t> sonar;
+	size_t sonar_pos; /* Read position of tracks_read() */
+} tracks_t;
+
+void tracks_init(tracks_t *p_tracks);
+/* False if the log can't be read or has no gyro samples */
+bool tracks_load(tracks_t *p_tracks, const char *p_path);
+
+/* motion_gyro_fn_t with p_arg = tracks_t *: trapezoidal integral over the
+   recorded samples, like the live sensors_gyro_integrate() */
+bool tracks_gyro_integrate(void *p_arg, int64_t t0, int64_t t1,
+			   double *p_x, double *p_y, double *p_z);
+
+/* Sensor values as sensors_read() would have returned them at time t. Calls
+   must come in time order. */
+void tracks_read(tracks_t *p_tracks, int64_t t, sensors_data_t *p_data);
+
+#endif
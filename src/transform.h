@@ -2,8 +2,52 @@
 #define TRANSFORM_H
 
 #include "common.h"
+#include "rng.h"
 #include <opencv2/core/utility.hpp>
 
-cv::Mat transform_estimate_rigid(std::vector<cv::Point2f>& src, std::vector<cv::Point2f>& dst, int *p_good_count);
+typedef enum {
+	TRANSFORM_KERNEL_NONE = 0, /* Plain least squares */
+	TRANSFORM_KERNEL_HUBER,
+	TRANSFORM_KERNEL_TUKEY
+} transform_kernel_t;
+
+typedef struct {
+	int ransac_niter; /* RANSAC hypotheses per worker */
+	int irls_niter; /* IRLS refinement iterations (0 = disabled) */
+	transform_kernel_t irls_kernel; /* M-estimator used by IRLS */
+	double irls_scale; /* Kernel scale [px] */
+} transform_params_t;
+
+/* Per-stream estimator state */
+typedef struct {
+	uint64_t seed; /* 0 = seed from the clock */
+	uint64_t frame; /* Selects the random streams of the next estimate */
+	int workers; /* RANSAC hypothesis sets, one random stream each */
+	bool parallel; /* Run the workers on the OpenCV thread pool */
+} transform_state_t;
+
+/* Non-zero seed makes the estimator deterministic: the same input sequence
+   yields the same models and inlier counts on every run. Used as the seed of
+   states initialized afterwards. */
+void transform_set_seed(uint64_t seed);
+
+/* Default seed and workers, run in parallel */
+void transform_state_init(transform_state_t *p_state);
+
+void transform_set_params(const transform_params_t *p_params);
+void transform_get_params(transform_params_t *p_params);
+
+cv::Mat transform_estimate_rigid(transform_state_t *p_state, std::vector<cv::Point2f>& src, std::vector<cv::Point2f>& dst, const std::vector<float>& weights, int *p_good_count);
+
+/* Marks the pairs within the RANSAC threshold of the 2x3 CV_64F model M
+   (p_inlier may be NULL), returns their number */
+int transform_inliers(const cv::Mat& M, const std::vector<cv::Point2f>& src,
+		      const std::vector<cv::Point2f>& dst, uint8_t *p_inlier);
+
+/* Building blocks of transform_estimate_rigid(), for tools/bench. M must be a
+   continuous 2x3 CV_64F matrix; w may be NULL. */
+void transform_fit_rigid(const cv::Point2f *a, const cv::Point2f *b,
+			 const float *w, int count, cv::Mat& M);
+cv::Mat transform_ransac(std::vector<cv::Point2f>& src, std::vector<cv::Point2f>& dst, int *p_good_count, rng_t *p_rng);
 
 #endif
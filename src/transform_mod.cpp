@@ -41,51 +41,71 @@
 //M*/
 
 #include "transform.h"
+#include "rng.h"
+#include "rtsched.h"
+#include "trace.h"
 #include <opencv2/calib3d/calib3d.hpp>
 #include <opencv2/video/video.hpp>
 
-#define RANSAC_NITER		75
+#define RANSAC_NITER		20 /* Twice the knee of pipebench synth at 50% outliers */
+#define RANSAC_WORKERS		3
 #define RANSAC_ERR_THRESH	1.5
 #define RANSAC_INL_PROPORTION	0.5
 
+#define IRLS_NITER		3
+#define IRLS_KERNEL		TRANSFORM_KERNEL_HUBER
+#define IRLS_SCALE		1.0 /* [px] */
+#define IRLS_EPS		1e-3 /* [px], stop when the translation moves less */
+#define IRLS_EPS_LINEAR		1e-5 /* And the rotation/scale part */
+
 using namespace cv;
 using namespace std;
 
-static void getRTMatrix(const Point2f* a, const Point2f* b, int count, Mat& M)
+static transform_params_t m_params = {
+	RANSAC_NITER,
+	IRLS_NITER,
+	IRLS_KERNEL,
+	IRLS_SCALE
+};
+
+static uint64_t m_seed; /* Default for new states */
+
+/* False if the points carry no weight or the system is singular; M is then
+   left untouched */
+static bool getRTMatrix(const Point2f* a, const Point2f* b, const float *w,
+			int count, Mat& M)
 {
 	CV_Assert( M.isContinuous() );
 
-	/* Original OpenCV code: */
+	/* Original OpenCV code, extended with per-point weights (w may be
+	   NULL for the unweighted solution): */
 	double sa[4][4]={{0.}}, sb[4]={0.}, m[4];
 	Mat A( 4, 4, CV_64F, sa ), B( 4, 1, CV_64F, sb );
 	Mat MM( 4, 1, CV_64F, m );
+	double sw = 0;
 
 	for( int i = 0; i < count; i++ ) {
-		sa[0][0] += a[i].x*a[i].x + a[i].y*a[i].y;
-		sa[0][2] += a[i].x;
-		sa[0][3] += a[i].y;
-
+		double wi = (w != NULL) ? w[i] : 1.0;
 
-		sa[2][1] += -a[i].y;
-		sa[2][2] += 1;
+		sa[0][0] += wi*(a[i].x*a[i].x + a[i].y*a[i].y);
+		sa[0][2] += wi*a[i].x;
+		sa[0][3] += wi*a[i].y;
+		sw += wi;
 
-		sa[3][0] += a[i].y;
-		sa[3][1] += a[i].x;
-		sa[3][3] += 1;
-
-		sb[0] += a[i].x*b[i].x + a[i].y*b[i].y;
-		sb[1] += a[i].x*b[i].y - a[i].y*b[i].x;
-		sb[2] += b[i].x;
-		sb[3] += b[i].y;
+		sb[0] += wi*(a[i].x*b[i].x + a[i].y*b[i].y);
+		sb[1] += wi*(a[i].x*b[i].y - a[i].y*b[i].x);
+		sb[2] += wi*b[i].x;
+		sb[3] += wi*b[i].y;
 	}
 
 	sa[1][1] = sa[0][0];
 	sa[2][1] = sa[1][2] = -sa[0][3];
 	sa[3][1] = sa[1][3] = sa[2][0] = sa[0][2];
-	sa[2][2] = sa[3][3] = count;
+	sa[2][2] = sa[3][3] = sw;
 	sa[3][0] = sa[0][3];
 
-	solve( A, B, MM, DECOMP_EIG );
+	if (!(sw > 0) || !solve( A, B, MM, DECOMP_EIG ))
+		return false;
 
 	double* om = M.ptr<double>();
 	om[0] = om[4] = m[0];
@@ -93,11 +113,140 @@ static void getRTMatrix(const Point2f* a, const Point2f* b, int count, Mat& M)
 	om[3] = m[1];
 	om[2] = m[2];
 	om[5] = m[3];
+
+	return true;
+}
+
+static double kernel_weight(transform_kernel_t kernel, double r, double c)
+{
+	switch (kernel) {
+	case TRANSFORM_KERNEL_HUBER:
+		return (r <= c) ? 1.0 : c/r;
+	case TRANSFORM_KERNEL_TUKEY:
+		if (r >= c)
+			return 0.0;
+		r /= c;
+		return (1.0 - r*r) * (1.0 - r*r);
+	default:
+		return 1.0;
+	}
+}
+
+/* Iteratively reweighted least squares: starting from the RANSAC model,
+   re-solve the weighted problem over the RANSAC inliers, each weight being
+   the prior (SAD) weight times the M-estimator weight of the current
+   residual. Outliers never enter the fit. If the weights vanish (all
+   residuals beyond a redescending kernel's scale) or the system is
+   singular, the RANSAC model is kept. Returns the number of points within
+   RANSAC_ERR_THRESH of the result. */
+static int irls_refine(vector<Point2f>& src, vector<Point2f>& dst,
+		       const vector<float>& prior, Mat& A)
+{
+	TRACE_SCOPE("irls");
+
+	int count = src.size();
+	const float *p_prior = (prior.size() == (size_t)count) ? &prior[0] : NULL;
+
+	vector<uint8_t> inlier(count);
+	if (transform_inliers(A, src, dst, &inlier[0]) < 2)
+		return transform_inliers(A, src, dst, NULL);
+
+	vector<Point2f> inl_src;
+	vector<Point2f> inl_dst;
+	vector<float> inl_prior;
+	for (int i = 0; i < count; i++) {
+		if (!inlier[i])
+			continue;
+		inl_src.push_back(src[i]);
+		inl_dst.push_back(dst[i]);
+		inl_prior.push_back(p_prior != NULL ? p_prior[i] : 1.0f);
+	}
+
+	int inl_count = inl_src.size();
+	vector<float> w(inl_count);
+	Mat ransac_A = A.clone();
+
+	for (int k = 0; k < m_params.irls_niter; k++) {
+		const double* p_a = A.ptr<double>();
+		double prev[6];
+		memcpy(prev, p_a, sizeof(prev));
+
+		for (int i = 0; i < inl_count; i++) {
+			double dx = p_a[0]*inl_src[i].x + p_a[1]*inl_src[i].y +
+				    p_a[2] - inl_dst[i].x;
+			double dy = p_a[3]*inl_src[i].x + p_a[4]*inl_src[i].y +
+				    p_a[5] - inl_dst[i].y;
+			double r = sqrt(dx*dx + dy*dy);
+
+			w[i] = (float)kernel_weight(m_params.irls_kernel, r,
+						    m_params.irls_scale) * inl_prior[i];
+		}
+
+		if (!getRTMatrix(&inl_src[0], &inl_dst[0], &w[0], inl_count, A)) {
+			ransac_A.copyTo(A);
+			break;
+		}
+
+		p_a = A.ptr<double>();
+		bool converged = true;
+		for (int j = 0; j < 6; j++) {
+			double eps = (j == 2 || j == 5) ? IRLS_EPS : IRLS_EPS_LINEAR;
+			if (fabs(p_a[j]-prev[j]) >= eps)
+				converged = false;
+		}
+		if (converged)
+			break;
+	}
+
+	return transform_inliers(A, src, dst, NULL);
+}
+
+int transform_inliers(const Mat& M, const vector<Point2f>& src,
+		      const vector<Point2f>& dst, uint8_t *p_inlier)
+{
+	double err_thresh = RANSAC_ERR_THRESH * RANSAC_ERR_THRESH; /* [px^2] */
+	const double* p_a = M.ptr<double>();
+	int count = src.size();
+	int good_count = 0;
+
+	for (int i = 0; i < count; i++) {
+		double dx = p_a[0]*src[i].x + p_a[1]*src[i].y + p_a[2] - dst[i].x;
+		double dy = p_a[3]*src[i].x + p_a[4]*src[i].y + p_a[5] - dst[i].y;
+		bool good = (dx*dx + dy*dy) < err_thresh;
+
+		if (p_inlier != NULL)
+			p_inlier[i] = good;
+		good_count += good;
+	}
+
+	return good_count;
+}
+
+void transform_set_seed(uint64_t seed)
+{
+	m_seed = seed;
+}
+
+void transform_state_init(transform_state_t *p_state)
+{
+	p_state->seed = m_seed;
+	p_state->frame = 0;
+	p_state->workers = RANSAC_WORKERS;
+	p_state->parallel = true;
+}
+
+void transform_set_params(const transform_params_t *p_params)
+{
+	m_params = *p_params;
+}
+
+void transform_get_params(transform_params_t *p_params)
+{
+	*p_params = m_params;
 }
 
-Mat ransac(vector<Point2f>& src, vector<Point2f>& dst, int *p_good_count, int seed)
+static Mat ransac(vector<Point2f>& src, vector<Point2f>& dst, int *p_good_count, rng_t *p_rng)
 {
-	RNG rng(microseconds() * seed);
 	int count = src.size();
 
 	vector<int> inl_idx(count);
@@ -112,16 +261,17 @@ Mat ransac(vector<Point2f>& src, vector<Point2f>& dst, int *p_good_count, int se
 	/* Best solution: */
 	vector<int> best_inl_idx(count);
 	int best_inl_count = 0;
+	Mat best_A(2, 3, CV_64F);
 
 	Mat A(2, 3, CV_64F);
 
 	double err_thresh = RANSAC_ERR_THRESH * RANSAC_ERR_THRESH; /* [px^2] */
 
-	for (k = 0; k < RANSAC_NITER; k++) {
+	for (k = 0; k < m_params.ransac_niter; k++) {
 		/* Select two random samples: */
-		sam_idx[0] = rng.uniform(0, count);
+		sam_idx[0] = rng_uniform(p_rng, 0, count);
 		do {
-			sam_idx[1] = rng.uniform(0, count);
+			sam_idx[1] = rng_uniform(p_rng, 0, count);
 		} while (sam_idx[0] == sam_idx[1]);
 
 		for (int i = 0; i < 2; i++) {
@@ -129,8 +279,10 @@ Mat ransac(vector<Point2f>& src, vector<Point2f>& dst, int *p_good_count, int se
 			sam_dst[i] = dst[sam_idx[i]];
 		}
 
-		/* Estimate model using the two samples: */
-		getRTMatrix(sam_src, sam_dst, 2, A);
+		/* Estimate model using the two samples (A would keep the
+		   previous hypothesis, or garbage on the first one): */
+		if (!getRTMatrix(sam_src, sam_dst, NULL, 2, A))
+			continue;
 
 		/* Evaluate the model and identify inliers: */
 		const double* p_a = A.ptr<double>();
@@ -153,9 +305,14 @@ Mat ransac(vector<Point2f>& src, vector<Point2f>& dst, int *p_good_count, int se
 		if (inl_count > best_inl_count) {
 			best_inl_count = inl_count;
 			best_inl_idx = inl_idx;
+			A.copyTo(best_A);
 		}
 	}
 
+	*p_good_count = best_inl_count;
+	if (best_inl_count == 0)
+		return best_A;
+
 	/* Re-estimate the model using the largest set of inliers: */
 	vector<Point2f> inl_src(best_inl_count);
 	vector<Point2f> inl_dst(best_inl_count);
@@ -165,10 +322,22 @@ Mat ransac(vector<Point2f>& src, vector<Point2f>& dst, int *p_good_count, int se
 		inl_dst[i] = dst[best_inl_idx[i]];
 	}
 
-	getRTMatrix(&inl_src[0], &inl_dst[0], best_inl_count, A);
-	*p_good_count = best_inl_count;
+	/* Keeps the best hypothesis if the system is singular */
+	getRTMatrix(&inl_src[0], &inl_dst[0], NULL, best_inl_count, best_A);
+
+	return best_A;
+}
+
+void transform_fit_rigid(const Point2f *a, const Point2f *b, const float *w,
+			 int count, Mat& M)
+{
+	getRTMatrix(a, b, w, count, M);
+}
 
-	return A;
+Mat transform_ransac(vector<Point2f>& src, vector<Point2f>& dst,
+		     int *p_good_count, rng_t *p_rng)
+{
+	return ransac(src, dst, p_good_count, p_rng);
 }
 
 class Parallel_process : public cv::ParallelLoopBody
@@ -180,25 +349,38 @@ private:
 
 	Mat *m_ms;
 	int *m_gs;
+	rng_t *m_rngs;
 
 public:
-	Parallel_process(vector<Point2f>& src1, vector<Point2f>& src2, int nthreads)
+	Parallel_process(vector<Point2f>& src1, vector<Point2f>& src2, int nthreads,
+			 uint64_t seed, uint64_t frame)
 	: m_src1(src1), m_src2(src2) {
 		m_nthreads = nthreads;
 		m_ms = new Mat[m_nthreads];
 		m_gs = new int[m_nthreads];
+		m_rngs = new rng_t[m_nthreads];
+
+		/* One stream per (frame, worker) so that the result does not
+		   depend on which thread picks up which range: */
+		for (int i = 0; i < m_nthreads; i++)
+			rng_seed(&m_rngs[i], seed, (frame << 8) | i);
 	}
 
 	~Parallel_process()
 	{
 		delete [] m_ms;
 		delete [] m_gs;
+		delete [] m_rngs;
 	}
 
 	virtual void operator()(const cv::Range& range) const
 	{
+		/* Only takes on OpenCV's pool threads, not the caller */
+		rtsched_thread(RTSCHED_ROLE_RANSAC, "ransac");
+		TRACE_SCOPE("ransac worker", range.start);
+
 		for(int i = range.start; i < range.end; i++)
-			m_ms[i] = ransac(m_src1, m_src2, &m_gs[i], i);
+			m_ms[i] = ransac(m_src1, m_src2, &m_gs[i], &m_rngs[i]);
 	}
 
 	void result(Mat& mat, int *p_good_count)
@@ -224,14 +406,26 @@ public:
 };
 
 
-Mat transform_estimate_rigid(vector<Point2f>& src, vector<Point2f>& dst, int *p_good_count)
+Mat transform_estimate_rigid(transform_state_t *p_state, vector<Point2f>& src,
+			     vector<Point2f>& dst, const vector<float>& weights,
+			     int *p_good_count)
 {
-	int nthreads = 3;
+	int nthreads = p_state->workers;
 	*p_good_count = 0;
 
-	setNumThreads(nthreads);
-	Parallel_process p(src, dst, nthreads);
-	parallel_for_(cv::Range(0, nthreads), p, nthreads);
+	uint64_t seed = (p_state->seed != 0) ? p_state->seed : (uint64_t)microseconds();
+
+	Parallel_process p(src, dst, nthreads, seed, p_state->frame++);
+
+	/* The result only depends on the seed and the number of workers, so
+	   running them in turn (e.g. when streams are processed in parallel)
+	   gives the same models */
+	if (p_state->parallel) {
+		setNumThreads(nthreads);
+		parallel_for_(cv::Range(0, nthreads), p, nthreads);
+	} else {
+		p(cv::Range(0, nthreads));
+	}
 
 	Mat tform;
 
@@ -239,6 +433,9 @@ Mat transform_estimate_rigid(vector<Point2f>& src, vector<Point2f>& dst, int *p_
 
 	if (*p_good_count == 0)
 		return Mat();
-	else
-		return tform;
+
+	if (m_params.irls_niter > 0)
+		*p_good_count = irls_refine(src, dst, weights, tform);
+
+	return tform;
 }
@@ -26,10 +26,6 @@ static Mat m_map_y;
 
 void undistort_init(void)
 {
-	suseconds_t t1, t2;
-
-	t1 = microseconds();
-
 	FileStorage fs(CALIBRATION_FILENAME, FileStorage::READ);
 
 	if (!fs.isOpened()) {
@@ -37,15 +33,31 @@ void undistort_init(void)
 		return;
 	}
 
+	Mat camera_mat, dist_coeffs;
 
-	fs["camera_matrix"] >> m_camera_mat;
-	fs["distortion_coefficients"] >> m_dist_coeffs;
+	fs["camera_matrix"] >> camera_mat;
+	fs["distortion_coefficients"] >> dist_coeffs;
 
-	m_imw = (int)fs["image_width"];
-	m_imh = (int)fs["image_height"];
+	int imw = (int)fs["image_width"];
+	int imh = (int)fs["image_height"];
 
 	fs.release();
 
+	undistort_init_camera(camera_mat, dist_coeffs, imw, imh);
+}
+
+bool undistort_init_camera(const Mat& camera_mat, const Mat& dist_coeffs,
+			   int imw, int imh)
+{
+	suseconds_t t1, t2;
+
+	t1 = microseconds();
+
+	m_camera_mat = camera_mat.clone();
+	m_dist_coeffs = dist_coeffs.clone();
+	m_imw = imw;
+	m_imh = imh;
+
 	DBG("Calibration for " << m_imw << "x" << m_imh << " image:" << endl
 	    << "K = " << m_camera_mat << endl
 	    << "D = " << m_dist_coeffs);
@@ -63,10 +75,11 @@ void undistort_init(void)
 	t2 = microseconds();
 
 	/* TODO: Also check camera matrix and dist. coefficients: */
-	if (m_imw > 0 && m_imh > 0)
-		m_initialized = true;
+	m_initialized = (m_imw > 0 && m_imh > 0);
 
 	DBG("undistort_init(): " << (t2-t1) << "us");
+
+	return m_initialized;
 }
 
 static void remap_point(Point2f& p)
@@ -97,10 +110,10 @@ void undistort_process_flow(vector<Point2f>& src, vector<Point2f>& dst)
 	int i;
 	for (i = 0; i < src.size(); i++) {
 		/* TODO: Decide what to do with points otside the range */
-		if (src[i].x >= 0 && src[i].x <= m_imw &&
-		    src[i].y >= 0 && src[i].y <= m_imh &&
-		    dst[i].x >= 0 && dst[i].x <= m_imw &&
-		    dst[i].y >= 0 && dst[i].y <= m_imh) {
+		if (src[i].x >= 0 && src[i].x < m_imw &&
+		    src[i].y >= 0 && src[i].y < m_imh &&
+		    dst[i].x >= 0 && dst[i].x < m_imw &&
+		    dst[i].y >= 0 && dst[i].y < m_imh) {
 			remap_point(src[i]);
 			remap_point(dst[i]);
 			count++;
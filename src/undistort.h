@@ -5,6 +5,9 @@
 #include <opencv2/core/utility.hpp>
 
 void undistort_init(void);
+/* Same, with a calibration given by the caller instead of the XML file */
+bool undistort_init_camera(const cv::Mat& camera_mat, const cv::Mat& dist_coeffs,
+			   int imw, int imh);
 void undistort_process_flow(std::vector<cv::Point2f>& src, std::vector<cv::Point2f>& dst);
 
 #endif
@@ -1,4 +1,5 @@
 #include "util.h"
+#include <time.h>
 
 suseconds_t microseconds()
 {
@@ -7,3 +8,11 @@ suseconds_t microseconds()
 
 	return ((tv.tv_sec * 1000000UL) + tv.tv_usec);
 }
+
+int64_t microseconds_monotonic()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((int64_t)ts.tv_sec * 1000000LL) + (ts.tv_nsec / 1000);
+}
@@ -6,9 +6,11 @@ extern "C" {
 #endif
 
 #include <stdio.h>
+#include <stdint.h>
 #include <sys/time.h>
 
 suseconds_t microseconds(void);
+int64_t microseconds_monotonic(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,387 @@
+/* Re-runs the motion estimator over every recorded flight in a directory,
+   using all cores: flights are spread over worker threads that steal from
+   each other when they run dry. Each flight gets its own estimator state and
+   is compensated with its own recorded gyro (if the recorder log is next to
+   the .imv file). Writes one motion track (CSV) per flight and a summary. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "cv_imv.h"
+#include "imvlog.h"
+#include "mavlog.h"
+#include "motion.h"
+#include "recorder.h"
+#include "sensors.h"
+#include "tracks.h"
+#include "transform.h"
+
+#define DEFAULT_FPS		30
+
+using namespace std;
+
+typedef struct {
+	string path;
+	string name;
+	off_t size;
+	bool raw; /* RaspiVid -x dump instead of an imvlog */
+
+	/* Results: */
+	bool ok;
+	bool gyro;
+	size_t frames;
+	double duration_s; /* Recorded */
+	double wall_s;
+} flight_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	deque<size_t> jobs;
+} worker_queue_t;
+
+typedef struct {
+	tracks_t tracks;
+	motion_state_t motion;
+	mavlog_stream_t stream;
+	FILE *p_out;
+} flight_state_t;
+
+static vector<flight_t> m_flights;
+static vector<worker_queue_t> m_queues;
+static string m_out_dir = ".";
+static int m_raw_width;
+static int m_raw_height;
+static int m_raw_fps = DEFAULT_FPS;
+
+static bool ends_with(const string& s, const char *p_suffix)
+{
+	size_t n = strlen(p_suffix);
+
+	return s.size() >= n && s.compare(s.size() - n, n, p_suffix) == 0;
+}
+
+/* Same steps as algo_imv() in flowberry */
+static void process_frame(flight_state_t *p_state, cv_imv& imv, int64_t t0)
+{
+	motion_t motion;
+	sensors_data_t sensors;
+	mavlog_flow_t flow;
+
+	cv_imv_stats_t stats = imv.stats();
+
+	motion_calc_from_imv(&p_state->motion, imv, &motion, stats.avg_sad);
+	tracks_read(&p_state->tracks, imv.timestamp(), &sensors);
+
+	motion.dx = stats.avg_x;
+	motion.dy = stats.avg_y;
+
+	if (!mavlog_flow_calc(&p_state->stream, imv.timestamp(), &motion,
+			      &sensors, &flow))
+		return;
+
+	double dx = 0, dy = 0;
+	if (motion.affine_xform.rows == 2 && motion.affine_xform.cols == 3) {
+		dx = motion.affine_xform.at<double>(0, 2);
+		dy = motion.affine_xform.at<double>(1, 2);
+	}
+
+	fprintf(p_state->p_out, "%.6f,%.4f,%.4f,%.6f,%d,%d,%u,%.4f,%.4f,%.3f\n",
+		(imv.timestamp() - t0) / 1e6, dx, dy, flow.gyro_z_rad,
+		motion.res.vec_in, motion.res.vec_good, flow.quality,
+		flow.flow_x_m, flow.flow_y_m, flow.ground_dist_m);
+}
+
+static bool process_imvlog(flight_t *p_flight, flight_state_t *p_state)
+{
+	imvlog_t log;
+	imvlog_cursor_t cursor;
+
+	if (!imvlog_open(&log, p_flight->path.c_str()))
+		return false;
+
+	size_t count = imvlog_count(&log);
+	int64_t t0 = (count > 0) ? imvlog_record(&log, 0)->t : 0;
+
+	imvlog_prefetch(&log, 0, count);
+	imvlog_cursor_init(&cursor, &log);
+
+	for (size_t i = 0; i < count; i++) {
+		if (!imvlog_cursor_read(&cursor, i))
+			break;
+
+		cv_imv imv = imvlog_cursor_frame(&cursor);
+		process_frame(p_state, imv, t0);
+		p_flight->frames++;
+	}
+
+	if (count > 0)
+		p_flight->duration_s = (imvlog_record(&log, count-1)->t - t0) / 1e6;
+
+	imvlog_cursor_free(&cursor);
+	imvlog_close(&log);
+
+	return true;
+}
+
+/* RaspiVid -x output has no header or timestamps: the geometry comes from
+   the command line and frames are assumed to be evenly spaced */
+static bool process_raw(flight_t *p_flight, flight_state_t *p_state)
+{
+	int mbx = (m_raw_width + 15) / 16;
+	int mby = (m_raw_height + 15) / 16;
+	vector<uint8_t> buf((mbx+1) * mby * sizeof(cv_imv_t));
+
+	FILE *p_file = fopen(p_flight->path.c_str(), "rb");
+	if (p_file == NULL)
+		return false;
+
+	int64_t period = 1000000 / m_raw_fps;
+	int64_t t = period; /* Non-zero, 0 means "no previous frame" */
+
+	while (fread(&buf[0], buf.size(), 1, p_file) == 1) {
+		cv_imv imv(&buf[0], mbx, mby, t, false);
+		process_frame(p_state, imv, period);
+		p_flight->frames++;
+		t += period;
+	}
+
+	p_flight->duration_s = p_flight->frames / (double)m_raw_fps;
+	fclose(p_file);
+
+	return true;
+}
+
+static void process_flight(flight_t *p_flight)
+{
+	flight_state_t state;
+	int64_t t1 = microseconds_monotonic();
+
+	tracks_init(&state.tracks);
+	motion_state_init(&state.motion);
+	state.motion.transform.parallel = false; /* Flights run in parallel */
+	state.stream.prev_t = 0;
+
+	/* Gyro and sonar from the recorder log next to the .imv file */
+	p_flight->gyro = !p_flight->raw &&
+			 tracks_load(&state.tracks, p_flight->path.substr(0, p_flight->path.size() - strlen(RECORDER_IMV_SUFFIX)).c_str());
+	if (p_flight->gyro) {
+		state.motion.gyro_integrate = tracks_gyro_integrate;
+		state.motion.p_gyro_arg = &state.tracks;
+	} else {
+		state.motion.gyro_integrate = NULL;
+	}
+
+	string out_path = m_out_dir + "/" + p_flight->name + ".csv";
+	state.p_out = fopen(out_path.c_str(), "w");
+	if (state.p_out == NULL) {
+		ERR("Can't create " << out_path);
+		return;
+	}
+
+	fprintf(state.p_out, "t_s,dx_px,dy_px,dr_rad,vec_in,vec_good,quality,"
+		"flow_x_m,flow_y_m,ground_dist_m\n");
+
+	if (p_flight->raw)
+		p_flight->ok = process_raw(p_flight, &state);
+	else
+		p_flight->ok = process_imvlog(p_flight, &state);
+
+	fclose(state.p_out);
+
+	p_flight->wall_s = (microseconds_monotonic() - t1) / 1e6;
+}
+
+/* Own queue from the back, others' from the front */
+static bool next_job(int worker, size_t *p_job)
+{
+	int nworkers = m_queues.size();
+
+	for (int i = 0; i < nworkers; i++) {
+		int victim = (worker + i) % nworkers;
+		worker_queue_t *p_queue = &m_queues[victim];
+		bool found = false;
+
+		pthread_mutex_lock(&p_queue->lock);
+		if (!p_queue->jobs.empty()) {
+			if (victim == worker) {
+				*p_job = p_queue->jobs.back();
+				p_queue->jobs.pop_back();
+			} else {
+				*p_job = p_queue->jobs.front();
+				p_queue->jobs.pop_front();
+			}
+			found = true;
+		}
+		pthread_mutex_unlock(&p_queue->lock);
+
+		if (found)
+			return true;
+	}
+
+	/* All jobs are known up front, so empty queues mean we are done */
+	return false;
+}
+
+static void *worker_thread(void *ptr)
+{
+	int worker = (int)(intptr_t)ptr;
+	size_t job;
+
+	while (next_job(worker, &job))
+		process_flight(&m_flights[job]);
+
+	return NULL;
+}
+
+static void scan_dir(const char *p_dir)
+{
+	DIR *p = opendir(p_dir);
+	struct dirent *p_ent;
+
+	if (p == NULL) {
+		ERR("Can't open " << p_dir);
+		return;
+	}
+
+	while ((p_ent = readdir(p)) != NULL) {
+		string name = p_ent->d_name;
+		flight_t flight;
+		struct stat st;
+
+		flight.path = string(p_dir) + "/" + name;
+		if (stat(flight.path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		if (ends_with(name, ".h264")) {
+			fprintf(stderr, "Skipping %s: H.264 input is not supported, "
+				"record with rec=<file>\n", name.c_str());
+			continue;
+		}
+
+		if (!ends_with(name, RECORDER_IMV_SUFFIX))
+			continue;
+
+		/* imvlog, or a raw dump if the magic does not match */
+		char magic[8] = { 0 };
+		FILE *p_file = fopen(flight.path.c_str(), "rb");
+		if (p_file == NULL)
+			continue;
+		size_t n = fread(magic, 1, sizeof(magic), p_file);
+		fclose(p_file);
+
+		flight.raw = (n != sizeof(magic) ||
+			      memcmp(magic, IMVLOG_MAGIC, sizeof(magic)) != 0);
+		if (flight.raw && m_raw_width == 0) {
+			fprintf(stderr, "Skipping %s: raw IMV needs size=<w>x<h>\n",
+				name.c_str());
+			continue;
+		}
+
+		flight.name = name.substr(0, name.size() - strlen(RECORDER_IMV_SUFFIX));
+		flight.size = st.st_size;
+		flight.ok = false;
+		flight.gyro = false;
+		flight.frames = 0;
+		flight.duration_s = 0;
+		flight.wall_s = 0;
+		m_flights.push_back(flight);
+	}
+
+	closedir(p);
+}
+
+int main(int argc, char **argv)
+{
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <dir> [out=<dir>] [threads=<n>] "
+			"[seed=<n>] [size=<w>x<h>] [fps=<n>]\n", argv[0]);
+		return 1;
+	}
+
+	for (int i = 2; i < argc; i++) {
+		if (strncmp("out=", argv[i], 4) == 0)
+			m_out_dir = argv[i]+4;
+		else if (strncmp("threads=", argv[i], 8) == 0)
+			nthreads = atoi(argv[i]+8);
+		else if (strncmp("seed=", argv[i], 5) == 0)
+			transform_set_seed(strtoull(argv[i]+5, NULL, 0));
+		else if (strncmp("size=", argv[i], 5) == 0)
+			sscanf(argv[i]+5, "%dx%d", &m_raw_width, &m_raw_height);
+		else if (strncmp("fps=", argv[i], 4) == 0)
+			m_raw_fps = atoi(argv[i]+4);
+	}
+
+	if (nthreads < 1)
+		nthreads = 1;
+	if (m_raw_fps < 1)
+		m_raw_fps = DEFAULT_FPS;
+
+	scan_dir(argv[1]);
+	if (m_flights.empty()) {
+		fprintf(stderr, "No flights found in %s\n", argv[1]);
+		return 1;
+	}
+
+	mkdir(m_out_dir.c_str(), 0755);
+	motion_init();
+
+	/* Largest flights first, dealt round-robin; stealing evens out the
+	   rest */
+	vector<size_t> order(m_flights.size());
+	for (size_t i = 0; i < order.size(); i++)
+		order[i] = i;
+	sort(order.begin(), order.end(), [](size_t a, size_t b) {
+		return m_flights[a].size > m_flights[b].size; });
+
+	m_queues = vector<worker_queue_t>(nthreads);
+	for (int i = 0; i < nthreads; i++)
+		pthread_mutex_init(&m_queues[i].lock, NULL);
+	for (size_t i = 0; i < order.size(); i++)
+		m_queues[i % nthreads].jobs.push_back(order[i]);
+
+	int64_t t1 = microseconds_monotonic();
+
+	vector<pthread_t> threads(nthreads);
+	for (int i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, worker_thread, (void *)(intptr_t)i);
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	double wall_s = (microseconds_monotonic() - t1) / 1e6;
+
+	size_t frames = 0;
+	double recorded_s = 0;
+	int failed = 0;
+
+	for (size_t i = 0; i < m_flights.size(); i++) {
+		flight_t *p_flight = &m_flights[i];
+
+		printf("%-32s %8zu frames %8.1f s %s%s %7.2f s\n",
+		       p_flight->name.c_str(), p_flight->frames,
+		       p_flight->duration_s, p_flight->gyro ? "gyro" : "    ",
+		       p_flight->ok ? "" : " FAILED", p_flight->wall_s);
+
+		frames += p_flight->frames;
+		recorded_s += p_flight->duration_s;
+		if (!p_flight->ok)
+			failed++;
+	}
+
+	printf("\n%zu flights (%d failed), %zu frames, %.1f s recorded\n",
+	       m_flights.size(), failed, frames, recorded_s);
+	printf("%.2f s on %d threads: %.0f frames/s, %.1fx real time\n",
+	       wall_s, nthreads, frames / wall_s, recorded_s / wall_s);
+
+	return (failed > 0) ? 1 : 0;
+}
@@ -0,0 +1,423 @@
+/* Microbenchmarks of the per-frame kernels of the estimator on synthetic IMV
+   fields: a rigid motion seen by every macroblock plus a given proportion of
+   random outliers. Every kernel runs on every grid size and outlier ratio for
+   at least min_ms. Results go to stdout as JSON (for regression tracking) and
+   to stderr as a table. Cache misses and instructions are counted with
+   perf_event_open(2) when the kernel lets us (kernel.perf_event_paranoid),
+   reported as null otherwise. */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "common.h"
+#include "cv_imv.h"
+#include "motion.h"
+#include "rng.h"
+#include "sensors.h"
+#include "transform.h"
+#include "undistort.h"
+
+#define DEFAULT_MIN_MS		200
+#define DEFAULT_SEED		1
+
+#define BENCH_SAD_LIMIT		1000
+
+/* Synthetic motion between two frames: */
+#define FIELD_ROTATION		0.01 /* [rad] */
+#define FIELD_DX		5.0 /* [px] */
+#define FIELD_DY		-3.0 /* [px] */
+
+using namespace cv;
+using namespace std;
+
+typedef struct {
+	int mbx;
+	int mby;
+} grid_t;
+
+/* 640x480, 1280x720 and 1920x1080 */
+static const grid_t m_grids[] = { {40, 30}, {80, 45}, {120, 68} };
+static const double m_outliers[] = { 0.0, 0.25, 0.5 };
+
+typedef struct {
+	int mbx;
+	int mby;
+	double outliers;
+
+	cv_imv *p_imv;
+	vector<Point2f> src; /* Extracted from p_imv, never modified */
+	vector<Point2f> dst;
+	vector<float> weights;
+
+	/* Scratch for the kernels: */
+	vector<Point2f> work_src;
+	vector<Point2f> work_dst;
+	vector<float> work_weights;
+	Mat M;
+	rng_t rng;
+	transform_state_t transform;
+	int sign;
+} bench_case_t;
+
+typedef void (*kernel_fn_t)(bench_case_t *p_case);
+
+typedef struct {
+	const char *name;
+	kernel_fn_t fn;
+} kernel_t;
+
+typedef struct {
+	int fd_misses;
+	int fd_instructions;
+} perf_t;
+
+static uint64_t m_seed = DEFAULT_SEED;
+
+static int64_t nanoseconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Keeps the compiler from dropping a result */
+static volatile double m_sink;
+
+static void kernel_stats(bench_case_t *p_case)
+{
+	cv_imv_stats_t stats = p_case->p_imv->stats();
+	m_sink = stats.avg_x;
+}
+
+static void kernel_extract(bench_case_t *p_case)
+{
+	m_sink = motion_extract_points(*p_case->p_imv, BENCH_SAD_LIMIT, NULL,
+				       p_case->work_src, p_case->work_dst,
+				       p_case->work_weights);
+}
+
+/* Best 2 vectors of every 4x4 blocks */
+static void kernel_extract_tiled(bench_case_t *p_case)
+{
+	motion_sampling_t sampling;
+
+	motion_sampling_init(&sampling);
+	sampling.tile_size = 4;
+	sampling.per_tile = 2;
+
+	m_sink = motion_extract_points(*p_case->p_imv, BENCH_SAD_LIMIT, &sampling,
+				       p_case->work_src, p_case->work_dst,
+				       p_case->work_weights);
+}
+
+/* Remaps in place, so the input is restored first (two memcpy()s) */
+static void kernel_undistort(bench_case_t *p_case)
+{
+	p_case->work_src.assign(p_case->src.begin(), p_case->src.end());
+	p_case->work_dst.assign(p_case->dst.begin(), p_case->dst.end());
+	undistort_process_flow(p_case->work_src, p_case->work_dst);
+	m_sink = p_case->work_src[0].x;
+}
+
+/* Shifts back and forth so that the points stay where they were */
+static void kernel_compensate(bench_case_t *p_case)
+{
+	p_case->sign = -p_case->sign;
+	sensors_compensate(p_case->work_src, p_case->sign * 0.2,
+			   p_case->sign * 0.1);
+	m_sink = p_case->work_src[0].x;
+}
+
+/* Weighted least squares over all vectors, as in every IRLS iteration */
+static void kernel_fit_rigid(bench_case_t *p_case)
+{
+	transform_fit_rigid(&p_case->src[0], &p_case->dst[0],
+			    &p_case->weights[0], p_case->src.size(), p_case->M);
+	m_sink = p_case->M.at<double>(0, 2);
+}
+
+static void kernel_ransac(bench_case_t *p_case)
+{
+	int good;
+	transform_ransac(p_case->src, p_case->dst, &good, &p_case->rng);
+	m_sink = good;
+}
+
+static void kernel_estimate(bench_case_t *p_case)
+{
+	int good;
+	transform_estimate_rigid(&p_case->transform, p_case->src, p_case->dst,
+				 p_case->weights, &good);
+	m_sink = good;
+}
+
+static void kernel_estimate_mt(bench_case_t *p_case)
+{
+	p_case->transform.parallel = true;
+	kernel_estimate(p_case);
+	p_case->transform.parallel = false;
+}
+
+static const kernel_t m_kernels[] = {
+	{ "stats", kernel_stats },
+	{ "extract_points", kernel_extract },
+	{ "extract_points_tiled", kernel_extract_tiled },
+	{ "undistort", kernel_undistort },
+	{ "compensate", kernel_compensate },
+	{ "fit_rigid", kernel_fit_rigid },
+	{ "ransac", kernel_ransac },
+	{ "estimate_rigid", kernel_estimate },
+	{ "estimate_rigid_mt", kernel_estimate_mt },
+};
+
+/* Vectors of a rigid motion about the image centre; outliers get a random
+   vector and a higher SAD, like blocks the encoder could not match */
+static void field_generate(uint8_t *p_buffer, int mbx, int mby,
+			   double outliers, rng_t *p_rng)
+{
+	cv_imv_t *p_imv = (cv_imv_t *)p_buffer;
+	double cx = mbx * 8.0;
+	double cy = mby * 8.0;
+	double c = cos(FIELD_ROTATION);
+	double s = sin(FIELD_ROTATION);
+
+	memset(p_buffer, 0, (mbx+1) * mby * sizeof(cv_imv_t));
+
+	for (int j = 0; j < mby; j++) {
+		for (int i = 0; i < mbx; i++) {
+			cv_imv_t *p_vec = p_imv + (i+(mbx+1)*j);
+			double x = i*16 + 8 - cx;
+			double y = j*16 + 8 - cy;
+
+			if (rng_uniform(p_rng, 0, 1000) < outliers * 1000) {
+				p_vec->x = rng_uniform(p_rng, -32, 33);
+				p_vec->y = rng_uniform(p_rng, -32, 33);
+				p_vec->sad = rng_uniform(p_rng, 1000, 4000);
+			} else {
+				p_vec->x = lrint(c*x - s*y + FIELD_DX - x);
+				p_vec->y = lrint(s*x + c*y + FIELD_DY - y);
+				p_vec->sad = rng_uniform(p_rng, 100, 800);
+			}
+		}
+	}
+}
+
+/* Plausible wide-angle calibration for the grid's image size */
+static void camera_init(int mbx, int mby)
+{
+	int w = mbx * 16;
+	int h = mby * 16;
+
+	double k[9] = { 0.8*w, 0, w/2.0,
+			0, 0.8*w, h/2.0,
+			0, 0, 1 };
+	double d[5] = { -0.3, 0.1, 0, 0, 0 };
+
+	undistort_init_camera(Mat(3, 3, CV_64F, k), Mat(1, 5, CV_64F, d), w, h);
+}
+
+static void case_init(bench_case_t *p_case, int mbx, int mby, double outliers)
+{
+	p_case->mbx = mbx;
+	p_case->mby = mby;
+	p_case->outliers = outliers;
+
+	rng_seed(&p_case->rng, m_seed, (mbx << 16) | (int)(outliers * 100));
+
+	vector<uint8_t> buffer((mbx+1) * mby * sizeof(cv_imv_t));
+	field_generate(&buffer[0], mbx, mby, outliers, &p_case->rng);
+	p_case->p_imv = new cv_imv(&buffer[0], mbx, mby, 0);
+
+	motion_extract_points(*p_case->p_imv, BENCH_SAD_LIMIT, NULL,
+			      p_case->src, p_case->dst, p_case->weights);
+	p_case->work_src = p_case->src;
+	p_case->work_dst = p_case->dst;
+	p_case->M = Mat(2, 3, CV_64F);
+	p_case->sign = 1;
+
+	transform_set_seed(m_seed);
+	transform_state_init(&p_case->transform);
+	p_case->transform.parallel = false;
+
+	camera_init(mbx, mby);
+}
+
+static void case_free(bench_case_t *p_case)
+{
+	delete p_case->p_imv;
+}
+
+static int perf_open(uint64_t config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.inherit = 1; /* Count the OpenCV workers too */
+
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void perf_init(perf_t *p_perf)
+{
+	p_perf->fd_misses = perf_open(PERF_COUNT_HW_CACHE_MISSES);
+	p_perf->fd_instructions = perf_open(PERF_COUNT_HW_INSTRUCTIONS);
+
+	if (p_perf->fd_misses < 0 || p_perf->fd_instructions < 0)
+		fprintf(stderr, "perf_event_open(): %s, not counting cache "
+			"misses\n", strerror(errno));
+}
+
+static void perf_start(perf_t *p_perf)
+{
+	int fds[2] = { p_perf->fd_misses, p_perf->fd_instructions };
+
+	for (int i = 0; i < 2; i++) {
+		if (fds[i] < 0)
+			continue;
+		ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+/* Negative when not available */
+static int64_t perf_read(int fd)
+{
+	uint64_t value;
+
+	if (fd < 0)
+		return -1;
+
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+
+	if (read(fd, &value, sizeof(value)) != sizeof(value))
+		return -1;
+
+	return value;
+}
+
+static void json_per_op(const char *name, int64_t count, int64_t iterations,
+			bool last)
+{
+	if (count < 0)
+		printf("\"%s\": null%s", name, last ? "" : ", ");
+	else
+		printf("\"%s\": %.1f%s", name, (double)count / iterations,
+		       last ? "" : ", ");
+}
+
+static void bench_run(const kernel_t *p_kernel, bench_case_t *p_case,
+		      perf_t *p_perf, int min_ms, bool first)
+{
+	int64_t min_ns = (int64_t)min_ms * 1000000;
+	int64_t iterations = 1;
+	int64_t elapsed;
+
+	/* Warm up and find an iteration count that runs for min_ms: */
+	for (;;) {
+		int64_t t0 = nanoseconds();
+		for (int64_t i = 0; i < iterations; i++)
+			p_kernel->fn(p_case);
+		elapsed = nanoseconds() - t0;
+
+		if (elapsed >= min_ns / 4)
+			break;
+		iterations *= 2;
+	}
+
+	iterations = iterations * min_ns / (elapsed > 0 ? elapsed : 1) + 1;
+
+	perf_start(p_perf);
+	int64_t t0 = nanoseconds();
+	for (int64_t i = 0; i < iterations; i++)
+		p_kernel->fn(p_case);
+	elapsed = nanoseconds() - t0;
+	int64_t misses = perf_read(p_perf->fd_misses);
+	int64_t instructions = perf_read(p_perf->fd_instructions);
+
+	double ns_per_op = (double)elapsed / iterations;
+
+	printf("%s\n    {\"kernel\": \"%s\", \"grid\": [%d, %d], "
+	       "\"outliers\": %.2f, \"vectors\": %zu, \"iterations\": %lld, "
+	       "\"ns_per_op\": %.1f, \"frames_per_s\": %.1f, ",
+	       first ? "" : ",", p_kernel->name, p_case->mbx, p_case->mby,
+	       p_case->outliers, p_case->src.size(), (long long)iterations,
+	       ns_per_op, 1e9 / ns_per_op);
+	json_per_op("cache_misses_per_op", misses, iterations, false);
+	json_per_op("instructions_per_op", instructions, iterations, true);
+	printf("}");
+	fflush(stdout);
+
+	fprintf(stderr, "%-18s %3dx%-3d %4.2f %6zu %12.1f %12.1f",
+		p_kernel->name, p_case->mbx, p_case->mby, p_case->outliers,
+		p_case->src.size(), ns_per_op, 1e9 / ns_per_op);
+	if (misses >= 0)
+		fprintf(stderr, " %10.1f", (double)misses / iterations);
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *p_filter = NULL;
+	int min_ms = DEFAULT_MIN_MS;
+
+	for (int i = 1; i < argc; i++) {
+		if (strncmp("filter=", argv[i], 7) == 0)
+			p_filter = argv[i]+7;
+		else if (strncmp("min_ms=", argv[i], 7) == 0)
+			min_ms = atoi(argv[i]+7);
+		else if (strncmp("seed=", argv[i], 5) == 0)
+			m_seed = strtoull(argv[i]+5, NULL, 0);
+		else {
+			fprintf(stderr, "Usage: %s [filter=<kernel>] "
+				"[min_ms=<ms>] [seed=<n>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	perf_t perf;
+	perf_init(&perf);
+
+	fprintf(stderr, "%-18s %7s %4s %6s %12s %12s %10s\n", "kernel", "grid",
+		"outl", "vecs", "ns/op", "frames/s", "misses/op");
+
+	printf("{\n  \"min_ms\": %d,\n  \"seed\": %llu,\n  \"results\": [",
+	       min_ms, (unsigned long long)m_seed);
+
+	bool first = true;
+
+	for (size_t g = 0; g < sizeof(m_grids) / sizeof(m_grids[0]); g++) {
+		for (size_t o = 0; o < sizeof(m_outliers) / sizeof(m_outliers[0]); o++) {
+			bench_case_t c;
+			case_init(&c, m_grids[g].mbx, m_grids[g].mby, m_outliers[o]);
+
+			for (size_t k = 0; k < sizeof(m_kernels) / sizeof(m_kernels[0]); k++) {
+				if (p_filter != NULL &&
+				    strstr(m_kernels[k].name, p_filter) == NULL)
+					continue;
+
+				bench_run(&m_kernels[k], &c, &perf, min_ms, first);
+				first = false;
+			}
+
+			case_free(&c);
+		}
+	}
+
+	printf("\n  ]\n}\n");
+
+	return 0;
+}
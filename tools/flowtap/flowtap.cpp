@@ -0,0 +1,207 @@
+/* Reader of flowberry's shared-memory ring (flowberry shm[=<socket>]): maps
+   the ring, follows the published frames in place and reports once a second
+   how many arrived, were lost or overwritten while being read, how old they
+   were and how many blocks the estimate kept. grid also prints the block
+   mask of the newest frame (. unused, x outlier, o inlier). slow=<ms> reads
+   each frame that long, like a busy consumer. With "self" it also publishes
+   synthetic frames at rate=<Hz> on the socket itself. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "common.h"
+#include "evloop.h"
+#include "flowshm.h"
+
+#define SELF_MBX	40
+#define SELF_MBY	30
+
+using namespace std;
+
+static int m_rate = 30; /* [Hz] */
+
+static void sleep_until(int64_t t_us)
+{
+	struct timespec ts;
+	ts.tv_sec = t_us / 1000000;
+	ts.tv_nsec = (t_us % 1000000) * 1000;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* Stands in for flowberry: a uniform shift with every 7th block an outlier */
+static void *writer_thread(void *ptr)
+{
+	int64_t t = microseconds_monotonic();
+
+	for (unsigned long frame = 0; ; frame++) {
+		cv_imv_t *p_imv;
+		uint8_t *p_blocks;
+		flowshm_slot_t *p_slot = flowshm_begin(t, &p_imv, &p_blocks);
+
+		for (int j = 0; j < SELF_MBY; j++) {
+			for (int i = 0; i <= SELF_MBX; i++) {
+				cv_imv_t *p_vec = p_imv + i + (SELF_MBX+1)*j;
+				int k = i + SELF_MBX*j;
+				bool outlier = (k % 7 == 0);
+
+				p_vec->x = outlier ? -8 : (int8_t)(frame % 5) - 2;
+				p_vec->y = outlier ? 8 : 1;
+				p_vec->sad = 100;
+				if (i < SELF_MBX)
+					p_blocks[k] = outlier ? CV_IMV_BLOCK_OUTLIER :
+						      CV_IMV_BLOCK_INLIER;
+			}
+		}
+
+		memset(p_slot->xform, 0, sizeof(p_slot->xform));
+		p_slot->xform[0] = 1;
+		p_slot->xform[4] = 1;
+		p_slot->xform[2] = -(int)(frame % 5) + 2;
+		p_slot->xform[5] = -1;
+		p_slot->valid = 1;
+		p_slot->vec_in = SELF_MBX * SELF_MBY;
+		p_slot->vec_good = p_slot->vec_in - (p_slot->vec_in + 6) / 7;
+		flowshm_commit(p_slot);
+
+		t += 1000000 / m_rate;
+		sleep_until(t);
+	}
+
+	return NULL;
+}
+
+static void grid_print(const flowshm_reader_t *p_reader, const uint8_t *p_blocks)
+{
+	static const char symbols[] = ".xo";
+	int mbx = p_reader->p_hdr->mbx;
+	int mby = p_reader->p_hdr->mby;
+
+	for (int j = 0; j < mby; j++) {
+		for (int i = 0; i < mbx; i++)
+			putchar(symbols[min((int)p_blocks[i + mbx*j], 2)]);
+		putchar('\n');
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *p_path = FLOWSHM_DEFAULT_PATH;
+	bool self = false;
+	bool grid = false;
+	int seconds = 10; /* 0: forever */
+	int slow_ms = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp("self", argv[i]) == 0)
+			self = true;
+		else if (strcmp("grid", argv[i]) == 0)
+			grid = true;
+		else if (strncmp("path=", argv[i], 5) == 0)
+			p_path = argv[i]+5;
+		else if (strncmp("rate=", argv[i], 5) == 0)
+			m_rate = atoi(argv[i]+5);
+		else if (strncmp("seconds=", argv[i], 8) == 0)
+			seconds = atoi(argv[i]+8);
+		else if (strncmp("slow=", argv[i], 5) == 0)
+			slow_ms = atoi(argv[i]+5);
+		else {
+			fprintf(stderr, "Usage: %s [self] [grid] [path=<socket>] "
+				"[rate=<Hz>] [seconds=<n>] [slow=<ms>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (self) {
+		if (m_rate <= 0 || !evloop_init() ||
+		    !flowshm_init(p_path, SELF_MBX, SELF_MBY) ||
+		    !flowshm_start() || !evloop_start()) {
+			fprintf(stderr, "Can't publish on %s\n", p_path);
+			return 1;
+		}
+
+		pthread_t thread;
+		pthread_create(&thread, NULL, writer_thread, NULL);
+	}
+
+	flowshm_reader_t reader;
+	if (!flowshm_open(&reader, p_path)) {
+		fprintf(stderr, "Can't read the ring on %s\n", p_path);
+		return 1;
+	}
+
+	printf("%dx%d blocks, %u slots of %u bytes\n", reader.p_hdr->mbx,
+	       reader.p_hdr->mby, reader.p_hdr->slot_count, reader.p_hdr->slot_size);
+
+	int64_t t_start = microseconds_monotonic();
+	int64_t t_report = t_start + 1000000;
+	unsigned long frames = 0, torn = 0, lost0 = 0;
+	long inliers = 0, used = 0;
+	vector<uint32_t> ages;
+	vector<uint8_t> last_blocks;
+
+	while (seconds == 0 || microseconds_monotonic() - t_start < seconds * 1000000LL) {
+		const flowshm_slot_t *p_slot = flowshm_next(&reader, 100);
+		int64_t t = microseconds_monotonic();
+
+		if (p_slot != NULL) {
+			/* Used in place; only kept if it was not overwritten meanwhile */
+			int64_t age = t - p_slot->t;
+			const uint8_t *p_blocks = flowshm_blocks(&reader, p_slot);
+			int count = reader.p_hdr->mbx * reader.p_hdr->mby;
+			int frame_inliers = 0, frame_used = 0;
+
+			for (int k = 0; k < count; k++) {
+				frame_inliers += (p_blocks[k] == CV_IMV_BLOCK_INLIER);
+				frame_used += (p_blocks[k] != CV_IMV_BLOCK_UNUSED);
+			}
+			if (grid)
+				last_blocks.assign(p_blocks, p_blocks + count);
+
+			if (slow_ms > 0)
+				usleep(slow_ms * 1000);
+
+			if (flowshm_valid(&reader, p_slot)) {
+				frames++;
+				inliers += frame_inliers;
+				used += frame_used;
+				ages.push_back((uint32_t)age);
+			} else {
+				torn++;
+			}
+		}
+
+		if (t < t_report)
+			continue;
+		t_report += 1000000;
+
+		sort(ages.begin(), ages.end());
+		printf("%lu frames/s, %lu lost, %lu torn, age p50 %u us max %u us, "
+		       "%.1f %% inliers\n", frames, reader.lost - lost0, torn,
+		       ages.empty() ? 0 : ages[ages.size()/2],
+		       ages.empty() ? 0 : ages.back(),
+		       used > 0 ? 100.0 * inliers / used : 0.0);
+		if (grid && !last_blocks.empty())
+			grid_print(&reader, &last_blocks[0]);
+		fflush(stdout);
+
+		frames = 0;
+		torn = 0;
+		inliers = 0;
+		used = 0;
+		lost0 = reader.lost;
+		ages.clear();
+	}
+
+	flowshm_close(&reader);
+	if (self) {
+		flowshm_stop();
+		evloop_stop();
+	}
+
+	return 0;
+}
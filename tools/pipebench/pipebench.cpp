@@ -0,0 +1,625 @@
+/* Whole-pipeline benchmark: pushes a recorded flight (imvlog plus the
+   recorder log next to it) or a synthetic stream with a known trajectory
+   through the same steps as algo_imv() in flowberry, as fast as possible.
+   Prints sustained frames/s, the per-frame latency distribution and the
+   error against a reference trajectory as JSON. With baseline=<json> (the
+   output of an earlier run) it fails when a number got worse by more than
+   tol percent, so it can gate a change. */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "cv_imv.h"
+#include "imvlog.h"
+#include "mavlog.h"
+#include "motion.h"
+#include "recorder.h"
+#include "rng.h"
+#include "sensors.h"
+#include "tracks.h"
+#include "transform.h"
+
+#define DEFAULT_SEED		1
+#define DEFAULT_TOL		10 /* [%] */
+
+#define SYNTH_FRAMES		3000
+#define SYNTH_WIDTH		1280
+#define SYNTH_HEIGHT		720
+#define SYNTH_OUTLIERS		0.2
+#define SYNTH_PERIOD		33333 /* [us] */
+#define SYNTH_GYRO_PERIOD	1250 /* [us], 800 Hz */
+#define SYNTH_SONAR_PERIOD	50000 /* [us] */
+#define SYNTH_DISTANCE		1500 /* [mm] */
+
+/* Absolute slack of the accuracy gate (quantization noise) */
+#define GATE_EPS_PX		1e-3
+#define GATE_EPS_RAD		1e-5
+
+using namespace cv;
+using namespace std;
+
+/* Rigid motion of one frame, as estimated (maps the previous position of a
+   block to the current one) */
+typedef struct {
+	int64_t t; /* [us], microseconds_monotonic() time of the frame */
+	bool valid;
+	double dx; /* [px] */
+	double dy;
+	double dr; /* [rad] */
+} pose_t;
+
+typedef struct {
+	motion_state_t motion;
+	motion_sampling_t sampling;
+	motion_prefilter_t prefilter;
+	mavlog_stream_t stream;
+	tracks_t tracks;
+
+	vector<pose_t> trajectory;
+	vector<int64_t> latency; /* [ns] */
+	int64_t busy; /* [ns] */
+	uint64_t vec_in;
+	uint64_t vec_good;
+	uint64_t prefilter_checked;
+	uint64_t prefilter_rejected;
+} bench_state_t;
+
+typedef struct {
+	size_t count;
+	size_t missing; /* Valid in the reference, not estimated */
+	double rms_dx;
+	double rms_dy;
+	double rms_dr;
+	double max_dxy;
+} accuracy_t;
+
+static uint64_t m_seed = DEFAULT_SEED;
+
+static int64_t nanoseconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Same steps as algo_imv() in flowberry */
+static void process_frame(bench_state_t *p_state, cv_imv& imv)
+{
+	motion_t motion;
+	sensors_data_t sensors;
+	mavlog_flow_t flow;
+	pose_t pose = { imv.timestamp(), false, 0, 0, 0 };
+
+	int64_t t1 = nanoseconds();
+
+	cv_imv_stats_t stats = imv.stats();
+
+	motion_points_t points;
+
+	motion_prepare(imv, stats.avg_sad, &p_state->sampling, &points);
+	motion_correct(&p_state->motion, &points);
+	motion_estimate(&p_state->motion, &points, &motion);
+	tracks_read(&p_state->tracks, imv.timestamp(), &sensors);
+
+	motion.dx = stats.avg_x;
+	motion.dy = stats.avg_y;
+
+	mavlog_flow_calc(&p_state->stream, imv.timestamp(), &motion, &sensors,
+			 &flow);
+
+	int64_t t2 = nanoseconds();
+
+	p_state->latency.push_back(t2 - t1);
+	p_state->busy += t2 - t1;
+	p_state->vec_in += motion.res.vec_in;
+	p_state->vec_good += motion.res.vec_good;
+	p_state->prefilter_checked += p_state->prefilter.checked;
+	p_state->prefilter_rejected += p_state->prefilter.rejected;
+
+	if (motion.affine_xform.rows == 2 && motion.affine_xform.cols == 3) {
+		pose.valid = true;
+		pose.dx = motion.affine_xform.at<double>(0, 2);
+		pose.dy = motion.affine_xform.at<double>(1, 2);
+		pose.dr = atan2(motion.affine_xform.at<double>(1, 0),
+				motion.affine_xform.at<double>(0, 0));
+	}
+
+	p_state->trajectory.push_back(pose);
+}
+
+static bool run_imvlog(bench_state_t *p_state, const char *p_path)
+{
+	imvlog_t log;
+	imvlog_cursor_t cursor;
+
+	if (!imvlog_open(&log, p_path))
+		return false;
+
+	/* Gyro and sonar from the recorder log next to the .imv file */
+	string rec_path = p_path;
+	size_t n = strlen(RECORDER_IMV_SUFFIX);
+	if (rec_path.size() > n &&
+	    rec_path.compare(rec_path.size() - n, n, RECORDER_IMV_SUFFIX) == 0 &&
+	    tracks_load(&p_state->tracks, rec_path.substr(0, rec_path.size() - n).c_str())) {
+		p_state->motion.gyro_integrate = tracks_gyro_integrate;
+		p_state->motion.p_gyro_arg = &p_state->tracks;
+	} else {
+		fprintf(stderr, "No recorder log for %s, not compensating\n", p_path);
+		p_state->motion.gyro_integrate = NULL;
+	}
+
+	size_t count = imvlog_count(&log);
+
+	imvlog_prefetch(&log, 0, count);
+	imvlog_cursor_init(&cursor, &log);
+
+	for (size_t i = 0; i < count; i++) {
+		if (!imvlog_cursor_read(&cursor, i))
+			break;
+
+		cv_imv imv = imvlog_cursor_frame(&cursor);
+		process_frame(p_state, imv);
+	}
+
+	imvlog_cursor_free(&cursor);
+	imvlog_close(&log);
+
+	return true;
+}
+
+/* Tilt rates [deg/s] of the synthetic flight */
+static double synth_rate_x(int64_t t)
+{
+	return 25.0 * sin(2 * M_PI * 0.7 * t / 1e6);
+}
+
+static double synth_rate_y(int64_t t)
+{
+	return 20.0 * cos(2 * M_PI * 0.45 * t / 1e6);
+}
+
+/* Ground truth of frame k, after the tilt has been compensated */
+static pose_t synth_pose(size_t k)
+{
+	pose_t pose;
+
+	pose.t = 0; /* Set by the caller */
+	pose.valid = true;
+	pose.dx = 6.0 * sin(2 * M_PI * k / 90.0);
+	pose.dy = 4.0 * cos(2 * M_PI * k / 70.0);
+	pose.dr = 0.004 * sin(2 * M_PI * k / 120.0);
+
+	return pose;
+}
+
+/* Vectors that sensors_compensate() turns into the true pose: the block at
+   pos came from R^T (pos - t), shifted by the tilt of the camera. Outliers
+   get a random vector and a higher SAD. */
+static void synth_frame(uint8_t *p_buffer, int mbx, int mby, size_t k,
+			double tilt_x, double tilt_y, double outliers,
+			rng_t *p_rng)
+{
+	cv_imv_t *p_imv = (cv_imv_t *)p_buffer;
+	pose_t pose = synth_pose(k);
+	double c = cos(pose.dr);
+	double s = sin(pose.dr);
+
+	/* f / (b*s), as in sensors_compensate() */
+	double corr_x = 531.9335 * tan(M_PI * tilt_x / 180.0);
+	double corr_y = 531.9335 * tan(M_PI * tilt_y / 180.0);
+
+	memset(p_buffer, 0, (mbx+1) * mby * sizeof(cv_imv_t));
+
+	for (int j = 0; j < mby; j++) {
+		for (int i = 0; i < mbx; i++) {
+			cv_imv_t *p_vec = p_imv + (i+(mbx+1)*j);
+			double x = i*16 + 8;
+			double y = j*16 + 8;
+
+			if (rng_uniform(p_rng, 0, 1000) < outliers * 1000) {
+				p_vec->x = rng_uniform(p_rng, -32, 33);
+				p_vec->y = rng_uniform(p_rng, -32, 33);
+				p_vec->sad = rng_uniform(p_rng, 1000, 4000);
+				continue;
+			}
+
+			double px = c*(x - pose.dx) + s*(y - pose.dy);
+			double py = -s*(x - pose.dx) + c*(y - pose.dy);
+
+			p_vec->x = lrint(px - x + corr_x);
+			p_vec->y = lrint(py - y - corr_y);
+			p_vec->sad = rng_uniform(p_rng, 100, 800);
+		}
+	}
+}
+
+static void run_synthetic(bench_state_t *p_state, size_t frames, int width,
+			  int height, double outliers, vector<pose_t> *p_truth)
+{
+	int mbx = (width + 15) / 16;
+	int mby = (height + 15) / 16;
+	vector<uint8_t> buf((mbx+1) * mby * sizeof(cv_imv_t));
+	rng_t rng;
+
+	rng_seed(&rng, m_seed, 0);
+
+	/* Non-zero start, 0 means "no previous frame" */
+	int64_t t0 = 1000000;
+	int64_t t_end = t0 + (int64_t)(frames + 1) * SYNTH_PERIOD;
+
+	for (int64_t t = t0 - SYNTH_PERIOD; t <= t_end; t += SYNTH_GYRO_PERIOD) {
+		tracks_gyro_t g = { t, (float)synth_rate_x(t),
+				    (float)synth_rate_y(t), 0 };
+		p_state->tracks.gyro.push_back(g);
+	}
+	for (int64_t t = t0 - SYNTH_PERIOD; t <= t_end; t += SYNTH_SONAR_PERIOD) {
+		tracks_sonar_t d = { t, SYNTH_DISTANCE };
+		p_state->tracks.sonar.push_back(d);
+	}
+
+	p_state->motion.gyro_integrate = tracks_gyro_integrate;
+	p_state->motion.p_gyro_arg = &p_state->tracks;
+
+	for (size_t k = 0; k < frames; k++) {
+		int64_t t = t0 + (int64_t)k * SYNTH_PERIOD;
+		double tilt_x = 0, tilt_y = 0, tilt_z;
+
+		/* The tilt the estimator will take out, integrated the same
+		   way (nothing to compensate on the first frame) */
+		if (k > 0)
+			tracks_gyro_integrate(&p_state->tracks, t - SYNTH_PERIOD,
+					      t, &tilt_x, &tilt_y, &tilt_z);
+
+		synth_frame(&buf[0], mbx, mby, k, tilt_x, tilt_y, outliers, &rng);
+		pose_t truth = synth_pose(k);
+		truth.t = t;
+		p_truth->push_back(truth);
+
+		cv_imv imv(&buf[0], mbx, mby, t, false);
+		process_frame(p_state, imv);
+	}
+}
+
+static bool load_trajectory(const char *p_path, vector<pose_t> *p_trajectory)
+{
+	FILE *p_file = fopen(p_path, "r");
+	if (p_file == NULL) {
+		ERR("Can't open " << p_path);
+		return false;
+	}
+
+	char line[256];
+	while (fgets(line, sizeof(line), p_file) != NULL) {
+		size_t frame;
+		int valid;
+		double t_s;
+		pose_t pose;
+
+		/* Also skips the header */
+		if (sscanf(line, "%zu,%lf,%lf,%lf,%lf,%d", &frame, &t_s, &pose.dx,
+			   &pose.dy, &pose.dr, &valid) != 6)
+			continue;
+
+		pose.t = llrint(t_s * 1e6);
+		pose.valid = (valid != 0);
+		if (frame >= p_trajectory->size())
+			p_trajectory->resize(frame + 1, pose_t());
+		(*p_trajectory)[frame] = pose;
+	}
+
+	fclose(p_file);
+
+	return true;
+}
+
+static bool save_trajectory(const char *p_path, const vector<pose_t>& trajectory)
+{
+	FILE *p_file = fopen(p_path, "w");
+	if (p_file == NULL) {
+		ERR("Can't create " << p_path);
+		return false;
+	}
+
+	fprintf(p_file, "frame,t_s,dx_px,dy_px,dr_rad,valid\n");
+	for (size_t i = 0; i < trajectory.size(); i++) {
+		const pose_t& p = trajectory[i];
+		fprintf(p_file, "%zu,%.6f,%.6f,%.6f,%.8f,%d\n", i,
+			p.t / 1e6, p.dx, p.dy, p.dr, p.valid ? 1 : 0);
+	}
+
+	fclose(p_file);
+
+	return true;
+}
+
+static accuracy_t compare(const vector<pose_t>& trajectory,
+			  const vector<pose_t>& reference)
+{
+	accuracy_t acc;
+
+	memset(&acc, 0, sizeof(acc));
+
+	for (size_t i = 0; i < reference.size(); i++) {
+		if (!reference[i].valid)
+			continue;
+
+		if (i >= trajectory.size() || !trajectory[i].valid) {
+			acc.missing++;
+			continue;
+		}
+
+		double ex = trajectory[i].dx - reference[i].dx;
+		double ey = trajectory[i].dy - reference[i].dy;
+		double er = trajectory[i].dr - reference[i].dr;
+
+		acc.rms_dx += ex*ex;
+		acc.rms_dy += ey*ey;
+		acc.rms_dr += er*er;
+		acc.max_dxy = max(acc.max_dxy, sqrt(ex*ex + ey*ey));
+		acc.count++;
+	}
+
+	if (acc.count > 0) {
+		acc.rms_dx = sqrt(acc.rms_dx / acc.count);
+		acc.rms_dy = sqrt(acc.rms_dy / acc.count);
+		acc.rms_dr = sqrt(acc.rms_dr / acc.count);
+	}
+
+	return acc;
+}
+
+/* [us] */
+static double percentile(const vector<int64_t>& sorted, double p)
+{
+	if (sorted.empty())
+		return 0;
+
+	size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+	return sorted[i] / 1000.0;
+}
+
+/* The output is flat enough that a key lookup will do */
+static bool json_number(const string& text, const char *p_key, double *p_value)
+{
+	string key = string("\"") + p_key + "\": ";
+	size_t pos = text.find(key);
+	if (pos == string::npos)
+		return false;
+
+	const char *p_start = text.c_str() + pos + key.size();
+	char *p_end;
+	*p_value = strtod(p_start, &p_end);
+
+	return p_end != p_start;
+}
+
+/* Number of regressions against the baseline, reported on stderr */
+static int gate(const char *p_path, const string& result, double tol)
+{
+	FILE *p_file = fopen(p_path, "r");
+	if (p_file == NULL) {
+		ERR("Can't open " << p_path);
+		return 1;
+	}
+
+	string baseline;
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), p_file)) > 0)
+		baseline.append(buf, n);
+	fclose(p_file);
+
+	static const struct {
+		const char *p_key;
+		int sign; /* +1: higher is better */
+		double eps;
+	} checks[] = {
+		{ "frames_per_s", 1, 0 },
+		{ "p50_us", -1, 0 },
+		{ "p99_us", -1, 0 },
+		{ "rms_dx_px", -1, GATE_EPS_PX },
+		{ "rms_dy_px", -1, GATE_EPS_PX },
+		{ "rms_dr_rad", -1, GATE_EPS_RAD },
+		{ "missing", -1, 0 },
+	};
+
+	int regressions = 0;
+
+	for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+		double base, now;
+		bool in_base = json_number(baseline, checks[i].p_key, &base);
+		bool in_result = json_number(result, checks[i].p_key, &now);
+
+		/* Neither has it (e.g. no accuracy without ref=): nothing to
+		   compare. A metric only one side has can't pass the gate. */
+		if (!in_base && !in_result)
+			continue;
+		if (!in_base || !in_result) {
+			fprintf(stderr, "%-14s missing in the %s REGRESSION\n",
+				checks[i].p_key, in_base ? "result" : "baseline");
+			regressions++;
+			continue;
+		}
+
+		bool worse;
+		if (checks[i].sign > 0)
+			worse = now < base * (1 - tol/100) - checks[i].eps;
+		else
+			worse = now > base * (1 + tol/100) + checks[i].eps;
+
+		fprintf(stderr, "%-14s %12.4f -> %12.4f %s\n", checks[i].p_key,
+			base, now, worse ? "REGRESSION" : "ok");
+
+		if (worse)
+			regressions++;
+	}
+
+	return regressions;
+}
+
+int main(int argc, char **argv)
+{
+	const char *p_ref = NULL;
+	const char *p_save = NULL;
+	const char *p_baseline = NULL;
+	size_t frames = SYNTH_FRAMES;
+	int width = SYNTH_WIDTH;
+	int height = SYNTH_HEIGHT;
+	double outliers = SYNTH_OUTLIERS;
+	double tol = DEFAULT_TOL;
+	bool parallel = true;
+	int prefilter = 0;
+	transform_params_t params;
+
+	transform_get_params(&params);
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <log.imv>|synth [ref=<csv>] "
+			"[save=<csv>] [baseline=<json>] [tol=<%%>] [seed=<n>] "
+			"[parallel=0|1] [frames=<n>] [size=<w>x<h>] "
+			"[outliers=<ratio>] [prefilter=<px>] [ransac_niter=<n>] "
+			"[irls_niter=<n>]\n", argv[0]);
+		return 1;
+	}
+
+	for (int i = 2; i < argc; i++) {
+		if (strncmp("ref=", argv[i], 4) == 0)
+			p_ref = argv[i]+4;
+		else if (strncmp("save=", argv[i], 5) == 0)
+			p_save = argv[i]+5;
+		else if (strncmp("baseline=", argv[i], 9) == 0)
+			p_baseline = argv[i]+9;
+		else if (strncmp("tol=", argv[i], 4) == 0)
+			tol = atof(argv[i]+4);
+		else if (strncmp("seed=", argv[i], 5) == 0)
+			m_seed = strtoull(argv[i]+5, NULL, 0);
+		else if (strncmp("parallel=", argv[i], 9) == 0)
+			parallel = atoi(argv[i]+9) != 0;
+		else if (strncmp("frames=", argv[i], 7) == 0)
+			frames = strtoul(argv[i]+7, NULL, 0);
+		else if (strncmp("size=", argv[i], 5) == 0)
+			sscanf(argv[i]+5, "%dx%d", &width, &height);
+		else if (strncmp("outliers=", argv[i], 9) == 0)
+			outliers = atof(argv[i]+9);
+		else if (strncmp("prefilter=", argv[i], 10) == 0)
+			prefilter = atoi(argv[i]+10);
+		else if (strncmp("ransac_niter=", argv[i], 13) == 0)
+			params.ransac_niter = atoi(argv[i]+13);
+		else if (strncmp("irls_niter=", argv[i], 11) == 0)
+			params.irls_niter = atoi(argv[i]+11);
+	}
+
+	bool synthetic = (strcmp(argv[1], "synth") == 0);
+
+	bench_state_t state;
+	vector<pose_t> reference;
+
+	transform_set_seed(m_seed);
+	transform_set_params(&params);
+	motion_state_init(&state.motion);
+	state.motion.transform.parallel = parallel;
+	motion_sampling_init(&state.sampling);
+	motion_prefilter_init(&state.prefilter, prefilter);
+	if (prefilter > 0)
+		state.sampling.p_prefilter = &state.prefilter;
+	state.stream.prev_t = 0;
+	tracks_init(&state.tracks);
+	state.busy = 0;
+	state.vec_in = 0;
+	state.vec_good = 0;
+	state.prefilter_checked = 0;
+	state.prefilter_rejected = 0;
+
+	int64_t t1 = nanoseconds();
+
+	if (synthetic) {
+		/* No undistortion: the synthetic camera is ideal */
+		state.latency.reserve(frames);
+		run_synthetic(&state, frames, width, height, outliers, &reference);
+	} else {
+		motion_init();
+		if (!run_imvlog(&state, argv[1]))
+			return 1;
+	}
+
+	int64_t wall = nanoseconds() - t1;
+
+	if (p_ref != NULL) {
+		reference.clear();
+		if (!load_trajectory(p_ref, &reference))
+			return 1;
+	}
+
+	if (p_save != NULL && !save_trajectory(p_save, state.trajectory))
+		return 1;
+
+	size_t count = state.trajectory.size();
+	if (count == 0) {
+		fprintf(stderr, "No frames processed\n");
+		return 1;
+	}
+
+	vector<int64_t> sorted = state.latency;
+	sort(sorted.begin(), sorted.end());
+
+	char buf[1024];
+	string result;
+
+	snprintf(buf, sizeof(buf),
+		 "{\n  \"input\": \"%s\",\n  \"seed\": %llu,\n"
+		 "  \"parallel\": %s,\n  \"ransac_niter\": %d,\n"
+		 "  \"irls_niter\": %d,\n  \"frames\": %zu,\n"
+		 "  \"frames_per_s\": %.1f,\n  \"wall_frames_per_s\": %.1f,\n"
+		 "  \"vectors_per_frame\": %.1f,\n  \"inlier_ratio\": %.4f,\n"
+		 "  \"prefilter_reject_ratio\": %.4f,\n",
+		 synthetic ? "synthetic" : argv[1], (unsigned long long)m_seed,
+		 parallel ? "true" : "false", params.ransac_niter,
+		 params.irls_niter, count,
+		 count / (state.busy / 1e9), count / (wall / 1e9),
+		 (double)state.vec_in / count,
+		 state.vec_in > 0 ? (double)state.vec_good / state.vec_in : 0.0,
+		 state.prefilter_checked > 0 ?
+		 (double)state.prefilter_rejected / state.prefilter_checked : 0.0);
+	result += buf;
+
+	snprintf(buf, sizeof(buf),
+		 "  \"latency\": {\"p50_us\": %.1f, \"p90_us\": %.1f, "
+		 "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f},\n",
+		 percentile(sorted, 0.5), percentile(sorted, 0.9),
+		 percentile(sorted, 0.99), percentile(sorted, 0.999),
+		 sorted.back() / 1000.0);
+	result += buf;
+
+	if (!reference.empty()) {
+		accuracy_t acc = compare(state.trajectory, reference);
+
+		snprintf(buf, sizeof(buf),
+			 "  \"accuracy\": {\"frames\": %zu, \"missing\": %zu, "
+			 "\"rms_dx_px\": %.4f, \"rms_dy_px\": %.4f, "
+			 "\"rms_dr_rad\": %.6f, \"max_dxy_px\": %.4f}\n}\n",
+			 acc.count, acc.missing, acc.rms_dx, acc.rms_dy,
+			 acc.rms_dr, acc.max_dxy);
+	} else {
+		snprintf(buf, sizeof(buf), "  \"accuracy\": null\n}\n");
+	}
+	result += buf;
+
+	fputs(result.c_str(), stdout);
+
+	if (p_baseline != NULL) {
+		int regressions = gate(p_baseline, result, tol);
+		if (regressions > 0) {
+			fprintf(stderr, "%d regression(s) beyond %.1f %%\n",
+				regressions, tol);
+			return 2;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,256 @@
+/* Stand-in for the flight controller on the serial MAVLink link: opens a
+   pseudo-terminal, prints its path for flowberry's serial=<device> and counts
+   the MAVLink frames that arrive, once a second. A pseudo-terminal has no
+   baud rate, so it is read no faster than baud=<n> would shift the bytes
+   out, and the writer's buffer fills like a UART's. stall=<ms> stops reading
+   for that long every second, like a busy autopilot. With "self" it also
+   feeds the terminal through mavserial itself at rate=<Hz> and reports what
+   was dropped and the wire latency. Frames are checked by their framing and
+   sequence numbers only, not by CRC; garbage bytes mean truncated frames. */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "common.h"
+#include "mavserial.h"
+
+#define MAVLINK_STX		0xfe
+#define MAVLINK_FRAME_EXTRA	8 /* Header and CRC */
+#define MAVLINK_MSG_ID_OPTICAL_FLOW	100
+#define MAVLINK_MSG_ID_OPTICAL_FLOW_RAD	106
+
+using namespace std;
+
+typedef struct {
+	atomic<unsigned long> frames;
+	atomic<unsigned long> bytes;
+	atomic<unsigned long> lost; /* Sequence numbers skipped */
+	atomic<unsigned long> garbage; /* Bytes outside of frames */
+} rx_stats_t;
+
+static int m_master = -1;
+static int m_stall_ms;
+static int m_baud = 921600;
+static rx_stats_t m_rx;
+
+static void sleep_until(int64_t t_us)
+{
+	struct timespec ts;
+	ts.tv_sec = t_us / 1000000;
+	ts.tv_nsec = (t_us % 1000000) * 1000;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* Consumes the complete frames at the start of the buffer, returns the
+   number of bytes used */
+static int parse(const uint8_t *p_buf, int len, int *p_prev_seq)
+{
+	int pos = 0;
+
+	while (pos < len) {
+		if (p_buf[pos] != MAVLINK_STX) {
+			m_rx.garbage++;
+			pos++;
+			continue;
+		}
+
+		if (pos + 2 > len)
+			break;
+
+		int frame_len = p_buf[pos+1] + MAVLINK_FRAME_EXTRA;
+		if (pos + frame_len > len)
+			break;
+
+		int seq = p_buf[pos+2];
+		if (*p_prev_seq >= 0)
+			m_rx.lost += (seq - *p_prev_seq - 1) & 0xff;
+		*p_prev_seq = seq;
+
+		m_rx.frames++;
+		pos += frame_len;
+	}
+
+	return pos;
+}
+
+static void *reader_thread(void *ptr)
+{
+	uint8_t buf[4096];
+	int len = 0;
+	int prev_seq = -1;
+	int64_t t_start = microseconds_monotonic();
+	int64_t t_stall = t_start + 1000000;
+	int64_t consumed = 0;
+
+	while (1) {
+		if (m_stall_ms > 0 && microseconds_monotonic() >= t_stall) {
+			usleep(m_stall_ms * 1000);
+			t_stall += 1000000;
+			/* The line does not catch up on a stall */
+			consumed = (microseconds_monotonic() - t_start) * m_baud / 10 / 1000000;
+		}
+
+		/* Bytes the line could have carried by now (8N1) */
+		int64_t allowed = (microseconds_monotonic() - t_start) * m_baud / 10 /
+				  1000000 - consumed;
+		if (allowed <= 0) {
+			usleep(1000);
+			continue;
+		}
+
+		struct pollfd pfd = { m_master, POLLIN, 0 };
+		if (poll(&pfd, 1, 100) <= 0) {
+			/* Idle line */
+			consumed = (microseconds_monotonic() - t_start) * m_baud / 10 / 1000000;
+			continue;
+		}
+
+		int n = read(m_master, buf + len, min((int64_t)(sizeof(buf) - len), allowed));
+		if (n <= 0)
+			continue;
+
+		consumed += n;
+
+		m_rx.bytes += n;
+		len += n;
+
+		int used = parse(buf, len, &prev_seq);
+		memmove(buf, buf + used, len - used);
+		len -= used;
+	}
+
+	return NULL;
+}
+
+/* MAVLink v1 frame with a zero payload and CRC */
+static int frame_build(uint8_t *p_buf, uint8_t seq, uint8_t msgid, int payload_len)
+{
+	p_buf[0] = MAVLINK_STX;
+	p_buf[1] = payload_len;
+	p_buf[2] = seq;
+	p_buf[3] = 1;
+	p_buf[4] = 42;
+	p_buf[5] = msgid;
+	memset(p_buf + 6, 0, payload_len + 2);
+
+	return payload_len + MAVLINK_FRAME_EXTRA;
+}
+
+int main(int argc, char **argv)
+{
+	bool self = false;
+	int rate = 60; /* [Hz] */
+	int seconds = 10;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp("self", argv[i]) == 0)
+			self = true;
+		else if (strncmp("baud=", argv[i], 5) == 0)
+			m_baud = atoi(argv[i]+5);
+		else if (strncmp("rate=", argv[i], 5) == 0)
+			rate = atoi(argv[i]+5);
+		else if (strncmp("seconds=", argv[i], 8) == 0)
+			seconds = atoi(argv[i]+8);
+		else if (strncmp("stall=", argv[i], 6) == 0)
+			m_stall_ms = atoi(argv[i]+6);
+		else {
+			fprintf(stderr, "Usage: %s [self] [baud=<n>] [rate=<Hz>] "
+				"[seconds=<n>] [stall=<ms>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	m_master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (m_master == -1 || grantpt(m_master) != 0 || unlockpt(m_master) != 0) {
+		perror("posix_openpt");
+		return 1;
+	}
+
+	const char *p_slave = ptsname(m_master);
+	printf("Listening on %s\n", p_slave);
+	fflush(stdout);
+
+	/* Keeps the terminal open while no writer is attached */
+	int slave = open(p_slave, O_RDWR | O_NOCTTY);
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, reader_thread, NULL);
+
+	if (!self) {
+		unsigned long frames0 = 0, lost0 = 0, bytes0 = 0;
+
+		while (1) {
+			sleep(1);
+			unsigned long frames = m_rx.frames, lost = m_rx.lost,
+				      bytes = m_rx.bytes;
+			printf("%lu frames/s, %lu bytes/s, %lu lost, %lu garbage bytes\n",
+			       frames - frames0, bytes - bytes0, lost - lost0,
+			       (unsigned long)m_rx.garbage);
+			fflush(stdout);
+			frames0 = frames;
+			lost0 = lost;
+			bytes0 = bytes;
+		}
+	}
+
+	if (!mavserial_init(p_slave, m_baud)) {
+		fprintf(stderr, "Can't open %s at %d baud\n", p_slave, m_baud);
+		return 1;
+	}
+
+	/* The two messages flowberry sends per frame */
+	uint8_t frames[2][MAVLINK_FRAME_EXTRA + 44];
+	struct iovec iov[2];
+	vector<uint32_t> wire_us;
+	uint8_t seq = 0;
+
+	int64_t t = microseconds_monotonic();
+	int64_t t_end = t + seconds * 1000000LL;
+
+	while (t < t_end) {
+		iov[0].iov_base = frames[0];
+		iov[0].iov_len = frame_build(frames[0], seq++,
+					     MAVLINK_MSG_ID_OPTICAL_FLOW, 26);
+		iov[1].iov_base = frames[1];
+		iov[1].iov_len = frame_build(frames[1], seq++,
+					     MAVLINK_MSG_ID_OPTICAL_FLOW_RAD, 44);
+
+		/* As the serial sink does */
+		uint32_t us;
+		if (mavserial_writev(iov, 2, &us) > 0)
+			wire_us.push_back(us);
+		mavserial_flush(MAVSERIAL_TX_MAX_US / 1000);
+
+		t += 1000000 / rate;
+		sleep_until(t);
+	}
+
+	mavserial_flush(1000);
+	usleep(200000 + MAVSERIAL_TX_MAX_US);
+
+	unsigned long written, dropped, stale;
+	mavserial_stats(&written, &dropped, &stale);
+	sort(wire_us.begin(), wire_us.end());
+
+	printf("messages:            %lu written, %lu dropped (driver full), %lu dropped (backlog)\n",
+	       written, dropped, stale);
+	printf("received:            %lu frames, %lu lost, %lu garbage bytes\n",
+	       (unsigned long)m_rx.frames, (unsigned long)m_rx.lost,
+	       (unsigned long)m_rx.garbage);
+	if (!wire_us.empty())
+		printf("wire latency:        p50 %u us, max %u us\n",
+		       wire_us[wire_us.size()/2], wire_us.back());
+
+	mavserial_close();
+	close(slave);
+
+	return 0;
+}
@@ -0,0 +1,145 @@
+/* Runs the flowberry sensor path (event loop, gyro FIFO readout, sonar
+   parser) against the simulated L3GD20H and HRLV-EZ4 and reports timing,
+   integration accuracy, bus traffic and CPU use. No hardware needed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "common.h"
+#include "evloop.h"
+#include "l3gd20h_sim.h"
+#include "sensors.h"
+#include "sonar_sim.h"
+
+#define FRAME_PERIOD_US		33333
+#define WARMUP_US		500000
+
+typedef struct {
+	unsigned long count;
+	double sum;
+	double max;
+} stat_t;
+
+static void stat_add(stat_t *p_stat, double value)
+{
+	p_stat->count++;
+	p_stat->sum += value;
+	if (value > p_stat->max)
+		p_stat->max = value;
+}
+
+static double stat_mean(stat_t *p_stat)
+{
+	return (p_stat->count > 0) ? p_stat->sum / p_stat->count : 0;
+}
+
+static void sleep_until(int64_t t_us)
+{
+	struct timespec ts;
+	ts.tv_sec = t_us / 1000000;
+	ts.tv_nsec = (t_us % 1000000) * 1000;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static double cpu_seconds(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	int seconds = (argc >= 2) ? atoi(argv[1]) : 10;
+	float rate = (argc >= 3) ? atof(argv[2]) : 30.0f; /* [deg/s] */
+
+	if (seconds <= 0) {
+		fprintf(stderr, "Usage: %s [seconds] [rate_dps]\n", argv[0]);
+		return 1;
+	}
+
+	if (!evloop_init() || !sensors_init(true, true) || !sensors_start() ||
+	    !evloop_start()) {
+		fprintf(stderr, "Can't start the simulated sensors.\n");
+		return 1;
+	}
+
+	l3gd20h_sim_set_rate(rate, -rate/2, 0);
+	l3gd20h_sim_set_noise(0.5f);
+
+	int64_t t = microseconds_monotonic() + WARMUP_US;
+	sleep_until(t);
+
+	unsigned long transactions0, bytes0;
+	l3gd20h_sim_get_stats(&transactions0, &bytes0);
+	double cpu0 = cpu_seconds();
+	int64_t t0 = t;
+	int64_t t_end = t0 + seconds * 1000000LL;
+
+	stat_t read_us = { 0 };
+	stat_t integrate_us = { 0 };
+	stat_t err_deg = { 0 };
+	unsigned long sonar_hits = 0;
+	unsigned long frames = 0;
+	int distance = 1000;
+
+	while (t < t_end) {
+		int64_t t_prev = t;
+		t += FRAME_PERIOD_US;
+		sleep_until(t);
+
+		/* Let the frame "arrive" a bit after the exposure, like MMAL */
+		sleep_until(t + 2000);
+
+		sensors_data_t data;
+		int64_t t1 = microseconds_monotonic();
+		sensors_read(&data);
+		int64_t t2 = microseconds_monotonic();
+		stat_add(&read_us, t2-t1);
+
+		double x, y, z;
+		t1 = microseconds_monotonic();
+		bool ok = sensors_gyro_integrate(t_prev, t, &x, &y, &z);
+		t2 = microseconds_monotonic();
+		stat_add(&integrate_us, t2-t1);
+
+		if (ok)
+			stat_add(&err_deg, fabs(x - rate * FRAME_PERIOD_US / 1e6));
+
+		if (data.sonar.distance_mm == distance)
+			sonar_hits++;
+
+		/* New sonar target every second */
+		if (++frames % 30 == 0) {
+			distance = 500 + (frames / 30 % 10) * 100;
+			sonar_sim_set_distance(distance);
+		}
+	}
+
+	double wall = (microseconds_monotonic() - t0) / 1e6;
+	double cpu = cpu_seconds() - cpu0;
+	unsigned long transactions, bytes;
+	l3gd20h_sim_get_stats(&transactions, &bytes);
+
+	evloop_stop();
+	sensors_stop();
+
+	printf("frames:              %lu\n", frames);
+	printf("sensors_read():      mean %.2f us, max %.0f us\n",
+	       stat_mean(&read_us), read_us.max);
+	printf("gyro_integrate():    mean %.2f us, max %.0f us\n",
+	       stat_mean(&integrate_us), integrate_us.max);
+	printf("integration error:   mean %.4f deg, max %.4f deg per frame\n",
+	       stat_mean(&err_deg), err_deg.max);
+	printf("sonar up to date:    %.1f %% of frames\n",
+	       100.0 * sonar_hits / frames);
+	printf("gyro bus:            %.1f transactions/s, %.1f bytes/s\n",
+	       (transactions - transactions0) / wall, (bytes - bytes0) / wall);
+	printf("CPU:                 %.2f %% of one core\n", 100.0 * cpu / wall);
+
+	return 0;
+}